@@ -0,0 +1,307 @@
+/**
+ * @file usermsg_bench.cc
+ * @brief Microbenchmarks for the message pipeline.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ *
+ * Usage:
+ * @code
+ * usermsg_bench [-n iterations] [filter]
+ * @endcode
+ *
+ * Each case is run once for warm-up and once for measurement;
+ * only cases whose name contains `filter` are run. The output
+ * has one line per case with the time, the number of heap
+ * allocations and the number of allocated bytes per operation.
+ *
+ * The formatters in impl/ write to stderr, so stderr is redirected
+ * to the null device for the duration of the run.
+ */
+
+#include <usermsg/usermsg.h>
+#include <usermsg/usermsgman.h>
+#include <usermsg/usermsgstg.h>
+#include <usermsg/usermsgreader.h>
+#include <usermsg/logmsg.h>
+#include <usermsg/impl/usermsg_impl.h>
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GLIBC__)
+#   include <malloc.h>
+#endif
+
+/*  ALLOCATION COUNTING    ================================================ */
+
+static QAtomicInteger<quint64> alloc_count;
+static QAtomicInteger<quint64> alloc_bytes;
+
+static inline void countAllocation (size_t sz)
+{
+    alloc_count.fetchAndAddRelaxed (1);
+    alloc_bytes.fetchAndAddRelaxed (sz);
+}
+
+#if defined(__GLIBC__)
+
+// Qt containers allocate with malloc(), not with operator new, so
+// the C allocator is interposed as well.
+extern "C" {
+void * __libc_malloc (size_t sz);
+void * __libc_calloc (size_t n, size_t sz);
+void * __libc_realloc (void * p, size_t sz);
+void __libc_free (void * p);
+
+void * malloc (size_t sz)
+{
+    countAllocation (sz);
+    return __libc_malloc (sz);
+}
+
+void * calloc (size_t n, size_t sz)
+{
+    countAllocation (n * sz);
+    return __libc_calloc (n, sz);
+}
+
+// a realloc() that fits in the block it has is not an allocation
+void * realloc (void * p, size_t sz)
+{
+    size_t old_size = p == NULL ? 0 : malloc_usable_size (p);
+    void * result = __libc_realloc (p, sz);
+    if ((result != NULL) && ((result != p) || (sz > old_size))) {
+        countAllocation (sz);
+    }
+    return result;
+}
+
+void free (void * p)
+{
+    __libc_free (p);
+}
+}
+
+#else
+
+void * operator new (size_t sz)
+{
+    countAllocation (sz);
+    void * p = malloc (sz);
+    if (p == NULL)
+        throw std::bad_alloc ();
+    return p;
+}
+
+void operator delete (void * p) noexcept
+{
+    free (p);
+}
+
+#endif // __GLIBC__
+
+/*  HARNESS    ============================================================ */
+
+static const char * name_filter = NULL;
+static int iterations = 100000;
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Runs \p fn for warm-up and then for the measurement and prints
+ * the results.
+ */
+template <typename Fn>
+static void runBench (const char * name, Fn fn, int divider = 1)
+{
+    if ((name_filter != NULL) && (strstr (name, name_filter) == NULL))
+        return;
+
+    int n = iterations / divider;
+    if (n < 1) n = 1;
+
+    // warm-up
+    for (int i = 0; i < n / 10 + 1; ++i) {
+        fn ();
+    }
+
+    quint64 count_start = alloc_count.loadAcquire ();
+    quint64 bytes_start = alloc_bytes.loadAcquire ();
+    QElapsedTimer timer;
+    timer.start ();
+
+    for (int i = 0; i < n; ++i) {
+        fn ();
+    }
+
+    qint64 nsecs = timer.nsecsElapsed ();
+    quint64 count = alloc_count.loadAcquire () - count_start;
+    quint64 bytes = alloc_bytes.loadAcquire () - bytes_start;
+
+    printf ("%-32s %10d %12.1f %12.2f %12.1f\n",
+            name, n,
+            (double)nsecs / n,
+            (double)count / n,
+            (double)bytes / n);
+    fflush (stdout);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static UserMsg sampleMessage (int entries)
+{
+    UserMsg um (QLatin1String ("Benchmark title"));
+    for (int i = 0; i < entries; ++i) {
+        um.addMsg ((UserMsgEntry::Type)(i % 6),
+                   QLatin1String ("A message of typical length, "
+                                  "with a second line\nof text"));
+    }
+    return um;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static QString benchLogFile ()
+{
+    QDir shm ("/dev/shm");
+    if (shm.exists ())
+        return shm.filePath ("usermsg_bench.log");
+    return QDir::temp ().filePath ("usermsg_bench.log");
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void removeLogFiles (const QString & path)
+{
+    foreach (const QString & s_file, UserMsgReader::rotationSet (path)) {
+        QFile::remove (s_file);
+        QFile::remove (UserMsgReader::indexPath (s_file));
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int main (int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp (argv[i], "-n") == 0) && (i + 1 < argc)) {
+            iterations = atoi (argv[++i]);
+        } else {
+            name_filter = argv[i];
+        }
+    }
+
+    if (freopen ("/dev/null", "w", stderr) == NULL) {
+        printf ("Cannot redirect stderr; formatter output will be visible.\n");
+    }
+
+    UserMsgMan::init ();
+    UserMsgMan::setLogFile (QString ());
+
+    printf ("%-32s %10s %12s %12s %12s\n",
+            "case", "ops", "ns/op", "allocs/op", "bytes/op");
+
+    const QString text (QLatin1String ("A message of typical length"));
+    const UserMsg one = sampleMessage (1);
+    const UserMsg small = sampleMessage (4);
+    const UserMsg big = sampleMessage (64);
+
+    // ------------------------------------------------------------
+    {
+        UserMsg um;
+        int added = 0;
+        runBench ("UserMsg::addMsg", [&] () {
+            um.addMsg (UserMsgEntry::UTINFO, text);
+            if (++added == 1024) {
+                um.clear ();
+                added = 0;
+            }
+        });
+    }
+
+    runBench ("UserMsg copy (4 entries)", [&] () {
+        UserMsg copy (small);
+        (void)copy;
+    });
+
+    runBench ("UserMsg copy (64 entries)", [&] () {
+        UserMsg copy (big);
+        (void)copy;
+    }, 10);
+
+    runBench ("UserMsg operator+ chain", [&] () {
+        UserMsg result = small + one + text + small;
+        (void)result;
+    });
+
+    // ------------------------------------------------------------
+    UserMsgMan::enable ();
+    runBench ("UserMsgMan::show enabled", [&] () {
+        UserMsgMan::show (one);
+    });
+
+    UserMsgMan::disable ();
+    runBench ("UserMsgMan::show disabled", [&] () {
+        UserMsgMan::show (one);
+    });
+    UserMsgMan::enable ();
+
+    // ------------------------------------------------------------
+    const QString log_file = benchLogFile ();
+    removeLogFiles (log_file);
+    UserMsgMan::setLogFile (log_file);
+
+    runBench ("_logMessage (1 entry)", [&] () {
+        UserMsgMan::logMessage (one);
+    });
+
+    runBench ("_logMessage (64 entries)", [&] () {
+        UserMsgMan::logMessage (big);
+    }, 64);
+
+    runBench ("LogMsg::msg", [&] () {
+        LogMsg::msg (UserMsgEntry::UTINFO, text);
+    });
+
+    UserMsgMan::setLogFile (QString ());
+    removeLogFiles (log_file);
+
+    // ------------------------------------------------------------
+    runBench ("showUserMsgUser (4 entries)", [&] () {
+        showUserMsgUser (small);
+    });
+
+    runBench ("showUserMsgJson (4 entries)", [&] () {
+        showUserMsgJson (small);
+    });
+
+    runBench ("showUserMsgXml (4 entries)", [&] () {
+        showUserMsgXml (small);
+    });
+
+    // ------------------------------------------------------------
+    {
+        UserMsgStg stg;
+        stg.setLogFile (log_file);
+        const QByteArray serialized = stg.toByteArray ();
+        runBench ("UserMsgStg::fromByteArray", [&] () {
+            QByteArray input (serialized);
+            UserMsgStg parsed;
+            parsed.fromByteArray (&input);
+        });
+    }
+
+    UserMsgMan::end ();
+    return 0;
+}
+/* ========================================================================= */
@@ -0,0 +1,331 @@
+/**
+ * @file usermsg_stress.cc
+ * @brief Multi-threaded stress harness for UserMsgMan.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ *
+ * Usage:
+ * @code
+ * usermsg_stress [-t threads] [-n messages-per-thread]
+ * @endcode
+ *
+ * Producer threads call UserMsgMan::show() and LogMsg::msg() while
+ * other threads keep switching the manager between enabled and
+ * disabled mode, alternate the log file between two paths
+ * and replace the settings. At the end each shown message must have
+ * reached the callback exactly once and each logged message must
+ * be present exactly once in the two log files.
+ *
+ * Before that a deterministic check queues messages in disabled mode,
+ * from the main thread and from a thread that exits before the
+ * queue is drained, and expects enable() to present all of them,
+ * once and in the order in which they were shown.
+ *
+ * The program exits with a non-zero code if a message was lost or
+ * duplicated. Configure with `-DUSERMSG_SANITIZE=thread` to run it
+ * under ThreadSanitizer.
+ */
+
+#include <usermsg/usermsg.h>
+#include <usermsg/usermsgman.h>
+#include <usermsg/usermsgstg.h>
+#include <usermsg/logmsg.h>
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int thread_count = 8;
+static int message_count = 20000;
+
+//! one counter for each message that is shown (thread * count + index)
+static QAtomicInt * shown_counters = NULL;
+
+//! set once all producers are done
+static QAtomicInt producers_done;
+
+static QString log_file_a;
+static QString log_file_b;
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Messages have the form `stress <kind> <thread> <index>`.
+ */
+static bool parseMarker (
+        const QString & text, const char * kind, int * thread, int * index)
+{
+    QByteArray ba = text.toLatin1 ();
+    char found [16];
+    if (sscanf (ba.constData (), "stress %15s %d %d",
+                found, thread, index) != 3)
+        return false;
+    if (strcmp (found, kind) != 0)
+        return false;
+    return (*thread >= 0) && (*thread < thread_count) &&
+            (*index >= 0) && (*index < message_count);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void countShown (const UserMsg & um)
+{
+    int thread, index;
+    for (int i = 0; i < um.count (); ++i) {
+        if (parseMarker (um.at (i).message (), "show", &thread, &index)) {
+            shown_counters[thread * message_count + index].fetchAndAddRelaxed (1);
+        }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+class Producer : public QThread {
+public:
+    int id_;
+
+    void run () {
+        for (int i = 0; i < message_count; ++i) {
+            UserMsg um;
+            um.addInfo (QString ("stress show %1 %2").arg (id_).arg (i));
+            UserMsgMan::show (um);
+            LogMsg::info (QString ("stress log %1 %2").arg (id_).arg (i));
+        }
+    }
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+class Toggler : public QThread {
+public:
+    int kind_;
+
+    void run () {
+        int i = 0;
+        while (!producers_done.loadAcquire ()) {
+            switch (kind_) {
+            case 0: {
+                UserMsgMan::disable ();
+                QThread::yieldCurrentThread ();
+                UserMsgMan::enable ((i % 2) == 0);
+                break; }
+            case 1: {
+                UserMsgMan::setLogFile ((i % 2) == 0 ? log_file_a : log_file_b);
+                break; }
+            default: {
+                UserMsgStg stg;
+                stg.setOldLogFilesCount (1000);
+                stg.setMaxLogFileSize (1024*1024*1024);
+                stg.setLogFile ((i % 2) == 0 ? log_file_a : log_file_b);
+                UserMsgMan::setSettings (stg);
+                UserMsgMan::setVisible (UserMsgEntry::UTDBG_INFO, (i % 2) == 0);
+                break; }
+            }
+            ++i;
+        }
+    }
+};
+/* ========================================================================= */
+
+//! the messages presented during checkQueue(), in order
+static QStringList queue_seen;
+
+/* ------------------------------------------------------------------------- */
+static void collectShown (const UserMsg & um)
+{
+    for (int i = 0; i < um.count (); ++i) {
+        queue_seen.append (um.at (i).message ());
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Shows one message and exits, leaving its queue to the manager.
+class OneShot : public QThread {
+public:
+    void run () {
+        UserMsg um;
+        um.addInfo ("queue 2");
+        UserMsgMan::show (um);
+    }
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Queues messages in disabled mode and drains them with enable().
+ *
+ * @return the number of errors
+ */
+static int checkQueue ()
+{
+    UserMsgMan::init (true);
+    UserMsgMan::setCallbackShow (collectShown);
+
+    QStringList expected;
+    for (int i = 0; i < 4; ++i) {
+        QString text = QString ("queue %1").arg (i);
+        expected.append (text);
+        if (i == 2) {
+            OneShot t;
+            t.start ();
+            t.wait ();
+        } else {
+            UserMsg um;
+            um.addInfo (text);
+            UserMsgMan::show (um);
+        }
+    }
+
+    int errors = 0;
+    if (!queue_seen.isEmpty ()) {
+        printf ("queue: %d messages shown in disabled mode\n",
+                queue_seen.count ());
+        ++errors;
+    }
+    UserMsgMan::enable ();
+    if (queue_seen != expected) {
+        printf ("queue: expected <%s>, got <%s>\n",
+                qPrintable(expected.join (", ")),
+                qPrintable(queue_seen.join (", ")));
+        ++errors;
+    }
+    if (!UserMsgMan::isEnabled ()) {
+        printf ("queue: the manager was not enabled\n");
+        ++errors;
+    }
+
+    UserMsgMan::end ();
+    return errors;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Counts the occurences of each logged message in a file.
+ */
+static void countLogged (const QString & path, QVector<int> & counters)
+{
+    QFile f (path);
+    if (!f.open (QIODevice::ReadOnly | QIODevice::Text))
+        return;
+    int thread, index;
+    while (!f.atEnd ()) {
+        QString line = QString::fromUtf8 (f.readLine ());
+        int pos = line.indexOf (QLatin1String ("stress log "));
+        if (pos < 0)
+            continue;
+        if (parseMarker (line.mid (pos), "log", &thread, &index)) {
+            counters[thread * message_count + index]++;
+        }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static int report (const char * what, const QVector<int> & counters)
+{
+    int lost = 0;
+    int duplicated = 0;
+    foreach (int c, counters) {
+        if (c == 0) ++lost;
+        else if (c > 1) ++duplicated;
+    }
+    printf ("%-8s %10d messages %8d lost %8d duplicated\n",
+            what, counters.count (), lost, duplicated);
+    return lost + duplicated;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int main (int argc, char *argv[])
+{
+    for (int i = 1; i < argc - 1; ++i) {
+        if (strcmp (argv[i], "-t") == 0) {
+            thread_count = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "-n") == 0) {
+            message_count = atoi (argv[++i]);
+        }
+    }
+    if ((thread_count < 1) || (message_count < 1)) {
+        printf ("Invalid arguments.\n");
+        return 2;
+    }
+
+    if (checkQueue () != 0) {
+        return 1;
+    }
+
+    QDir tmp = QDir::temp ();
+    log_file_a = tmp.filePath ("usermsg_stress_a.log");
+    log_file_b = tmp.filePath ("usermsg_stress_b.log");
+    QFile::remove (log_file_a);
+    QFile::remove (log_file_b);
+
+    const int total = thread_count * message_count;
+    shown_counters = new QAtomicInt [total];
+
+    UserMsgMan::init ();
+    UserMsgStg stg;
+    stg.setOldLogFilesCount (1000);
+    stg.setMaxLogFileSize (1024*1024*1024);
+    UserMsgMan::setSettings (stg);
+    UserMsgMan::setLogFile (log_file_a);
+    UserMsgMan::setCallbackShow (countShown);
+
+    QVector<Toggler*> togglers;
+    for (int k = 0; k < 3; ++k) {
+        Toggler * t = new Toggler ();
+        t->kind_ = k;
+        togglers.append (t);
+        t->start ();
+    }
+
+    QVector<Producer*> producers;
+    for (int i = 0; i < thread_count; ++i) {
+        Producer * p = new Producer ();
+        p->id_ = i;
+        producers.append (p);
+        p->start ();
+    }
+
+    foreach (Producer * p, producers) {
+        p->wait ();
+        delete p;
+    }
+    producers_done.storeRelease (1);
+    foreach (Toggler * t, togglers) {
+        t->wait ();
+        delete t;
+    }
+
+    // deliver anything that is still cached and close the log
+    UserMsgMan::enable ();
+    UserMsgMan::end ();
+
+    QVector<int> shown (total, 0);
+    for (int i = 0; i < total; ++i) {
+        shown[i] = shown_counters[i].loadAcquire ();
+    }
+    delete [] shown_counters;
+
+    QVector<int> logged (total, 0);
+    countLogged (log_file_a, logged);
+    countLogged (log_file_b, logged);
+
+    int errors = report ("shown", shown) + report ("logged", logged);
+
+    QFile::remove (log_file_a);
+    QFile::remove (log_file_b);
+    return errors == 0 ? 0 : 1;
+}
+/* ========================================================================= */
@@ -10,12 +10,14 @@
 #include "../usermsg.h"
 #include "../usermsg-private.h"
 #include "../usermsgman.h"
+#include "../usermsgtime.h"
 #include "usermsg_impl.h"
 
 #include <QDebug>
 #include <QFile>
 #include <QDateTime>
 #include <QTextStream>
+#include <QtNumeric>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -49,15 +51,40 @@ static QString escapeForJson (const QString & input)
     return result;
 }
 
-static QString dateForJson (const QDateTime & input)
+static void fieldsForJson (QTextStream & d, const UserMsgEntry & e)
 {
-    return input.toString (Qt::ISODate);
+    d << ",\"fields\":{";
+    bool first = true;
+    foreach(const UserMsgEntry::Field & f, e.fields ()) {
+        if (!first) d << ",";
+        first = false;
+        d << "\"" << escapeForJson (QLatin1String (f.key)) << "\":";
+        switch (f.kind) {
+        case UserMsgEntry::FSTRING: {
+            d << "\"" << escapeForJson (f.text) << "\"";
+            break; }
+        case UserMsgEntry::FDOUBLE: {
+            if (qIsFinite (f.value.d)) d << f.toString ();
+            else d << "null";
+            break; }
+        default: {
+            d << f.toString ();
+            break; }
+        }
+    }
+    d << "}";
+}
+
+static QLatin1String dateForJson (const QDateTime & input, char * buffer)
+{
+    return QLatin1String (buffer, UserMsgTime::formatIso (input, buffer));
 }
 
 void USERMSG_EXPORT showUserMsgJson (const UserMsg & um)
 {
 
     QTextStream d (stderr, QIODevice::WriteOnly);
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
     int i_max = um.count ();
     if (i_max > 0) {
         d << "{"
@@ -92,8 +119,11 @@ void USERMSG_EXPORT showUserMsgJson (const UserMsg & um)
                     d << "\"type\":null,";
                     break; }
                 }
-                d << "\"moment\":\"" << dateForJson (e.moment ()) << "\",";
+                d << "\"moment\":\"" << dateForJson (e.moment (), date_buffer) << "\",";
                 d << "\"message\":\"" << escapeForJson (e.message ()) << "\"";
+                if (!e.fields ().isEmpty ()) {
+                    fieldsForJson (d, e);
+                }
 
                 d << "}";
             }
@@ -10,6 +10,7 @@
 #include "../usermsg.h"
 #include "../usermsg-private.h"
 #include "../usermsgman.h"
+#include "../usermsgtime.h"
 #include "usermsg_impl.h"
 
 #include <QDebug>
@@ -45,14 +46,15 @@ static QString escapeForUser (const QString & input)
     return result;
 }
 
-static QString dateForUser (const QDateTime & input)
+static QLatin1String dateForUser (const QDateTime & input, char * buffer)
 {
-    return input.toString (Qt::ISODate);
+    return QLatin1String (buffer, UserMsgTime::formatIso (input, buffer));
 }
 
 void USERMSG_EXPORT showUserMsgUser (const UserMsg & um)
 {
     QTextStream d (stderr, QIODevice::WriteOnly);
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
 
     int i_max = um.count ();
     if (i_max > 0) {
@@ -87,10 +89,13 @@ void USERMSG_EXPORT showUserMsgUser (const UserMsg & um)
                     break; }
                 }
                 d << " "
-                  << dateForUser (e.moment ())
+                  << dateForUser (e.moment (), date_buffer)
                   << "> "
-                  << escapeForUser (e.message ())
-                  << "\n";
+                  << escapeForUser (e.message ());
+                if (!e.fields ().isEmpty ()) {
+                    d << " " << e.fieldsText ();
+                }
+                d << "\n";
             }
             //d << "\n";
         }
@@ -10,6 +10,7 @@
 #include "../usermsg.h"
 #include "../usermsg-private.h"
 #include "../usermsgman.h"
+#include "../usermsgtime.h"
 #include "usermsg_impl.h"
 
 #include <QDebug>
@@ -45,15 +46,27 @@ static QString escapeForXml (const QString & input)
     return result;
 }
 
-static QString dateForXml (const QDateTime & input)
+static QLatin1String fieldKindForXml (UserMsgEntry::FieldKind kind)
 {
-    return input.toString (Qt::ISODate);
+    switch (kind) {
+    case UserMsgEntry::FINT64: return QLatin1String ("int64");
+    case UserMsgEntry::FDOUBLE: return QLatin1String ("double");
+    case UserMsgEntry::FSTRING: return QLatin1String ("string");
+    case UserMsgEntry::FBOOL: return QLatin1String ("bool");
+    default: return QLatin1String ("null");
+    }
+}
+
+static QLatin1String dateForXml (const QDateTime & input, char * buffer)
+{
+    return QLatin1String (buffer, UserMsgTime::formatIso (input, buffer));
 }
 
 void USERMSG_EXPORT showUserMsgXml (const UserMsg & um)
 {
     // << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
     QTextStream d (stderr, QIODevice::WriteOnly);
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
 
     int i_max = um.count ();
     if (i_max > 0) {
@@ -61,7 +74,7 @@ void USERMSG_EXPORT showUserMsgXml (const UserMsg & um)
         for (int i = 0; i < i_max; ++i) {
             const UserMsgEntry & e = um.at (i);
             if (e.isEnabled()) {
-                d << "<usermsgentry moment=\"" << dateForXml (e.moment ()) << "\" "
+                d << "<usermsgentry moment=\"" << dateForXml (e.moment (), date_buffer) << "\" "
                   << "type=\"";
 
                 switch (e.type ()) {
@@ -87,8 +100,14 @@ void USERMSG_EXPORT showUserMsgXml (const UserMsg & um)
                     d << "null";
                     break; }
                 }
-                d << "\">" << escapeForXml(e.message ())
-                  << "</usermsgentry>";
+                d << "\">" << escapeForXml(e.message ());
+                foreach(const UserMsgEntry::Field & f, e.fields ()) {
+                    d << "<field key=\"" << escapeForXml (QLatin1String (f.key))
+                      << "\" type=\"" << fieldKindForXml (f.kind) << "\">"
+                      << escapeForXml (f.toString ())
+                      << "</field>";
+                }
+                d << "</usermsgentry>";
             }
         }
         d << "</usermsg>";
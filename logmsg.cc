@@ -36,3 +36,24 @@ void LogMsg::msg (
     um.clear ();
 }
 /* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The name of the category is attached to the entry as
+ * the `category` field.
+ */
+void LogMsg::msg (
+        const UserMsgCat & cat, UserMsgEntry::Type ty,
+        const QString & s_message)
+{
+    if (!cat.isEnabled (ty)) {
+        UserMsgMetrics::countFiltered (ty);
+        return;
+    }
+    static QLatin1String logtitle ("   ");
+    UserMsg um (logtitle);
+    um.addMsg (ty, s_message);
+    um.addField ("category", cat.name ());
+    UserMsgMan::singleton()->_logMessage (um);
+}
+/* ========================================================================= */
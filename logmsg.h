@@ -12,6 +12,7 @@
 
 #include <usermsg/usermsg-config.h>
 #include <usermsg/usermsgentry.h>
+#include <usermsg/usermsgcat.h>
 
 #include <QVector>
 
@@ -71,6 +72,13 @@ public:
             UserMsgEntry::Type ty,
             const QString & s_message);
 
+    //! Show an entry in a category if the category enables its type.
+    static void
+    msg (
+            const UserMsgCat & cat,
+            UserMsgEntry::Type ty,
+            const QString & s_message);
+
 };
 
 #endif // GUARD_LOGMSG_H_INCLUDE
@@ -0,0 +1,212 @@
+/**
+ * @file usermsg_collect.cc
+ * @brief Gathers the entries of UserMsgShmSink rings in a single log.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ *
+ * Usage:
+ * @code
+ * usermsg_collect [-i interval-ms] [-w window-ms] [-n old-logs] [-s max-size] log-file
+ * @endcode
+ *
+ * Every few milliseconds the program looks for the rings created by
+ * UserMsgShmSink in the processes of this host, drains them, sorts
+ * the entries by moment and writes them to the log file through
+ * UserMsgMan, so the output has the usual format, index and
+ * rotation. Each entry gets a `pid` field with the process that
+ * produced it.
+ *
+ * A producer may push an entry some time after its moment, so the
+ * entries younger than the reorder window are held back until the
+ * next drain; the ones from all the rings are then merged in order.
+ * An entry that arrives later than the window is still written, in
+ * the next batch.
+ *
+ * The rings of processes that have exited are removed once they are
+ * empty. The program stops on SIGINT or SIGTERM after a last drain.
+ */
+
+#include <usermsg/usermsg.h>
+#include <usermsg/usermsgman.h>
+#include <usermsg/usermsgstg.h>
+#include <usermsg/usermsgshm.h>
+
+#include <QDateTime>
+#include <QMap>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+#include <algorithm>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! Set by the signal handler.
+static volatile sig_atomic_t stop_requested = 0;
+
+/* ------------------------------------------------------------------------- */
+static void requestStop (int)
+{
+    stop_requested = 1;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! An entry and the process that produced it.
+struct Collected {
+    UserMsgEntry entry; /**< the entry */
+    qint64 pid; /**< the producer */
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static bool collectedBefore (const Collected & a, const Collected & b)
+{
+    return a.entry.moment () < b.entry.moment ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static bool collectedAfter (const QDateTime & watermark, const Collected & c)
+{
+    return watermark < c.entry.moment ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Attaches to the rings that appeared since last call, drains all
+ * of them and forgets the ones whose producer has exited.
+ *
+ * The entries are added to \p pending and those at or before
+ * \p watermark are written; an invalid watermark writes them all.
+ *
+ * @returns the number of entries that were written
+ */
+static int collect (
+        QMap<QString, UserMsgShmRing*> & rings,
+        QVector<Collected> & pending, const QDateTime & watermark)
+{
+    foreach(const QString & s_name, UserMsgShmRing::available ()) {
+        if (rings.contains (s_name))
+            continue;
+        UserMsgShmRing * ring = new UserMsgShmRing ();
+        if (ring->attach (s_name)) {
+            rings.insert (s_name, ring);
+        } else {
+            delete ring;
+        }
+    }
+
+    QVector<UserMsgEntry> entries;
+    QMap<QString, UserMsgShmRing*>::iterator it = rings.begin ();
+    while (it != rings.end ()) {
+        UserMsgShmRing * ring = it.value ();
+        bool alive = ring->isOwnerAlive ();
+        entries.clear ();
+        ring->pop (entries);
+        foreach(const UserMsgEntry & e, entries) {
+            Collected c;
+            c.entry = e;
+            c.pid = ring->ownerPid ();
+            pending.append (c);
+        }
+        if (!alive) {
+            // whatever the producer wrote before exiting was drained above
+            ring->close (true);
+            delete ring;
+            it = rings.erase (it);
+        } else {
+            ++it;
+        }
+    }
+
+    // the entries held back come first, so equal moments keep their order
+    std::stable_sort (pending.begin (), pending.end (), collectedBefore);
+    int count = pending.count ();
+    if (watermark.isValid ()) {
+        count = std::upper_bound (
+                    pending.constBegin (), pending.constEnd (),
+                    watermark, collectedAfter) - pending.constBegin ();
+    }
+    if (count > 0) {
+        UserMsg um (QLatin1String ("   "));
+        for (int i = 0; i < count; ++i) {
+            UserMsgEntry e (pending.at (i).entry);
+            e.addField ("pid", pending.at (i).pid);
+            um.addEntry (e);
+        }
+        UserMsgMan::logMessage (um);
+        pending.remove (0, count);
+    }
+    return count;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int main (int argc, char *argv[])
+{
+    int interval = 50;
+    int window = 500;
+    int old_logs = 10;
+    int max_size = 1024 * 1024 * 10;
+    int i = 1;
+    for (; i < argc - 1; ++i) {
+        if (strcmp (argv[i], "-i") == 0) {
+            interval = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "-w") == 0) {
+            window = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "-n") == 0) {
+            old_logs = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "-s") == 0) {
+            max_size = atoi (argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if ((i != argc - 1) || (interval < 1) || (window < 0) ||
+            (old_logs < 1) || (max_size < 1)) {
+        fprintf (stderr,
+                 "Usage: usermsg_collect [-i interval-ms] [-w window-ms] "
+                 "[-n old-logs] [-s max-size] log-file\n");
+        return 2;
+    }
+    QString log_file = QString::fromLocal8Bit (argv[i]);
+
+    signal (SIGINT, requestStop);
+    signal (SIGTERM, requestStop);
+
+    UserMsgMan::init ();
+    UserMsgStg stg;
+    stg.setOldLogFilesCount (old_logs);
+    stg.setMaxLogFileSize (max_size);
+    UserMsgMan::setSettings (stg);
+    UserMsgMan::setLogFile (log_file);
+
+    QMap<QString, UserMsgShmRing*> rings;
+    QVector<Collected> pending;
+    while (!stop_requested) {
+        QDateTime watermark = QDateTime::currentDateTime ().addMSecs (-window);
+        if (collect (rings, pending, watermark) > 0) {
+            UserMsgMan::rollLogFile ();
+        }
+        QThread::msleep (interval);
+    }
+    collect (rings, pending, QDateTime ());
+
+    foreach(UserMsgShmRing * ring, rings) {
+        if (ring->dropped () > 0) {
+            fprintf (stderr, "%s: %llu entries were dropped\n",
+                     ring->name ().toLocal8Bit ().constData (),
+                     (unsigned long long)ring->dropped ());
+        }
+    }
+    qDeleteAll (rings);
+    UserMsgMan::end ();
+    return 0;
+}
+/* ========================================================================= */
@@ -0,0 +1,93 @@
+/**
+ * @file usermsg_search.cc
+ * @brief Command line front-end for UserMsgSearch.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ *
+ * Usage:
+ * @code
+ * usermsg_search [-j threads] [-from time] [-to time] log-file text
+ * @endcode
+ *
+ * Searches the log file and its rotated siblings (named after the
+ * moment they were rolled, `log-file.20141012153000123`) and prints
+ * the entries whose message contains the text, oldest first. The times use the format of the log
+ * (`2017-02-10T21:37:46`, optionally with milliseconds and zone).
+ */
+
+#include <usermsg/usermsgsearch.h>
+#include <usermsg/usermsgreader.h>
+#include <usermsg/usermsgtime.h>
+
+#include <QDateTime>
+#include <QString>
+#include <QVector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------------- */
+static int usage ()
+{
+    fprintf (stderr,
+             "Usage: usermsg_search [-j threads] [-from time] [-to time] "
+             "log-file text\n");
+    return 2;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static bool parseTime (const char * arg, QDateTime * out)
+{
+    *out = UserMsgReader::parseMoment (arg, (int)strlen (arg));
+    if (!out->isValid ()) {
+        fprintf (stderr, "Invalid time: %s\n", arg);
+        return false;
+    }
+    return true;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int main (int argc, char *argv[])
+{
+    int threads = 0;
+    QDateTime from;
+    QDateTime to;
+    int i = 1;
+    for (; i < argc - 2; ++i) {
+        if (strcmp (argv[i], "-j") == 0) {
+            threads = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "-from") == 0) {
+            if (!parseTime (argv[++i], &from))
+                return 2;
+        } else if (strcmp (argv[i], "-to") == 0) {
+            if (!parseTime (argv[++i], &to))
+                return 2;
+        } else {
+            return usage ();
+        }
+    }
+    if (i != argc - 2)
+        return usage ();
+
+    QString log_file = QString::fromLocal8Bit (argv[argc - 2]);
+    QString text = QString::fromLocal8Bit (argv[argc - 1]);
+
+    QVector<UserMsgEntry> found = UserMsgSearch::search (
+                log_file, text, from, to, threads);
+
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
+    foreach(const UserMsgEntry & e, found) {
+        int len = UserMsgTime::formatIso (e.moment (), date_buffer);
+        printf ("%.*s %s: %s\n",
+                len, date_buffer,
+                e.typeName ().toUtf8 ().constData (),
+                e.message ().toUtf8 ().constData ());
+    }
+    return found.isEmpty () ? 1 : 0;
+}
+/* ========================================================================= */
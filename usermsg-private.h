@@ -18,17 +18,16 @@
 #    define USERMSG_DEBUGM black_hole
 #endif
 
-#if 0
-#    define USERMSG_TRACE_ENTRY printf("USERMSG ENTRY %s in %s[%d]\n", __func__, __FILE__, __LINE__)
+// The scope is recorded from the entry to the end of the enclosing
+// block (see UserMsgTrace), so the exit marker does nothing.
+#if defined(USERMSG_TRACE)
+#    include <usermsg/usermsgtrace.h>
+#    define USERMSG_TRACE_ENTRY UserMsgTraceScope usermsg_trace_scope (Q_FUNC_INFO)
 #else
 #    define USERMSG_TRACE_ENTRY
 #endif
 
-#if 0
-#    define USERMSG_TRACE_EXIT printf("USERMSG EXIT %s in %s[%d]\n", __func__, __FILE__, __LINE__)
-#else
-#    define USERMSG_TRACE_EXIT
-#endif
+#define USERMSG_TRACE_EXIT
 
 
 static inline void black_hole (...)
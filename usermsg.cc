@@ -10,8 +10,14 @@
 #include "usermsg.h"
 #include "usermsg-private.h"
 #include "usermsgman.h"
+#include "usermsgcrash.h"
 
 #include <QVector>
+#include <QObject>
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
 
 /**
  * @class UserMsg
@@ -26,9 +32,7 @@
  * and with a NULL value for user payload.
  */
 UserMsg::UserMsg() :
-    title_(),
-    user_payload_(NULL),
-    message_list_()
+    d_(new UserMsgData ())
 {
     USERMSG_TRACE_ENTRY;
 
@@ -38,34 +42,44 @@ UserMsg::UserMsg() :
 
 /* ------------------------------------------------------------------------- */
 /**
+ * The two instances share the same data until one of them is
+ * modified (copy-on-write), so messages can be passed through
+ * signals, queues and callbacks for the price of a reference count.
+ *
  * This is a bit dangerous as the user pointer is copied
  * without any notice or reference counting. Pointer lifetime
  * must be well understood.
  */
 UserMsg::UserMsg (const UserMsg & other) :
-    title_(other.title_),
-    user_payload_(other.user_payload_),
-    message_list_()
+    d_(other.d_)
 {
     USERMSG_TRACE_ENTRY;
 
-    foreach(const UserMsgEntry & e, other.message_list_) {
-        message_list_.append (UserMsgEntry (e));
-    }
-
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * As with the copy constructor, the data is shared until one of
+ * the instances is modified.
+ */
+UserMsg & UserMsg::operator= (const UserMsg & other)
+{
+    d_ = other.d_;
+    return *this;
+}
+/* ========================================================================= */
+
 /* ------------------------------------------------------------------------- */
 /**
  *
  */
 UserMsg::UserMsg (const QString & title, void * user_data) :
-    title_(title),
-    user_payload_(user_data),
-    message_list_()
+    d_(new UserMsgData ())
 {
+    d_->title_ = title;
+    d_->user_payload_ = user_data;
     USERMSG_TRACE_ENTRY;
 
     USERMSG_TRACE_EXIT;
@@ -112,7 +126,7 @@ void UserMsg::loggit ()
 int UserMsg::errorCount () const
 {
     int result = 0;
-    foreach(const UserMsgEntry & e, message_list_) {
+    foreach(const UserMsgEntry & e, d_->message_list_) {
         result += (e.type() == UserMsgEntry::UTERROR ? 1 : 0);
     }
     return result;
@@ -121,13 +135,138 @@ int UserMsg::errorCount () const
 
 /* ------------------------------------------------------------------------- */
 /**
- * The list is not sorted based on the timestamps.
+ * The list is not sorted based on the timestamps; use appendMerged()
+ * for that.
  */
 void UserMsg::append(const UserMsg & other)
 {
-    foreach(const UserMsgEntry & e, other.message_list_) {
-        message_list_.append (e);
+    foreach(const UserMsgEntry & e, other.d_->message_list_) {
+        d_->message_list_.append (e);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Both lists are expected to be sorted by moment already (which is
+ * the case for entries added with addMsg()), so this is a single
+ * linear pass. For equal moments the entries in this instance
+ * come first.
+ */
+void UserMsg::appendMerged (const UserMsg & other)
+{
+    const QVector<UserMsgEntry> & right = other.d_->message_list_;
+    if (right.isEmpty ())
+        return;
+    if (d_->message_list_.isEmpty () ||
+            !(right.first ().moment () < d_->message_list_.last ().moment ())) {
+        // the common case: other starts after this one ends
+        append (other);
+        return;
+    }
+
+    QVector<UserMsgEntry> left;
+    left.swap (d_->message_list_);
+    d_->message_list_.reserve (left.count () + right.count ());
+
+    int i = 0;
+    int j = 0;
+    while ((i < left.count ()) && (j < right.count ())) {
+        if (right.at (j).moment () < left.at (i).moment ()) {
+            d_->message_list_.append (right.at (j++));
+        } else {
+            d_->message_list_.append (left.at (i++));
+        }
+    }
+    while (i < left.count ()) {
+        d_->message_list_.append (left.at (i++));
+    }
+    while (j < right.count ()) {
+        d_->message_list_.append (right.at (j++));
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsg UserMsg::mergeSorted (const QVector<UserMsg> & list)
+{
+    QVector<const UserMsg *> pointers;
+    pointers.reserve (list.count ());
+    foreach(const UserMsg & um, list) {
+        pointers.append (&um);
+    }
+    return mergeSorted (pointers.constData (), pointers.count ());
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Position inside one of the messages being merged.
+struct UserMsgEntryCursor {
+    const UserMsg * source; /**< the message */
+    int list_index; /**< index of the message in the input */
+    int index; /**< next entry to take */
+};
+
+//! Heap order for cursors; the oldest entry ends up on top.
+static inline bool entryCursorAfter (
+        const UserMsgEntryCursor & a, const UserMsgEntryCursor & b)
+{
+    const QDateTime & ma = a.source->at (a.index).moment ();
+    const QDateTime & mb = b.source->at (b.index).moment ();
+    if (mb < ma) return true;
+    if (ma < mb) return false;
+    return b.list_index < a.list_index;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Each message in the input is expected to have its entries sorted
+ * by moment. The result is produced with a n-way merge, so the cost
+ * is proportional to the number of entries times the logarithm of
+ * the number of messages. For equal moments the order of the input
+ * is preserved.
+ *
+ * The result has no title and no payload.
+ */
+UserMsg UserMsg::mergeSorted (const UserMsg * const * list, int count)
+{
+    UserMsg result;
+
+    QVector<UserMsgEntryCursor> heap;
+    int total = 0;
+    heap.reserve (count);
+    for (int i = 0; i < count; ++i) {
+        int entries = list[i]->count ();
+        if (entries > 0) {
+            UserMsgEntryCursor c = { list[i], i, 0 };
+            heap.append (c);
+            total += entries;
+        }
+    }
+    result.d_->message_list_.reserve (total);
+    std::make_heap (heap.begin (), heap.end (), entryCursorAfter);
+
+    while (heap.count () > 1) {
+        std::pop_heap (heap.begin (), heap.end (), entryCursorAfter);
+        UserMsgEntryCursor & c = heap.last ();
+        result.d_->message_list_.append (c.source->at (c.index));
+        if (++c.index < c.source->count ()) {
+            std::push_heap (heap.begin (), heap.end (), entryCursorAfter);
+        } else {
+            heap.removeLast ();
+        }
     }
+
+    // the last one is copied in bulk
+    if (!heap.isEmpty ()) {
+        const UserMsgEntryCursor & c = heap.first ();
+        for (int i = c.index; i < c.source->count (); ++i) {
+            result.d_->message_list_.append (c.source->at (i));
+        }
+    }
+
+    return result;
 }
 /* ========================================================================= */
 
@@ -139,7 +278,7 @@ void UserMsg::addMsg (
         UserMsgEntry::Type ty, const QString & s_message)
 {
     UserMsgEntry new_value (ty, s_message);
-    message_list_.append (new_value);
+    d_->message_list_.append (new_value);
 }
 /* ========================================================================= */
 
@@ -227,11 +366,23 @@ void UserMsg::msg (
 
 /* ------------------------------------------------------------------------- */
 /**
- * Uses the underlying platform to show the message.
+ * The message is logged as an error and the log is flushed before
+ * the message is printed to the standard error and the program
+ * is aborted. The crash handlers (UserMsgCrash) are removed first,
+ * since the log is already complete.
  */
 void UserMsg::fatalException (const QString & s_message)
 {
-    /** @todo stub */
+    UserMsg um (QObject::tr ("Fatal error"));
+    um.addErr (s_message);
+    UserMsgMan::logMessage (um);
+    UserMsgMan::flush ();
+
+    fprintf (stderr, "FATAL: %s\n", s_message.toLocal8Bit ().constData ());
+    fflush (stderr);
+
+    UserMsgCrash::uninstall ();
+    abort ();
 }
 /* ========================================================================= */
 
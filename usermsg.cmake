@@ -7,6 +7,9 @@ set (USERMSG_DEBUG_MSG OFF)
 # pileInclude() from pile_support.cmake module.
 include(pile_support)
 
+# the directory where this file resides
+set (USERMSG_SOURCE_DIR "${CMAKE_CURRENT_LIST_DIR}")
+
 # initialize this module
 macro    (usermsgInit
           usermsg_use_mode)
@@ -23,6 +26,22 @@ macro    (usermsgInit
         "usermsgentry.h"
         "usermsg.h"
         "logmsg.h"
+        "usermsgtime.h"
+        "usermsghist.h"
+        "usermsgreader.h"
+        "usermsgsearch.h"
+        "usermsgcat.h"
+        "usermsgqt.h"
+        "usermsgcrash.h"
+        "usermsgsink.h"
+        "usermsgshm.h"
+        "usermsgsock.h"
+        "usermsgsync.h"
+        "usermsgmetrics.h"
+        "usermsgtrace.h"
+        "usermsgenc.h"
+        "usermsgasync.h"
+        "usermsgjanitor.h"
         "impl/usermsg_impl.h")
     set(USERMSG_SOURCES
         "usermsgman.cc"
@@ -30,6 +49,22 @@ macro    (usermsgInit
         "usermsgentry.cc"
         "usermsg.cc"
         "logmsg.cc"
+        "usermsgtime.cc"
+        "usermsghist.cc"
+        "usermsgreader.cc"
+        "usermsgsearch.cc"
+        "usermsgcat.cc"
+        "usermsgqt.cc"
+        "usermsgcrash.cc"
+        "usermsgsink.cc"
+        "usermsgshm.cc"
+        "usermsgsock.cc"
+        "usermsgsync.cc"
+        "usermsgmetrics.cc"
+        "usermsgtrace.cc"
+        "usermsgenc.cc"
+        "usermsgasync.cc"
+        "usermsgjanitor.cc"
         "impl/usermsg_json.cc"
         "impl/usermsg_user.cc"
         "impl/usermsg_xml.cc")
@@ -52,3 +87,52 @@ macro    (usermsgInit
         "user-interaction")
 
 endmacro ()
+
+# build the microbenchmarks for the library target usermsg_lib
+macro    (usermsgBench
+          usermsg_lib)
+
+    add_executable(usermsg_bench
+        "${USERMSG_SOURCE_DIR}/bench/usermsg_bench.cc")
+    target_link_libraries(usermsg_bench
+        ${usermsg_lib}
+        Qt5::Core)
+    if (USERMSG_DEBUG_MSG)
+        message (STATUS "usermsg_bench will be build against ${usermsg_lib}")
+    endif ()
+
+endmacro ()
+
+# build the multi-threaded stress harness for the library target usermsg_lib
+macro    (usermsgStress
+          usermsg_lib)
+
+    add_executable(usermsg_stress
+        "${USERMSG_SOURCE_DIR}/bench/usermsg_stress.cc")
+    target_link_libraries(usermsg_stress
+        ${usermsg_lib}
+        Qt5::Core)
+
+endmacro ()
+
+# build the command line tools for the library target usermsg_lib
+macro    (usermsgTools
+          usermsg_lib)
+
+    add_executable(usermsg_search
+        "${USERMSG_SOURCE_DIR}/tools/usermsg_search.cc")
+    target_link_libraries(usermsg_search
+        ${usermsg_lib}
+        Qt5::Core)
+
+    add_executable(usermsg_collect
+        "${USERMSG_SOURCE_DIR}/tools/usermsg_collect.cc")
+    target_link_libraries(usermsg_collect
+        ${usermsg_lib}
+        Qt5::Core)
+    if (UNIX AND NOT APPLE)
+        # shm_open lives in librt on older glibc
+        target_link_libraries(usermsg_collect rt)
+    endif ()
+
+endmacro ()
@@ -13,9 +13,42 @@
 #include <usermsg/usermsg-config.h>
 #include <usermsg/usermsgentry.h>
 
+#include <QSharedData>
+#include <QSharedDataPointer>
 #include <QVector>
 
 
+//! The part of a UserMsg that is shared between its copies.
+class UserMsgData : public QSharedData {
+
+public:
+
+    QString
+    title_; /**< a title for this message */
+
+    void *
+    user_payload_; /**< user defined data that the user sets */
+
+    QVector<UserMsgEntry>
+    message_list_; /**< the list of messages */
+
+    //! Default constructor.
+    UserMsgData () :
+        QSharedData (),
+        title_ (),
+        user_payload_ (NULL),
+        message_list_ ()
+    {}
+
+    //! Copy constructor; used when a shared instance is modified.
+    UserMsgData (
+            const UserMsgData & other) :
+        QSharedData (other),
+        title_ (other.title_),
+        user_payload_ (other.user_payload_),
+        message_list_ (other.message_list_)
+    {}
+};
 
 //! user messages mediator
 class USERMSG_EXPORT UserMsg {
@@ -47,24 +80,23 @@ class USERMSG_EXPORT UserMsg {
 
 private:
 
-    QString
-    title_; /**< a title for this message */
-
-    void *
-    user_payload_; /**< user defined data that the user sets */
-
-    QVector<UserMsgEntry>
-    message_list_; /**< the list of messages */
+    QSharedDataPointer<UserMsgData>
+    d_; /**< the title, the payload and the entries */
 
 public:
 
     //! Default constructor.
     UserMsg ();
 
-    //! Copy constructor.
+    //! Copy constructor; only increments a reference count.
     UserMsg (
             const UserMsg & other);
 
+    //! Assignment operator; only increments a reference count.
+    UserMsg &
+    operator= (
+            const UserMsg & other);
+
     //! Constructor that also sets the title and payload.
     UserMsg (
             const QString & title,
@@ -78,28 +110,28 @@ public:
     //! Get the title.
     const QString &
     title () const {
-        return title_;
+        return d_->title_;
     }
 
     //! Set the title.
     void
     setTitle (
             const QString & value) {
-        title_ = value;
+        d_->title_ = value;
     }
 
 
     //! Get the payload.
     void *
     userData () const {
-        return user_payload_;
+        return d_->user_payload_;
     }
 
     //! Set the payload.
     void
     setUserData (
             void * value) {
-        user_payload_ = value;
+        d_->user_payload_ = value;
     }
 
     //! Show the content of this structure.
@@ -113,7 +145,7 @@ public:
     //! The number of entries in the list.
     int
     count () const {
-        return message_list_.count ();
+        return d_->message_list_.count ();
     }
 
     //! The number of errors in the list.
@@ -123,21 +155,21 @@ public:
     //! Clear all entries from the list.
     void
     clear () {
-        message_list_.clear ();
+        d_->message_list_.clear ();
     }
 
     //! Get an entry at a specific location.
     const UserMsgEntry &
     at (
             int i) const {
-        return message_list_.at (i);
+        return d_->message_list_.at (i);
     }
 
     //! Remove an entry at a specific location.
     void
     remove (
             int i) {
-        message_list_.removeAt (i);
+        d_->message_list_.removeAt (i);
     }
 
     //! Appends all entries in \p other entry to current entry.
@@ -145,6 +177,22 @@ public:
     append (
             const UserMsg & other);
 
+    //! Merges the entries in \p other keeping the list sorted by moment.
+    void
+    appendMerged (
+            const UserMsg & other);
+
+    //! Merges the entries of all messages in a list sorted by moment.
+    static UserMsg
+    mergeSorted (
+            const QVector<UserMsg> & list);
+
+    //! Merges the entries of \p count messages in a list sorted by moment.
+    static UserMsg
+    mergeSorted (
+            const UserMsg * const * list,
+            int count);
+
 
 
     //! Add an error entry to the list.
@@ -195,6 +243,23 @@ public:
             UserMsgEntry::Type ty,
             const QString & s_message);
 
+    //! Add an existing entry to the list.
+    void
+    addEntry (
+            const UserMsgEntry & e) {
+        d_->message_list_.append (e);
+    }
+
+    //! Add a typed field to the last entry in the list.
+    template <typename T>
+    void
+    addField (
+            const char * key,
+            const T & value) {
+        if (!d_->message_list_.isEmpty ())
+            d_->message_list_.last ().addField (key, value);
+    }
+
     //! Adds messages from two instances and deposits them in a new one.
     UserMsg operator+ (const UserMsg & s) const;
     UserMsg & operator+= (const UserMsg & s);
@@ -0,0 +1,714 @@
+/**
+ * @file usermsgasync.cc
+ * @brief Definitions for UserMsgAsyncWriter class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgasync.h"
+#include "usermsgsync.h"
+#include "usermsg-private.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <string.h>
+
+#if defined(Q_OS_UNIX)
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX)
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <sys/uio.h>
+#   include <linux/io_uring.h>
+#   if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+        defined(__NR_io_uring_register)
+#       define USERMSG_HAVE_URING 1
+#   endif
+#endif
+
+/**
+ * @class UserMsgAsyncWriter
+ *
+ * The manager owns one instance and, when UserMsgStg::asyncWrite() is
+ * set, gives it the bytes of each message instead of writing them to
+ * the log file itself (see UserMsgMan::_logMessage()).
+ *
+ * The bytes are copied into one of BUFFER_COUNT buffers. The thread
+ * takes a buffer when it is full or, if the disk is idle, as soon as
+ * it holds anything; while writes are in flight the lines accumulate,
+ * so a slow disk gets fewer and larger writes. A logging thread only
+ * waits when all the buffers are in flight.
+ *
+ * On Linux the buffers are registered with an io_uring instance
+ * (raw system calls; no liburing) and the thread submits all the
+ * ready buffers with one io_uring_enter() that also collects the
+ * completions. Each buffer has its own offset in the file, so the
+ * writes may complete in any order; a short write is resubmitted.
+ * When io_uring is not available (old kernel, seccomp) or it fails,
+ * the thread uses pwrite() instead; the logging threads never call
+ * either.
+ *
+ * When the file is opened with `O_DSYNC` the time each batch takes
+ * to reach the disk is given to UserMsgSync::recordLatency(), as the
+ * logging threads no longer wait for it.
+ *
+ * The file is opened by setFile() without `O_APPEND` and nobody else
+ * may write to it meanwhile. setFile() and the destructor wait for
+ * the writes in flight, so the manager can roll the log files
+ * (UserMsgMan::_logRollFeature()) as usual.
+ *
+ * Only POSIX systems are supported; elsewhere setFile() fails and
+ * the manager writes the log file itself.
+ */
+
+//! An io_uring instance with the rings mapped.
+struct UserMsgRing {
+#if defined(USERMSG_HAVE_URING)
+    int fd; /**< the instance */
+    void * sq_ptr; /**< the submission ring */
+    size_t sq_size; /**< size of sq_ptr */
+    void * cq_ptr; /**< the completion ring; may be sq_ptr */
+    size_t cq_size; /**< size of cq_ptr */
+    struct io_uring_sqe * sqes; /**< the submission entries */
+    size_t sqes_size; /**< size of sqes */
+    unsigned * sq_head; /**< advanced by the kernel */
+    unsigned * sq_tail; /**< advanced by us */
+    unsigned sq_mask; /**< ring index mask */
+    unsigned * sq_array; /**< maps ring slots to entries */
+    unsigned * cq_head; /**< advanced by us */
+    unsigned * cq_tail; /**< advanced by the kernel */
+    unsigned cq_mask; /**< ring index mask */
+    struct io_uring_cqe * cqes; /**< the completion entries */
+    bool fixed; /**< the buffers are registered */
+    struct iovec iov [UserMsgAsyncWriter::BUFFER_COUNT]; /**< the buffers */
+#endif
+};
+
+#if defined(USERMSG_HAVE_URING)
+
+/* ------------------------------------------------------------------------- */
+static void ringDestroy (UserMsgRing * r)
+{
+    if (r->sqes != NULL)
+        munmap (r->sqes, r->sqes_size);
+    if ((r->cq_ptr != NULL) && (r->cq_ptr != r->sq_ptr))
+        munmap (r->cq_ptr, r->cq_size);
+    if (r->sq_ptr != NULL)
+        munmap (r->sq_ptr, r->sq_size);
+    ::close (r->fd);
+    delete r;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void * ringMap (int fd, size_t size, off_t offset)
+{
+    void * p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The buffers are registered if the kernel allows it (the locked
+ * memory limit may not); otherwise each write passes its iovec.
+ *
+ * @returns NULL if io_uring is not available.
+ */
+static UserMsgRing * ringCreate (char ** buffers, int count, int size)
+{
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    int fd = (int)syscall (__NR_io_uring_setup, count, &p);
+    if (fd < 0)
+        return NULL;
+
+    UserMsgRing * r = new UserMsgRing ();
+    memset (r, 0, sizeof(UserMsgRing));
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = false;
+#   if defined(IORING_FEAT_SINGLE_MMAP)
+    single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        r->sq_size = qMax (r->sq_size, r->cq_size);
+        r->cq_size = r->sq_size;
+    }
+#   endif
+    r->sq_ptr = ringMap (fd, r->sq_size, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == NULL) {
+        ringDestroy (r);
+        return NULL;
+    }
+    r->cq_ptr = single ? r->sq_ptr : ringMap (fd, r->cq_size, IORING_OFF_CQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)ringMap (fd, r->sqes_size, IORING_OFF_SQES);
+    if ((r->cq_ptr == NULL) || (r->sqes == NULL)) {
+        ringDestroy (r);
+        return NULL;
+    }
+
+    char * sq = (char*)r->sq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    char * cq = (char*)r->cq_ptr;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    for (int i = 0; i < count; ++i) {
+        r->iov[i].iov_base = buffers[i];
+        r->iov[i].iov_len = size;
+    }
+    r->fixed = (syscall (__NR_io_uring_register, fd,
+                         IORING_REGISTER_BUFFERS, r->iov, count) == 0);
+    return r;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The entry is submitted by the next ringEnter().
+ */
+static void ringPrepare (
+        UserMsgRing * r, int fd, int buffer,
+        const char * data, unsigned len, qint64 offset)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe * sqe = &r->sqes[index];
+    memset (sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = fd;
+    sqe->off = (quint64)offset;
+    sqe->user_data = (quint64)buffer;
+    if (r->fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (quint64)(quintptr)data;
+        sqe->len = len;
+        sqe->buf_index = (quint16)buffer;
+    } else {
+        r->iov[buffer].iov_base = (void*)data;
+        r->iov[buffer].iov_len = len;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (quint64)(quintptr)&r->iov[buffer];
+        sqe->len = 1;
+    }
+    r->sq_array[index] = index;
+    __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Submits the prepared entries and waits for at least one completion.
+ *
+ * @returns false if the instance can no longer be used.
+ */
+static bool ringEnter (UserMsgRing * r)
+{
+    for (;;) {
+        unsigned pending = *r->sq_tail -
+                __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+        int rc = (int)syscall (
+                    __NR_io_uring_enter, r->fd, pending, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc >= 0)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN) || (errno == EBUSY)) {
+            // out of kernel resources; the completions free them
+            QThread::usleep (100);
+            return true;
+        }
+        return false;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static bool ringReap (UserMsgRing * r, int * buffer, int * result)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    struct io_uring_cqe * cqe = &r->cqes[head & r->cq_mask];
+    *buffer = (int)cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n (r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+/* ========================================================================= */
+
+#endif // USERMSG_HAVE_URING
+
+/* ------------------------------------------------------------------------- */
+UserMsgAsyncWriter::UserMsgAsyncWriter (UserMsgSync * sync) :
+    QThread (),
+    mutex_ (),
+    wake_ (),
+    space_ (),
+    idle_ (),
+    fd_ (-1),
+    dsync_ (false),
+    position_ (0),
+    submitted_ (0),
+    stop_ (false),
+    free_ (),
+    ready_ (),
+    current_ (-1),
+    in_flight_ (0),
+    ring_ (NULL),
+    sync_ (sync),
+    batches_ (0),
+    writes_ (0),
+    bytes_ (0),
+    waits_ (0),
+    wait_ns_ (0),
+    errors_ (0)
+{
+    USERMSG_TRACE_ENTRY;
+
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        buffers_[i] = (char*)qMallocAligned (BUFFER_SIZE, 4096);
+        fill_[i] = 0;
+        offset_[i] = 0;
+        done_[i] = 0;
+        in_ring_[i] = false;
+        free_.append (BUFFER_COUNT - 1 - i);
+    }
+#if defined(USERMSG_HAVE_URING)
+    ring_ = ringCreate (buffers_, BUFFER_COUNT, BUFFER_SIZE);
+#endif
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgAsyncWriter::~UserMsgAsyncWriter()
+{
+    USERMSG_TRACE_ENTRY;
+
+    setFile (QString ());
+    mutex_.lock ();
+    stop_ = true;
+    wake_.wakeOne ();
+    mutex_.unlock ();
+    wait ();
+
+#if defined(USERMSG_HAVE_URING)
+    if (ring_ != NULL) {
+        ringDestroy (ring_);
+    }
+#endif
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        qFreeAligned (buffers_[i]);
+    }
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * What was queued for the previous file is written first. The new
+ * file is created if needed and written at its end.
+ *
+ * @returns false if the file could not be opened; the queued bytes
+ * are discarded until a file is set.
+ */
+bool UserMsgAsyncWriter::setFile (const QString & path, bool dsync)
+{
+    USERMSG_TRACE_ENTRY;
+    QMutexLocker locker (&mutex_);
+
+    _drain ();
+#if defined(Q_OS_UNIX)
+    if (fd_ != -1) {
+        ::close (fd_);
+        fd_ = -1;
+    }
+    if (path.isEmpty ()) {
+        USERMSG_TRACE_EXIT;
+        return true;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+#   if defined(O_DSYNC)
+    if (dsync) {
+        flags = flags | O_DSYNC;
+    }
+#   endif
+    int fd = ::open (QFile::encodeName (path).constData (), flags, 0666);
+    if (fd == -1) {
+        USERMSG_TRACE_EXIT;
+        return false;
+    }
+    off_t end = ::lseek (fd, 0, SEEK_END);
+    fd_ = fd;
+    dsync_ = dsync;
+    position_ = (end < 0) ? 0 : end;
+    submitted_ = position_;
+    if (!isRunning ()) {
+        start ();
+    }
+    USERMSG_TRACE_EXIT;
+    return true;
+#else
+    Q_UNUSED(dsync);
+    USERMSG_TRACE_EXIT;
+    return path.isEmpty ();
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgAsyncWriter::isOpen ()
+{
+    QMutexLocker locker (&mutex_);
+    return fd_ != -1;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgAsyncWriter::usesRing ()
+{
+    QMutexLocker locker (&mutex_);
+    return ring_ != NULL;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * This is where the next byte given to write() will land, which is
+ * what the time index of the log file records.
+ */
+qint64 UserMsgAsyncWriter::position ()
+{
+    QMutexLocker locker (&mutex_);
+    return position_;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Waits only if all the buffers are in flight. The manager calls
+ * this under its lock, so a wait also stalls every other thread
+ * that logs; the waits and the time spent in them are counted in
+ * stats().
+ */
+void UserMsgAsyncWriter::write (const char * data, int size)
+{
+    USERMSG_TRACE_ENTRY;
+    QMutexLocker locker (&mutex_);
+    if (fd_ == -1) {
+        USERMSG_TRACE_EXIT;
+        return;
+    }
+
+    position_ += size;
+    while (size > 0) {
+        if (current_ == -1) {
+            if (free_.isEmpty ()) {
+                QElapsedTimer timer;
+                timer.start ();
+                do {
+                    waits_.fetchAndAddRelaxed (1);
+                    wake_.wakeOne ();
+                    space_.wait (&mutex_);
+                } while (free_.isEmpty ());
+                wait_ns_.fetchAndAddRelaxed ((quint64)timer.nsecsElapsed ());
+            }
+            current_ = free_.takeLast ();
+            // an idle thread takes the buffer once we are done
+            wake_.wakeOne ();
+        }
+        int n = qMin (size, BUFFER_SIZE - fill_[current_]);
+        memcpy (buffers_[current_] + fill_[current_], data, n);
+        fill_[current_] += n;
+        data += n;
+        size -= n;
+        if (fill_[current_] == BUFFER_SIZE) {
+            _queueCurrent ();
+            wake_.wakeOne ();
+        }
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgAsyncWriter::flush ()
+{
+    USERMSG_TRACE_ENTRY;
+    QMutexLocker locker (&mutex_);
+    _drain ();
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Async-signal-safe: takes no lock and only calls pwrite(), so the
+ * state it reads may be torn if another thread is using the writer.
+ * Each buffer that holds bytes is written at its offset (the one
+ * being filled goes after the queued ones); a buffer that is already
+ * in flight is written again, with the same bytes.
+ */
+void UserMsgAsyncWriter::dumpPending ()
+{
+#if defined(Q_OS_UNIX)
+    int fd = fd_;
+    if (fd == -1)
+        return;
+    int current = current_;
+    for (int b = 0; b < BUFFER_COUNT; ++b) {
+        int fill = fill_[b];
+        if ((fill <= 0) || (fill > BUFFER_SIZE))
+            continue;
+        qint64 offset = (b == current) ? submitted_ : offset_[b];
+        int done = 0;
+        while (done < fill) {
+            ssize_t n = ::pwrite (fd, buffers_[b] + done,
+                                  fill - done, offset + done);
+            if (n <= 0)
+                break;
+            done += (int)n;
+        }
+    }
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgAsyncStats UserMsgAsyncWriter::stats () const
+{
+    UserMsgAsyncStats result;
+    result.batches = batches_.load ();
+    result.writes = writes_.load ();
+    result.bytes = bytes_.load ();
+    result.waits = waits_.load ();
+    result.wait_ns = wait_ns_.load ();
+    result.errors = errors_.load ();
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @warning The caller must hold the mutex.
+ */
+void UserMsgAsyncWriter::_queueCurrent ()
+{
+    if ((current_ == -1) || (fill_[current_] == 0))
+        return;
+    offset_[current_] = submitted_;
+    submitted_ += fill_[current_];
+    ready_.append (current_);
+    current_ = -1;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @warning The caller must hold the mutex.
+ */
+void UserMsgAsyncWriter::_drain ()
+{
+    _queueCurrent ();
+    while (!ready_.isEmpty () || (in_flight_ > 0)) {
+        wake_.wakeOne ();
+        idle_.wait (&mutex_);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @warning The caller must hold the mutex.
+ */
+void UserMsgAsyncWriter::_complete (int buffer)
+{
+    fill_[buffer] = 0;
+    done_[buffer] = 0;
+    free_.append (buffer);
+    --in_flight_;
+    space_.wakeAll ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The file does not change while buffers are in flight (see
+ * setFile()), so it can be used without the mutex.
+ */
+bool UserMsgAsyncWriter::_writeNow (int buffer, int fd)
+{
+#if defined(Q_OS_UNIX)
+    while (done_[buffer] < fill_[buffer]) {
+        ssize_t n = ::pwrite (
+                    fd, buffers_[buffer] + done_[buffer],
+                    fill_[buffer] - done_[buffer],
+                    offset_[buffer] + done_[buffer]);
+        if (n > 0) {
+            done_[buffer] += (int)n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else {
+            errors_.fetchAndAddRelaxed (1);
+            return false;
+        }
+    }
+    writes_.fetchAndAddRelaxed (1);
+    bytes_.fetchAndAddRelaxed (fill_[buffer]);
+    return true;
+#else
+    Q_UNUSED(buffer);
+    Q_UNUSED(fd);
+    errors_.fetchAndAddRelaxed (1);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A write that the kernel refused is retried with pwrite().
+ *
+ * @returns false if the ring failed; the buffers in it are unfinished.
+ */
+bool UserMsgAsyncWriter::_ringWait (int fd, QVector<int> & finished)
+{
+#if defined(USERMSG_HAVE_URING)
+    if (!ringEnter (ring_))
+        return false;
+
+    int buffer;
+    int result;
+    while (ringReap (ring_, &buffer, &result)) {
+        if ((result == -EINTR) || (result == -EAGAIN)) {
+            result = 0;
+        } else if (result > 0) {
+            done_[buffer] += result;
+        } else {
+            in_ring_[buffer] = false;
+            _writeNow (buffer, fd);
+            finished.append (buffer);
+            continue;
+        }
+        if (done_[buffer] < fill_[buffer]) {
+            ringPrepare (ring_, fd, buffer,
+                         buffers_[buffer] + done_[buffer],
+                         fill_[buffer] - done_[buffer],
+                         offset_[buffer] + done_[buffer]);
+            continue;
+        }
+        in_ring_[buffer] = false;
+        writes_.fetchAndAddRelaxed (1);
+        bytes_.fetchAndAddRelaxed (fill_[buffer]);
+        finished.append (buffer);
+    }
+    return true;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(finished);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A partial buffer is only taken when nothing is in flight, so that
+ * the lines logged while the disk is busy go out together.
+ */
+void UserMsgAsyncWriter::run ()
+{
+    QVector<int> batch;
+    QVector<int> finished;
+
+    mutex_.lock ();
+    for (;;) {
+        if ((in_flight_ == 0) && ready_.isEmpty ()) {
+            _queueCurrent ();
+        }
+        if ((in_flight_ == 0) && ready_.isEmpty ()) {
+            idle_.wakeAll ();
+            if (stop_)
+                break;
+            wake_.wait (&mutex_);
+            continue;
+        }
+        batch = ready_;
+        ready_.clear ();
+        in_flight_ += batch.count ();
+        int fd = fd_;
+        bool measure = dsync_ && (sync_ != NULL);
+        mutex_.unlock ();
+
+        QElapsedTimer timer;
+        if (measure) {
+            timer.start ();
+        }
+        finished.clear ();
+        if (!batch.isEmpty ()) {
+            batches_.fetchAndAddRelaxed (1);
+        }
+        if (ring_ != NULL) {
+#if defined(USERMSG_HAVE_URING)
+            foreach(int b, batch) {
+                in_ring_[b] = true;
+                ringPrepare (ring_, fd, b, buffers_[b], fill_[b], offset_[b]);
+            }
+#endif
+            if (!_ringWait (fd, finished)) {
+                // the writes still in the ring are repeated; writing
+                // the same bytes at the same offset again is harmless
+                UserMsgRing * ring = ring_;
+                mutex_.lock ();
+                ring_ = NULL;
+                mutex_.unlock ();
+#if defined(USERMSG_HAVE_URING)
+                ringDestroy (ring);
+#endif
+                for (int b = 0; b < BUFFER_COUNT; ++b) {
+                    if (in_ring_[b]) {
+                        in_ring_[b] = false;
+                        done_[b] = 0;
+                        _writeNow (b, fd);
+                        finished.append (b);
+                    }
+                }
+            }
+        } else {
+            foreach(int b, batch) {
+                _writeNow (b, fd);
+                finished.append (b);
+            }
+        }
+        if (measure && !finished.isEmpty ()) {
+            // the writes waited for the disk
+            sync_->recordLatency (timer.nsecsElapsed ());
+        }
+
+        mutex_.lock ();
+        foreach(int b, finished) {
+            _complete (b);
+        }
+    }
+    mutex_.unlock ();
+}
+/* ========================================================================= */
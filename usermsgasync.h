@@ -0,0 +1,160 @@
+/**
+ * @file usermsgasync.h
+ * @brief Declarations for UserMsgAsyncWriter class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGASYNC_H_INCLUDE
+#define GUARD_USERMSGASYNC_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+struct UserMsgRing;
+class UserMsgSync;
+
+//! The work done by the background writer.
+struct UserMsgAsyncStats {
+    quint64 batches; /**< calls that submitted writes */
+    quint64 writes; /**< buffers written */
+    quint64 bytes; /**< bytes written */
+    quint64 waits; /**< times a logging thread waited for a free buffer */
+    quint64 wait_ns; /**< time spent in those waits */
+    quint64 errors; /**< writes that failed; their bytes are lost */
+};
+
+//! Writes the log file from a background thread.
+class USERMSG_EXPORT UserMsgAsyncWriter : public QThread {
+
+public:
+
+    enum {
+        //! the number of buffers; at most this many writes are in flight
+        BUFFER_COUNT = 8,
+        //! the size of each buffer
+        BUFFER_SIZE = 64 * 1024
+    };
+
+private:
+
+    QMutex mutex_; /**< protects the members below, up to the statistics */
+    QWaitCondition wake_; /**< wakes the thread */
+    QWaitCondition space_; /**< a buffer was freed */
+    QWaitCondition idle_; /**< everything was written */
+    int fd_; /**< the file; -1 if none */
+    bool dsync_; /**< the file was opened with O_DSYNC */
+    qint64 position_; /**< where the next byte will be written */
+    qint64 submitted_; /**< where the next buffer will be written */
+    bool stop_; /**< asks the thread to exit */
+
+    char * buffers_[BUFFER_COUNT]; /**< the memory of the buffers */
+    int fill_[BUFFER_COUNT]; /**< bytes used in each buffer */
+    qint64 offset_[BUFFER_COUNT]; /**< where each queued buffer goes */
+    int done_[BUFFER_COUNT]; /**< bytes already written; thread only */
+    bool in_ring_[BUFFER_COUNT]; /**< the kernel has the buffer; thread only */
+    QVector<int> free_; /**< buffers that can be filled */
+    QVector<int> ready_; /**< full buffers, in file order */
+    int current_; /**< the buffer being filled; -1 if none */
+    int in_flight_; /**< buffers taken by the thread */
+
+    UserMsgRing * ring_; /**< the io_uring instance; NULL uses pwrite() */
+    UserMsgSync * sync_; /**< records the time of O_DSYNC writes; may be NULL */
+
+    QAtomicInteger<quint64> batches_; /**< see UserMsgAsyncStats */
+    QAtomicInteger<quint64> writes_; /**< see UserMsgAsyncStats */
+    QAtomicInteger<quint64> bytes_; /**< see UserMsgAsyncStats */
+    QAtomicInteger<quint64> waits_; /**< see UserMsgAsyncStats */
+    QAtomicInteger<quint64> wait_ns_; /**< see UserMsgAsyncStats */
+    QAtomicInteger<quint64> errors_; /**< see UserMsgAsyncStats */
+
+public:
+
+    //! Constructor; \p sync receives the time spent in O_DSYNC writes.
+    UserMsgAsyncWriter (
+            UserMsgSync * sync = NULL);
+
+    //! Destructor; writes what is pending and stops the thread.
+    virtual ~UserMsgAsyncWriter();
+
+
+    //! Write to the file at \p path from now on (empty for none).
+    bool
+    setFile (
+            const QString & path,
+            bool dsync = false);
+
+    //! Tell if a file is open.
+    bool
+    isOpen ();
+
+    //! Tell if the writes go through io_uring (otherwise pwrite()).
+    bool
+    usesRing ();
+
+    //! The size of the file once everything queued is written.
+    qint64
+    position ();
+
+    //! Queue bytes to be appended to the file.
+    void
+    write (
+            const char * data,
+            int size);
+
+    //! Wait until everything queued was written.
+    void
+    flush ();
+
+    //! Write the buffers that are not in the file yet; for crash handlers.
+    void
+    dumpPending ();
+
+
+    //! The work done so far.
+    UserMsgAsyncStats
+    stats () const;
+
+protected:
+
+    //! Submits the buffers and collects the completions.
+    virtual void
+    run ();
+
+private:
+
+    //! Give the buffer being filled to the thread.
+    void
+    _queueCurrent ();
+
+    //! Wait until the thread has written everything that was queued.
+    void
+    _drain ();
+
+    //! A buffer was written (or failed); make it available again.
+    void
+    _complete (
+            int buffer);
+
+    //! Submit the pending writes and collect the completions.
+    bool
+    _ringWait (
+            int fd,
+            QVector<int> & finished);
+
+    //! Write the rest of a buffer with pwrite().
+    bool
+    _writeNow (
+            int buffer,
+            int fd);
+};
+
+#endif // GUARD_USERMSGASYNC_H_INCLUDE
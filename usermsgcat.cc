@@ -0,0 +1,114 @@
+/**
+ * @file usermsgcat.cc
+ * @brief Definitions for UserMsgCat class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgcat.h"
+#include "usermsgstg.h"
+#include "usermsg-private.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+
+/**
+ * @class UserMsgCat
+ *
+ * Each category has a name (for example `net.http`) and a mask with
+ * one bit for each UserMsgEntry::Type that is enabled in it. The
+ * mask is resolved from the rules in UserMsgStg (see
+ * UserMsgStg::categoryMask()) when the category is created and
+ * each time the manager publishes new settings (setSettings(),
+ * setVisible(), setAllVisible(), setLogFile() or a reload of the
+ * settings file), so testing it at the call site is a single load:
+ * @code
+ * USERMSG_CATEGORY(cat_http, "net.http");
+ *
+ * UM_CAT_LOG(cat_http, UserMsgEntry::UTDBG_INFO,
+ *            QString ("Request %1").arg (url));
+ * @endcode
+ *
+ * All the categories that exist are kept in a registry (a linked
+ * list guarded by a mutex) together with a copy of the settings
+ * used to resolve new categories. The manager applies its own
+ * settings when it is created, so a category never keeps settings
+ * that the manager does not have.
+ */
+
+//! The categories and the settings used to resolve them.
+struct UserMsgCatRegistry {
+    QMutex mutex; /**< guards the other members */
+    UserMsgCat * head; /**< first category */
+    UserMsgStg settings; /**< last settings that were applied */
+
+    UserMsgCatRegistry () : mutex (), head (NULL), settings () {}
+};
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Categories are usually defined at file scope, so the registry is
+ * created on first use to be independent of the initialization order.
+ */
+static UserMsgCatRegistry & registry ()
+{
+    static UserMsgCatRegistry instance;
+    return instance;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The name is copied, so it need not outlive the category.
+ */
+UserMsgCat::UserMsgCat (const char * name) :
+    name_ (name),
+    mask_ (0),
+    next_ (NULL)
+{
+    USERMSG_TRACE_ENTRY;
+    UserMsgCatRegistry & r = registry ();
+    QMutexLocker locker (&r.mutex);
+    mask_.store (r.settings.categoryMask (name_.constData ()));
+    next_ = r.head;
+    r.head = this;
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgCat::~UserMsgCat()
+{
+    USERMSG_TRACE_ENTRY;
+    UserMsgCatRegistry & r = registry ();
+    QMutexLocker locker (&r.mutex);
+    UserMsgCat ** p = &r.head;
+    while (*p != NULL) {
+        if (*p == this) {
+            *p = next_;
+            break;
+        }
+        p = &(*p)->next_;
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Called by UserMsgMan with its lock held, each time it publishes a
+ * settings snapshot; the settings are also remembered for the
+ * categories that are created later.
+ */
+void UserMsgCat::applySettings (const UserMsgStg & stg)
+{
+    UserMsgCatRegistry & r = registry ();
+    QMutexLocker locker (&r.mutex);
+    r.settings = stg;
+    for (UserMsgCat * c = r.head; c != NULL; c = c->next_) {
+        c->mask_.store (r.settings.categoryMask (c->name_.constData ()));
+    }
+}
+/* ========================================================================= */
@@ -0,0 +1,96 @@
+/**
+ * @file usermsgcat.h
+ * @brief Declarations for UserMsgCat class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGCAT_H_INCLUDE
+#define GUARD_USERMSGCAT_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+#include <usermsg/usermsgmetrics.h>
+
+#include <QAtomicInt>
+#include <QByteArray>
+
+class UserMsgStg;
+
+//! Define a category handle with static storage.
+#define USERMSG_CATEGORY(handle, name) \
+    static UserMsgCat handle (name)
+
+//! Declare a category handle defined in another file.
+#define USERMSG_DECLARE_CATEGORY(handle) \
+    extern UserMsgCat handle
+
+//! Define a category handle that other files may use.
+#define USERMSG_DEFINE_CATEGORY(handle, name) \
+    UserMsgCat handle (name)
+
+//! Log a message in a category; the text is only built if enabled.
+#define UM_CAT_LOG(handle, ty, text) \
+    do { if ((handle).isEnabled (ty)) LogMsg::msg ((handle), (ty), (text)); \
+    else UserMsgMetrics::countFiltered (ty); } while (0)
+
+//! A named logging category.
+class USERMSG_EXPORT UserMsgCat {
+
+private:
+
+    QByteArray name_; /**< a copy of the name */
+    QAtomicInt mask_; /**< one bit for each enabled type */
+    UserMsgCat * next_; /**< next category in the registry */
+
+public:
+
+    //! Constructor.
+    UserMsgCat (
+            const char * name);
+
+    //! Destructor.
+    virtual ~UserMsgCat();
+
+
+    //! The name of this category.
+    const char *
+    name () const {
+        return name_.constData ();
+    }
+
+    //! The types that are enabled in this category (one bit for each).
+    int
+    mask () const {
+        return mask_.load ();
+    }
+
+    //! Tell if a type is enabled in this category.
+    bool
+    isEnabled (
+            UserMsgEntry::Type ty) const {
+        return (mask_.load () & (1 << (int)ty)) != 0;
+    }
+
+
+    //! Resolve the thresholds of all categories using new settings.
+    static void
+    applySettings (
+            const UserMsgStg & stg);
+
+private:
+
+    //! Copying a category would break the registry.
+    UserMsgCat (
+            const UserMsgCat &);
+
+    //! Copying a category would break the registry.
+    UserMsgCat &
+    operator= (
+            const UserMsgCat &);
+
+};
+
+#endif // GUARD_USERMSGCAT_H_INCLUDE
@@ -0,0 +1,440 @@
+/**
+ * @file usermsgcrash.cc
+ * @brief Definitions for UserMsgCrash class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgcrash.h"
+#include "usermsgasync.h"
+#include "usermsgtime.h"
+#include "usermsg-private.h"
+
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QFile>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(Q_OS_UNIX)
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+/**
+ * @class UserMsgCrash
+ *
+ * While the handlers are installed UserMsgMan gives each entry that
+ * it logs to record(), which formats it as a log line into a ring of
+ * preallocated slots. When the program receives SIGSEGV, SIGABRT
+ * or SIGBUS the handler writes a marker and the content of the ring
+ * to the log file using only write(), then lets the previous handler
+ * (or the default action) deal with the signal.
+ *
+ * The dump repeats the last SLOT_COUNT entries, some of which may
+ * already be in the file; this way nothing that was still buffered
+ * when the crash happened is lost. If the log file is written by
+ * a UserMsgAsyncWriter the bytes still in its buffers are saved
+ * first (UserMsgAsyncWriter::dumpPending()).
+ *
+ * The log file is opened a second time, with `O_APPEND`, for the
+ * dump, so the report lands at the end of the file whatever the
+ * position of the descriptor used for logging.
+ *
+ * The handler runs on an alternate signal stack, so that it works
+ * after a stack overflow. Alternate stacks are per thread: the thread
+ * that calls install() gets one and each other thread gets its own
+ * the first time it records an entry (it is released when the thread
+ * exits). A thread that never logged anything crashes on its own
+ * stack.
+ *
+ * The handlers are only available on POSIX systems; elsewhere
+ * install() fails.
+ */
+
+//! A formatted entry.
+struct UserMsgCrashSlot {
+    volatile int length; /**< number of valid bytes in text */
+    char text [UserMsgCrash::SLOT_SIZE]; /**< the line(s) */
+};
+
+//! The ring of formatted entries.
+static UserMsgCrashSlot crash_ring [UserMsgCrash::SLOT_COUNT];
+
+Q_STATIC_ASSERT((UserMsgCrash::SLOT_COUNT & (UserMsgCrash::SLOT_COUNT - 1)) == 0);
+
+//! Index of the next slot to be written (not wrapped; may overflow).
+static QAtomicInteger<quint32> crash_next;
+
+//! The descriptor of the log file, opened with O_APPEND.
+static volatile sig_atomic_t crash_fd = -1;
+
+//! The writer that may hold bytes not yet in the file.
+static QAtomicPointer<UserMsgAsyncWriter> crash_writer;
+
+//! Set while the handlers are installed.
+static QAtomicInt crash_installed;
+
+//! Set by the first signal that is handled.
+static volatile sig_atomic_t crash_dumping = 0;
+
+#if defined(Q_OS_UNIX)
+
+//! The signals that are handled.
+static const int crash_signals [] = { SIGSEGV, SIGABRT, SIGBUS };
+
+//! Number of entries in crash_signals.
+#define CRASH_SIGNAL_COUNT (int)(sizeof(crash_signals) / sizeof(crash_signals[0]))
+
+//! The handlers that were active before install().
+static struct sigaction crash_previous [CRASH_SIGNAL_COUNT];
+
+//! Size of the stack used by the handler.
+#define CRASH_STACK_SIZE (64 * 1024)
+
+//! The stack used by the handler, so that it runs after a stack overflow.
+static char crash_stack [CRASH_STACK_SIZE];
+
+//! The alternate stack of a thread other than the one of install().
+struct UserMsgCrashStack {
+    char * memory; /**< allocated on first use; NULL for none */
+    bool ready; /**< the thread has an alternate stack */
+
+    //! The thread exits; its stack is no longer used.
+    ~UserMsgCrashStack () {
+        if (memory != NULL) {
+            stack_t ss;
+            memset (&ss, 0, sizeof(ss));
+            ss.ss_flags = SS_DISABLE;
+            sigaltstack (&ss, NULL);
+            free (memory);
+        }
+    }
+};
+
+static thread_local UserMsgCrashStack crash_thread_stack = { NULL, false };
+
+/* ------------------------------------------------------------------------- */
+//! Give the calling thread an alternate stack, unless it has one.
+static void ensureAltStack ()
+{
+    if (crash_thread_stack.ready)
+        return;
+    crash_thread_stack.ready = true;
+
+    stack_t current;
+    if ((sigaltstack (NULL, &current) == 0) &&
+            ((current.ss_flags & SS_DISABLE) == 0))
+        return;
+
+    char * memory = (char*)malloc (CRASH_STACK_SIZE);
+    if (memory == NULL)
+        return;
+    stack_t ss;
+    memset (&ss, 0, sizeof(ss));
+    ss.ss_sp = memory;
+    ss.ss_size = CRASH_STACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack (&ss, NULL) == 0) {
+        crash_thread_stack.memory = memory;
+    } else {
+        free (memory);
+    }
+}
+/* ========================================================================= */
+
+#endif // Q_OS_UNIX
+
+/* ------------------------------------------------------------------------- */
+//! Append \p len bytes to a slot; stops at the end of the slot.
+static inline int appendBytes (char * out, int used, const char * in, int len)
+{
+    int room = UserMsgCrash::SLOT_SIZE - 1 - used;
+    if (len > room)
+        len = room;
+    memcpy (out + used, in, len);
+    return used + len;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Encodes \p s as UTF-8 without allocating memory. Line breaks are
+ * padded like in the log file.
+ */
+static int appendUtf8 (char * out, int used, const QString & s)
+{
+    static const char padding[] = "\n                              : ";
+    const QChar * p = s.constData ();
+    const QChar * end = p + s.length ();
+    for (; p < end; ++p) {
+        uint c = p->unicode ();
+        if (p->isHighSurrogate () && (p + 1 < end) && p[1].isLowSurrogate ()) {
+            c = QChar::surrogateToUcs4 (*p, p[1]);
+            ++p;
+        }
+        char buf [4];
+        int n;
+        if (c == '\n') {
+            used = appendBytes (out, used, padding, sizeof(padding) - 1);
+            continue;
+        } else if (c < 0x80) {
+            buf[0] = (char)c;
+            n = 1;
+        } else if (c < 0x800) {
+            buf[0] = (char)(0xC0 | (c >> 6));
+            buf[1] = (char)(0x80 | (c & 0x3F));
+            n = 2;
+        } else if (c < 0x10000) {
+            buf[0] = (char)(0xE0 | (c >> 12));
+            buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+            buf[2] = (char)(0x80 | (c & 0x3F));
+            n = 3;
+        } else {
+            buf[0] = (char)(0xF0 | (c >> 18));
+            buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+            buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+            buf[3] = (char)(0x80 | (c & 0x3F));
+            n = 4;
+        }
+        if (used + n > UserMsgCrash::SLOT_SIZE - 1)
+            break;
+        used = appendBytes (out, used, buf, n);
+    }
+    return used;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Same labels as the ones used in the log file.
+ */
+static const char * typeLabel (UserMsgEntry::Type ty)
+{
+    switch (ty) {
+    case UserMsgEntry::UTERROR: return "error   ";
+    case UserMsgEntry::UTWARNING: return "warning ";
+    case UserMsgEntry::UTINFO: return "info    ";
+    case UserMsgEntry::UTDBG_ERROR: return "derror  ";
+    case UserMsgEntry::UTDBG_WARNING: return "dwarning";
+    case UserMsgEntry::UTDBG_INFO: return "debug   ";
+    default: return "null    ";
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Write a buffer, retrying on partial writes; async-signal-safe.
+static void writeAll (int fd, const char * data, int len)
+{
+#if defined(Q_OS_UNIX)
+    while (len > 0) {
+        ssize_t n = ::write (fd, data, len);
+        if (n <= 0)
+            return;
+        data += n;
+        len -= (int)n;
+    }
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+#if defined(Q_OS_UNIX)
+/**
+ * Dumps the ring once, then gives the signal to the handler that was
+ * there before (the default action terminates the program).
+ */
+static void crashHandler (int sig)
+{
+    if (!crash_dumping) {
+        crash_dumping = 1;
+        UserMsgCrash::dump (sig);
+    }
+
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        if (crash_signals[i] == sig) {
+            sigaction (sig, &crash_previous[i], NULL);
+            break;
+        }
+    }
+    raise (sig);
+}
+#endif // Q_OS_UNIX
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @returns false if the handlers could not be installed
+ */
+bool UserMsgCrash::install ()
+{
+#if defined(Q_OS_UNIX)
+    if (!crash_installed.testAndSetOrdered (0, 1))
+        return true;
+
+    stack_t ss;
+    memset (&ss, 0, sizeof(ss));
+    ss.ss_sp = crash_stack;
+    ss.ss_size = CRASH_STACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack (&ss, NULL) == 0) {
+        crash_thread_stack.ready = true;
+    }
+
+    struct sigaction sa;
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = crashHandler;
+    sa.sa_flags = SA_ONSTACK;
+    sigemptyset (&sa.sa_mask);
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        sigaction (crash_signals[i], &sa, &crash_previous[i]);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgCrash::uninstall ()
+{
+#if defined(Q_OS_UNIX)
+    if (!crash_installed.testAndSetOrdered (1, 0))
+        return;
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        sigaction (crash_signals[i], &crash_previous[i], NULL);
+    }
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgCrash::isInstalled ()
+{
+    return crash_installed.loadAcquire () != 0;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The handler stops using the old descriptor before it is closed.
+ */
+void UserMsgCrash::setLogFile (const QString & path)
+{
+#if defined(Q_OS_UNIX)
+    int old_fd = crash_fd;
+    crash_fd = -1;
+    if (old_fd != -1) {
+        ::close (old_fd);
+    }
+    if (!path.isEmpty ()) {
+        int fd = ::open (QFile::encodeName (path).constData (),
+                         O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1) {
+            printf("Cannot open the log file for crash reports\n");
+        }
+        crash_fd = fd;
+    }
+#else
+    Q_UNUSED(path);
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The writer must outlive the call that replaces it.
+ */
+void UserMsgCrash::setAsyncWriter (UserMsgAsyncWriter * writer)
+{
+    crash_writer.storeRelease (writer);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only one thread may call this at a time; UserMsgMan calls it
+ * while holding its lock. The entry is formatted like in the log
+ * file and cut to SLOT_SIZE bytes.
+ *
+ * The first call on a thread also gives it an alternate stack.
+ */
+void UserMsgCrash::record (const UserMsgEntry & e)
+{
+#if defined(Q_OS_UNIX)
+    ensureAltStack ();
+#endif
+
+    quint32 next = crash_next.loadAcquire ();
+    UserMsgCrashSlot & slot = crash_ring [next & (SLOT_COUNT - 1)];
+    slot.length = 0;
+
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
+    int used = appendBytes (slot.text, 0, "  ", 2);
+    used = appendBytes (slot.text, used, date_buffer,
+                        UserMsgTime::formatIso (e.moment (), date_buffer));
+    used = appendBytes (slot.text, used, " ", 1);
+    used = appendBytes (slot.text, used, typeLabel (e.type ()), 8);
+    used = appendBytes (slot.text, used, ": ", 2);
+    used = appendUtf8 (slot.text, used, e.message ());
+    slot.text[used++] = '\n';
+
+    slot.length = used;
+    crash_next.storeRelease (next + 1);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Async-signal-safe: only uses the preallocated ring, the buffers
+ * of the writer and write().
+ *
+ * @param sig the signal that caused the dump, printed in the marker
+ */
+void UserMsgCrash::dump (int sig)
+{
+    UserMsgAsyncWriter * writer = crash_writer.loadAcquire ();
+    if (writer != NULL) {
+        writer->dumpPending ();
+    }
+
+    int fd = crash_fd;
+    if (fd < 0)
+        return;
+
+    static const char head[] = "---- crash (signal ";
+    static const char head_end[] = "); last entries follow ----\n";
+    static const char tail[] = "---- end of crash report ----\n";
+
+    char number [12];
+    int n = sizeof(number);
+    unsigned int u = sig < 0 ? 0 : (unsigned int)sig;
+    do {
+        number[--n] = (char)('0' + u % 10);
+        u /= 10;
+    } while ((u != 0) && (n > 0));
+
+    writeAll (fd, head, sizeof(head) - 1);
+    writeAll (fd, number + n, (int)sizeof(number) - n);
+    writeAll (fd, head_end, sizeof(head_end) - 1);
+
+    quint32 next = crash_next.loadAcquire ();
+    quint32 count = next < (quint32)SLOT_COUNT ? next : (quint32)SLOT_COUNT;
+    for (quint32 i = next - count; i != next; ++i) {
+        const UserMsgCrashSlot & slot = crash_ring [i & (SLOT_COUNT - 1)];
+        int len = slot.length;
+        if ((len > 0) && (len <= SLOT_SIZE)) {
+            writeAll (fd, slot.text, len);
+        }
+    }
+
+    writeAll (fd, tail, sizeof(tail) - 1);
+}
+/* ========================================================================= */
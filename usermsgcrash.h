@@ -0,0 +1,65 @@
+/**
+ * @file usermsgcrash.h
+ * @brief Declarations for UserMsgCrash class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGCRASH_H_INCLUDE
+#define GUARD_USERMSGCRASH_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+
+class UserMsgAsyncWriter;
+
+//! Writes the most recent entries to the log when the program crashes.
+class USERMSG_EXPORT UserMsgCrash {
+
+public:
+
+    enum {
+        //! the number of entries that are kept (a power of two)
+        SLOT_COUNT = 64,
+        //! the maximum length of an entry in bytes (longer ones are cut)
+        SLOT_SIZE = 512
+    };
+
+    //! Install the handlers for SIGSEGV, SIGABRT and SIGBUS.
+    static bool
+    install ();
+
+    //! Restore the handlers that were active before install().
+    static void
+    uninstall ();
+
+    //! Tell if the handlers are installed.
+    static bool
+    isInstalled ();
+
+
+    //! The log file that receives the dump (empty for none).
+    static void
+    setLogFile (
+            const QString & path);
+
+    //! The writer whose buffers are saved by the dump (NULL for none).
+    static void
+    setAsyncWriter (
+            UserMsgAsyncWriter * writer);
+
+    //! Keep a copy of an entry that was logged.
+    static void
+    record (
+            const UserMsgEntry & e);
+
+    //! Write the entries that are kept to the log file.
+    static void
+    dump (
+            int sig);
+
+};
+
+#endif // GUARD_USERMSGCRASH_H_INCLUDE
@@ -0,0 +1,309 @@
+/**
+ * @file usermsgenc.cc
+ * @brief Definitions for UserMsgEncoder class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgenc.h"
+#include "usermsg-private.h"
+#include "usermsg.h"
+#include "usermsgtime.h"
+
+#include <QLocale>
+
+#include <stdlib.h>
+
+/**
+ * @class UserMsgEncoder
+ *
+ * The manager renders each message into the encoder of the calling
+ * thread (see local()) before taking its lock and then writes the
+ * bytes to the log file with a single call. The buffer is reset
+ * between messages but never freed, and it doubles when it is too
+ * small, so once it has seen the largest message no more memory
+ * is allocated.
+ *
+ * The text is converted from UTF-16 to UTF-8 directly into the
+ * buffer; a lone surrogate becomes U+FFFD. Only the values of
+ * UserMsgEntry::FDOUBLE fields go through a temporary string.
+ */
+
+//! Aligns the lines after the first one with the start of the text.
+static const char new_line_padding [] =
+        "\n                              : ";
+
+/* ------------------------------------------------------------------------- */
+UserMsgEncoder::UserMsgEncoder () :
+    data_ (NULL),
+    size_ (0),
+    capacity_ (0)
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgEncoder::~UserMsgEncoder()
+{
+    USERMSG_TRACE_ENTRY;
+    free (data_);
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The encoder is freed when the thread exits.
+ */
+UserMsgEncoder & UserMsgEncoder::local ()
+{
+    static thread_local UserMsgEncoder encoder;
+    return encoder;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::grow (int needed)
+{
+    int capacity = qMax (capacity_, (int)INITIAL_CAPACITY);
+    while (capacity < needed) {
+        capacity = capacity * 2;
+    }
+    char * data = (char*)realloc (data_, capacity);
+    Q_CHECK_PTR(data);
+    data_ = data;
+    capacity_ = capacity;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::appendNumber (qint64 value)
+{
+    char buffer [24];
+    char * p = buffer + sizeof(buffer);
+    quint64 u = (value < 0) ? (0 - (quint64)value) : (quint64)value;
+    do {
+        *--p = (char)('0' + (u % 10));
+        u = u / 10;
+    } while (u != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    append (p, (int)(buffer + sizeof(buffer) - p));
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * With \p pad_lines each line break is followed by the padding that
+ * aligns the next line with the text of the first one.
+ */
+void UserMsgEncoder::appendUtf8 (const QString & text, bool pad_lines)
+{
+    appendUtf8 (text.constData (), text.length (), pad_lines);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::appendUtf8 (
+        const QChar * text, int len, bool pad_lines)
+{
+    const ushort * src = reinterpret_cast<const ushort *>(text);
+    // three bytes are enough for any UTF-16 unit
+    reserve (len * 3);
+    char * dst = data_ + size_;
+
+    for (int i = 0; i < len; ++i) {
+        ushort c = src[i];
+        if (c < 0x80) {
+            if ((c == '\n') && pad_lines) {
+                size_ = (int)(dst - data_);
+                appendLiteral (new_line_padding);
+                reserve ((len - i - 1) * 3);
+                dst = data_ + size_;
+            } else {
+                *dst++ = (char)c;
+            }
+        } else if (c < 0x800) {
+            *dst++ = (char)(0xC0 | (c >> 6));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+        } else if (QChar::isHighSurrogate (c) && (i + 1 < len) &&
+                   QChar::isLowSurrogate (src[i+1])) {
+            uint u = QChar::surrogateToUcs4 (c, src[i+1]);
+            ++i;
+            *dst++ = (char)(0xF0 | (u >> 18));
+            *dst++ = (char)(0x80 | ((u >> 12) & 0x3F));
+            *dst++ = (char)(0x80 | ((u >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (u & 0x3F));
+        } else {
+            if (QChar::isSurrogate (c)) {
+                c = QChar::ReplacementCharacter;
+            }
+            *dst++ = (char)(0xE0 | (c >> 12));
+            *dst++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    size_ = (int)(dst - data_);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::encodePrefix (const UserMsgEntry & e)
+{
+    reserve (UserMsgTime::ISO_MAX_LENGTH + 3);
+    data_[size_++] = ' ';
+    data_[size_++] = ' ';
+    size_ += UserMsgTime::formatIso (e.moment (), data_ + size_);
+    data_[size_++] = ' ';
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::encodeType (UserMsgEntry::Type ty)
+{
+    switch (ty) {
+    case UserMsgEntry::UTERROR: {
+        appendLiteral ("error   ");
+        break; }
+    case UserMsgEntry::UTWARNING: {
+        appendLiteral ("warning ");
+        break; }
+    case UserMsgEntry::UTINFO: {
+        appendLiteral ("info    ");
+        break; }
+    case UserMsgEntry::UTDBG_ERROR: {
+        appendLiteral ("derror  ");
+        break; }
+    case UserMsgEntry::UTDBG_WARNING: {
+        appendLiteral ("dwarning");
+        break; }
+    case UserMsgEntry::UTDBG_INFO: {
+        appendLiteral ("debug   ");
+        break; }
+    default: {
+        appendLiteral ("null    ");
+        break; }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Produces the same text as UserMsgEntry::fieldsText().
+ */
+void UserMsgEncoder::encodeFieldText (const QString & text)
+{
+    bool quote = text.isEmpty ();
+    foreach(const QChar & c, text) {
+        if ((c == ' ') || (c == '"') || (c == '=') ||
+                (c == '\\') || (c == '\n') || (c == '\r')) {
+            quote = true;
+            break;
+        }
+    }
+    if (!quote) {
+        appendUtf8 (text);
+        return;
+    }
+
+    append ('"');
+    int start = 0;
+    int len = text.length ();
+    for (int i = 0; i < len; ++i) {
+        QChar c = text.at (i);
+        if ((c != '"') && (c != '\\') && (c != '\n') && (c != '\r'))
+            continue;
+        appendUtf8 (text.constData () + start, i - start);
+        if (c == '\n') {
+            appendLiteral ("\\n");
+        } else if (c == '\r') {
+            appendLiteral ("\\r");
+        } else {
+            append ('\\');
+            append ((char)c.unicode ());
+        }
+        start = i + 1;
+    }
+    appendUtf8 (text.constData () + start, len - start);
+    append ('"');
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Produces the same text as UserMsgEntry::fieldsText().
+ */
+void UserMsgEncoder::encodeFields (const UserMsgEntry & e)
+{
+    bool first = true;
+    foreach(const UserMsgEntry::Field & f, e.fields ()) {
+        if (!first) append (' ');
+        first = false;
+        append (f.key.constData (), f.key.size ());
+        append ('=');
+        switch (f.kind) {
+        case UserMsgEntry::FINT64: {
+            appendNumber (f.value.i);
+            break; }
+        case UserMsgEntry::FDOUBLE: {
+            appendUtf8 (QString::number (
+                            f.value.d, 'g', QLocale::FloatingPointShortest));
+            break; }
+        case UserMsgEntry::FSTRING: {
+            encodeFieldText (f.text);
+            break; }
+        case UserMsgEntry::FBOOL: {
+            if (f.value.b) appendLiteral ("true");
+            else appendLiteral ("false");
+            break; }
+        default: {
+            break; }
+        }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The line ends with a line break; see UserMsgMan::_logMessage()
+ * for the format.
+ */
+void UserMsgEncoder::encodeEntry (const UserMsgEntry & e)
+{
+    encodePrefix (e);
+    encodeType (e.type ());
+    appendLiteral (": ");
+    appendUtf8 (e.message (), true);
+    if (!e.fields ().isEmpty ()) {
+        append (' ');
+        encodeFields (e);
+    }
+    append ('\n');
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEncoder::encodeMessage (const UserMsg & um)
+{
+    int i_max = um.count ();
+    if (i_max == 0)
+        return;
+
+    const QString & t = um.title ();
+    if (t.isEmpty ()) {
+        encodePrefix (um.at (0));
+        appendLiteral ("title   ");
+        appendUtf8 (t);
+        append ('\n');
+    }
+    for (int i = 0; i < i_max; ++i) {
+        encodeEntry (um.at (i));
+    }
+}
+/* ========================================================================= */
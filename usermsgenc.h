@@ -0,0 +1,168 @@
+/**
+ * @file usermsgenc.h
+ * @brief Declarations for UserMsgEncoder class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGENC_H_INCLUDE
+#define GUARD_USERMSGENC_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+
+#include <QString>
+
+#include <string.h>
+
+class UserMsg;
+
+//! Renders the lines of the log file into a reusable buffer.
+class USERMSG_EXPORT UserMsgEncoder {
+
+public:
+
+    enum {
+        //! the size of the buffer when it is first used
+        INITIAL_CAPACITY = 4 * 1024
+    };
+
+private:
+
+    char * data_; /**< the bytes; NULL until first used */
+    int size_; /**< bytes in use */
+    int capacity_; /**< bytes allocated */
+
+public:
+
+    //! Default constructor.
+    UserMsgEncoder ();
+
+    //! Destructor.
+    virtual ~UserMsgEncoder();
+
+
+    //! The encoder of the calling thread.
+    static UserMsgEncoder &
+    local ();
+
+
+    //! Forget the content but keep the memory.
+    inline void
+    reset () {
+        size_ = 0;
+    }
+
+    //! The encoded bytes.
+    inline const char *
+    data () const {
+        return data_;
+    }
+
+    //! The number of encoded bytes.
+    inline int
+    size () const {
+        return size_;
+    }
+
+    //! The number of bytes that fit without growing.
+    inline int
+    capacity () const {
+        return capacity_;
+    }
+
+    //! Make room for \p count more bytes.
+    inline void
+    reserve (
+            int count) {
+        if (Q_UNLIKELY(size_ + count > capacity_))
+            grow (size_ + count);
+    }
+
+
+    //! Append raw bytes.
+    inline void
+    append (
+            const char * bytes,
+            int count) {
+        reserve (count);
+        memcpy (data_ + size_, bytes, count);
+        size_ += count;
+    }
+
+    //! Append a single byte.
+    inline void
+    append (
+            char c) {
+        reserve (1);
+        data_[size_++] = c;
+    }
+
+    //! Append a string literal.
+    template <int N>
+    inline void
+    appendLiteral (
+            const char (&literal)[N]) {
+        append (literal, N - 1);
+    }
+
+    //! Append a number in decimal.
+    void
+    appendNumber (
+            qint64 value);
+
+    //! Append the UTF-8 form of a string, padding line breaks.
+    void
+    appendUtf8 (
+            const QString & text,
+            bool pad_lines = false);
+
+    //! Append the UTF-8 form of \p len UTF-16 units.
+    void
+    appendUtf8 (
+            const QChar * text,
+            int len,
+            bool pad_lines = false);
+
+
+    //! Append the lines of a message, as the log file expects them.
+    void
+    encodeMessage (
+            const UserMsg & um);
+
+    //! Append the line of an entry.
+    void
+    encodeEntry (
+            const UserMsgEntry & e);
+
+    //! Append the fields of an entry as `key=value` pairs.
+    void
+    encodeFields (
+            const UserMsgEntry & e);
+
+private:
+
+    //! Enlarge the buffer so that \p needed bytes fit.
+    void
+    grow (
+            int needed);
+
+    //! Append the time stamp that starts each line.
+    void
+    encodePrefix (
+            const UserMsgEntry & e);
+
+    //! Append the label of a type, padded to the same width.
+    void
+    encodeType (
+            UserMsgEntry::Type ty);
+
+    //! Append a string value, quoted if needed.
+    void
+    encodeFieldText (
+            const QString & text);
+};
+
+#endif // GUARD_USERMSGENC_H_INCLUDE
@@ -11,11 +11,26 @@
 #include "usermsg-private.h"
 
 #include <QObject>
+#include <QLocale>
 
 /**
  * @class UserMsgEntry
  *
+ * Besides the text an entry may carry typed fields (integers,
+ * floating point numbers, strings and booleans). The values are
+ * stored as they are and are only formatted by the sinks that
+ * need text: the JSON and XML outputs write them with their native
+ * types, the log file and the console write them as `key=value`
+ * after the message.
  *
+ * The keys are copied, so they need not outlive the entry. Integers
+ * of any width are stored as qint64 (unsigned values above the range
+ * of qint64 wrap around):
+ * @code
+ * UserMsgEntry e (UserMsgEntry::UTINFO, "Transfer complete");
+ * e.addField ("bytes", bytes);
+ * e.addField ("rate", rate);
+ * @endcode
  */
 
 /* ------------------------------------------------------------------------- */
@@ -25,7 +40,8 @@
 UserMsgEntry::UserMsgEntry() :
     message_(),
     moment_(QDateTime::currentDateTime ()),
-    type_(UTERROR)
+    type_(UTERROR),
+    fields_()
 {
     USERMSG_TRACE_ENTRY;
 
@@ -40,7 +56,8 @@ UserMsgEntry::UserMsgEntry() :
 UserMsgEntry::UserMsgEntry(const UserMsgEntry & other) :
     message_(other.message_),
     moment_(other.moment_),
-    type_(other.type_)
+    type_(other.type_),
+    fields_(other.fields_)
 {
     USERMSG_TRACE_ENTRY;
 
@@ -55,7 +72,26 @@ UserMsgEntry::UserMsgEntry(const UserMsgEntry & other) :
 UserMsgEntry::UserMsgEntry (Type ty, const QString & message) :
     message_(message),
     moment_(QDateTime::currentDateTime ()),
-    type_(ty)
+    type_(ty),
+    fields_()
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Used when the entry is recreated from a stored form, for example
+ * a log file.
+ */
+UserMsgEntry::UserMsgEntry (
+        Type ty, const QString & message, const QDateTime & moment) :
+    message_(message),
+    moment_(moment),
+    type_(ty),
+    fields_()
 {
     USERMSG_TRACE_ENTRY;
 
@@ -120,3 +156,118 @@ bool UserMsgEntry::isEnabled () const
     return UserMsgEntry::isEnabled (type_);
 }
 /* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEntry::addField (const char * key, qint64 value)
+{
+    Field f;
+    f.key = key;
+    f.kind = FINT64;
+    f.value.i = value;
+    fields_.append (f);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEntry::addField (const char * key, double value)
+{
+    Field f;
+    f.key = key;
+    f.kind = FDOUBLE;
+    f.value.d = value;
+    fields_.append (f);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEntry::addField (const char * key, const QString & value)
+{
+    Field f;
+    f.key = key;
+    f.kind = FSTRING;
+    f.value.i = 0;
+    f.text = value;
+    fields_.append (f);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgEntry::addField (const char * key, bool value)
+{
+    Field f;
+    f.key = key;
+    f.kind = FBOOL;
+    f.value.b = value;
+    fields_.append (f);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Floating point values use the shortest representation that
+ * reads back to the same value. Strings are returned unchanged.
+ */
+QString UserMsgEntry::Field::toString () const
+{
+    switch (kind) {
+    case FINT64: return QString::number (value.i);
+    case FDOUBLE: return QString::number (
+                    value.d, 'g', QLocale::FloatingPointShortest);
+    case FSTRING: return text;
+    case FBOOL: return value.b ?
+                    QLatin1String ("true") : QLatin1String ("false");
+    default: return QString ();
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * String values that are empty or contain spaces, quotes, equal signs
+ * or line breaks are quoted, with quotes and backslashes escaped
+ * and line breaks written as `\n`.
+ */
+QString UserMsgEntry::fieldsText () const
+{
+    QString result;
+    foreach(const Field & f, fields_) {
+        if (!result.isEmpty ())
+            result.append (QChar (' '));
+        result.append (QLatin1String (f.key));
+        result.append (QChar ('='));
+        if (f.kind != FSTRING) {
+            result.append (f.toString ());
+            continue;
+        }
+
+        bool quote = f.text.isEmpty ();
+        foreach(const QChar & c, f.text) {
+            if ((c == ' ') || (c == '"') || (c == '=') ||
+                    (c == '\\') || (c == '\n') || (c == '\r')) {
+                quote = true;
+                break;
+            }
+        }
+        if (!quote) {
+            result.append (f.text);
+            continue;
+        }
+
+        result.append (QChar ('"'));
+        foreach(const QChar & c, f.text) {
+            if ((c == '"') || (c == '\\')) {
+                result.append (QChar ('\\'));
+                result.append (c);
+            } else if (c == '\n') {
+                result.append (QLatin1String ("\\n"));
+            } else if (c == '\r') {
+                result.append (QLatin1String ("\\r"));
+            } else {
+                result.append (c);
+            }
+        }
+        result.append (QChar ('"'));
+    }
+    return result;
+}
+/* ========================================================================= */
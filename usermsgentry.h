@@ -12,8 +12,12 @@
 
 #include <usermsg/usermsg-config.h>
 
+#include <QByteArray>
 #include <QString>
 #include <QDateTime>
+#include <QVector>
+
+#include <type_traits>
 
 //! user messages mediator
 class USERMSG_EXPORT UserMsgEntry {
@@ -30,11 +34,36 @@ public:
         UTDBG_INFO
     };
 
+    //! kind of the value in a field
+    enum FieldKind {
+        FINT64 = 0,
+        FDOUBLE,
+        FSTRING,
+        FBOOL
+    };
+
+    //! A typed key/value pair attached to an entry.
+    struct Field {
+        QByteArray key; /**< the name (a copy) */
+        FieldKind kind; /**< the kind of the value */
+        union {
+            qint64 i; /**< value for FINT64 */
+            double d; /**< value for FDOUBLE */
+            bool b; /**< value for FBOOL */
+        } value; /**< the value, unless it is a string */
+        QString text; /**< value for FSTRING */
+
+        //! The value formatted as text.
+        QString
+        toString () const;
+    };
+
 private:
 
     QString message_; /**< the message */
     QDateTime moment_; /**< the time when this occured */
     Type type_; /**< the kind */
+    QVector<Field> fields_; /**< typed values; empty for most entries */
 
 public:
 
@@ -50,6 +79,12 @@ public:
             Type ty,
             const QString & message);
 
+    //! Constructor. Sets the message, type and moment.
+    UserMsgEntry (
+            Type ty,
+            const QString & message,
+            const QDateTime & moment);
+
     //! Destructor.
     virtual ~UserMsgEntry();
 
@@ -112,6 +147,61 @@ public:
     }
 
 
+    //! Get the fields.
+    const QVector<Field> &
+    fields () const {
+        return fields_;
+    }
+
+    //! Add an integer field.
+    void
+    addField (
+            const char * key,
+            qint64 value);
+
+    //! Add an integer field of any other integral type (kept as qint64).
+    template <typename T>
+    typename std::enable_if<
+        std::is_integral<T>::value &&
+        !std::is_same<T, bool>::value &&
+        !std::is_same<T, qint64>::value>::type
+    addField (
+            const char * key,
+            T value) {
+        addField (key, (qint64)value);
+    }
+
+    //! Add a floating point field.
+    void
+    addField (
+            const char * key,
+            double value);
+
+    //! Add a string field.
+    void
+    addField (
+            const char * key,
+            const QString & value);
+
+    //! Add a string field.
+    void
+    addField (
+            const char * key,
+            const char * value) {
+        addField (key, QString::fromUtf8 (value));
+    }
+
+    //! Add a boolean field.
+    void
+    addField (
+            const char * key,
+            bool value);
+
+    //! The fields as `key=value` pairs separated by spaces.
+    QString
+    fieldsText () const;
+
+
 public:
 
     //! Get the name of the type in all-lower-case
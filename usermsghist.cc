@@ -0,0 +1,250 @@
+/**
+ * @file usermsghist.cc
+ * @brief Definitions for UserMsgHist class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsghist.h"
+#include "usermsg-private.h"
+
+#include <algorithm>
+
+/**
+ * @class UserMsgHist
+ *
+ * The entries are stored in a fixed-capacity ring; once the ring is
+ * full each new entry replaces the oldest one.
+ *
+ * Two indexes are maintained as the entries are added:
+ * - each entry links to the previous entry of the same type, so
+ *   lastOfType() only visits the entries that it returns;
+ * - the ring is split in buckets of BUCKET_WIDTH milliseconds
+ *   and the index of the first entry in each bucket is recorded, so
+ *   between() finds its starting point with a binary search.
+ *
+ * The time index assumes that entries are added in chronological
+ * order, which is the case for entries that are timestamped when
+ * they are created.
+ *
+ * The class is not thread-safe; UserMsgMan guards its instance
+ * with its own lock.
+ */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A capacity of 0 disables the history.
+ */
+UserMsgHist::UserMsgHist (int capacity) :
+    ring_ (),
+    buckets_ (),
+    next_ (0),
+    bucket_next_ (0)
+{
+    USERMSG_TRACE_ENTRY;
+    setCapacity (capacity);
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgHist::~UserMsgHist()
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgHist::setCapacity (int value)
+{
+    if (value < 0)
+        value = 0;
+    ring_.clear ();
+    buckets_.clear ();
+    ring_.resize (value);
+    buckets_.resize (value);
+    ring_.squeeze ();
+    buckets_.squeeze ();
+    clear ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int UserMsgHist::count () const
+{
+    return (int)(next_ - oldest ());
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The memory used by the ring is not released; the entries are only
+ * marked as unavailable.
+ */
+void UserMsgHist::clear ()
+{
+    next_ = 0;
+    bucket_next_ = 0;
+    for (int i = 0; i < TYPE_COUNT; ++i) {
+        last_of_type_[i] = 0;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgHist::add (const UserMsgEntry & e)
+{
+    quint64 cap = (quint64)ring_.count ();
+    if (cap == 0)
+        return;
+
+    Slot & s = ring_[(int)(next_ % cap)];
+    s.entry = e;
+    s.key = timeKey (e.moment ());
+
+    int ty = (int)e.type ();
+    if ((ty >= 0) && (ty < TYPE_COUNT)) {
+        s.prev_same_type = last_of_type_[ty];
+        last_of_type_[ty] = next_ + 1;
+    } else {
+        s.prev_same_type = 0;
+    }
+
+    qint64 id = s.key / BUCKET_WIDTH;
+    if ((bucket_next_ == 0) ||
+            (id > buckets_.at ((int)((bucket_next_ - 1) % cap)).id)) {
+        Bucket & b = buckets_[(int)(bucket_next_ % cap)];
+        b.id = id;
+        b.first = next_;
+        ++bucket_next_;
+    }
+
+    ++next_;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgHist::add (const UserMsg & um)
+{
+    int i_max = um.count ();
+    for (int i = 0; i < i_max; ++i) {
+        add (um.at (i));
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+QVector<UserMsgEntry> UserMsgHist::last (int n) const
+{
+    QVector<UserMsgEntry> result;
+    quint64 cap = (quint64)ring_.count ();
+    quint64 lo = oldest ();
+    if (n <= 0)
+        return result;
+    if ((quint64)n < next_ - lo)
+        lo = next_ - n;
+
+    result.reserve ((int)(next_ - lo));
+    for (quint64 i = lo; i < next_; ++i) {
+        result.append (ring_.at ((int)(i % cap)).entry);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only the entries of the requested type are visited.
+ */
+QVector<UserMsgEntry> UserMsgHist::lastOfType (
+        UserMsgEntry::Type ty, int n) const
+{
+    QVector<UserMsgEntry> result;
+    int t = (int)ty;
+    if ((t < 0) || (t >= TYPE_COUNT) || (n <= 0))
+        return result;
+
+    quint64 cap = (quint64)ring_.count ();
+    quint64 lo = oldest ();
+    quint64 p = last_of_type_[t];
+    while ((p != 0) && (p - 1 >= lo) && (result.count () < n)) {
+        const Slot & s = ring_.at ((int)((p - 1) % cap));
+        result.append (s.entry);
+        p = s.prev_same_type;
+    }
+
+    std::reverse (result.begin (), result.end ());
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The time index is used to locate the first candidate; from there
+ * the entries are visited in order until one is newer than \p to.
+ */
+QVector<UserMsgEntry> UserMsgHist::between (
+        const QDateTime & from, const QDateTime & to) const
+{
+    QVector<UserMsgEntry> result;
+    quint64 cap = (quint64)ring_.count ();
+    if ((cap == 0) || (next_ == 0))
+        return result;
+
+    qint64 k_from = timeKey (from);
+    qint64 k_to = timeKey (to);
+    if (k_to < k_from)
+        return result;
+
+    // binary search for the first bucket that may hold the start
+    qint64 id_from = k_from / BUCKET_WIDTH;
+    quint64 lo_b = bucket_next_ > cap ? bucket_next_ - cap : 0;
+    quint64 hi_b = bucket_next_;
+    while (lo_b < hi_b) {
+        quint64 mid = lo_b + (hi_b - lo_b) / 2;
+        if (buckets_.at ((int)(mid % cap)).id < id_from) {
+            lo_b = mid + 1;
+        } else {
+            hi_b = mid;
+        }
+    }
+    if (lo_b == bucket_next_)
+        return result;
+
+    quint64 start = buckets_.at ((int)(lo_b % cap)).first;
+    quint64 lo = oldest ();
+    if (start < lo)
+        start = lo;
+
+    for (quint64 i = start; i < next_; ++i) {
+        const Slot & s = ring_.at ((int)(i % cap));
+        if (s.key > k_to)
+            break;
+        if (s.key >= k_from)
+            result.append (s.entry);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Local time is used so that the key can be computed without the
+ * cost of a time zone conversion for entries (which are created
+ * in local time).
+ */
+qint64 UserMsgHist::timeKey (const QDateTime & moment)
+{
+    if (!moment.isValid ())
+        return 0;
+    if (moment.timeSpec () != Qt::LocalTime) {
+        return timeKey (moment.toLocalTime ());
+    }
+    return moment.date ().toJulianDay () * 86400000 +
+            moment.time ().msecsSinceStartOfDay ();
+}
+/* ========================================================================= */
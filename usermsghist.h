@@ -0,0 +1,136 @@
+/**
+ * @file usermsghist.h
+ * @brief Declarations for UserMsgHist class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGHIST_H_INCLUDE
+#define GUARD_USERMSGHIST_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsg.h>
+
+#include <QVector>
+#include <QDateTime>
+
+//! In-memory history of the most recent entries.
+class USERMSG_EXPORT UserMsgHist {
+
+public:
+
+    enum {
+        //! the width of a time bucket in milliseconds
+        BUCKET_WIDTH = 1000,
+        //! the number of distinct types
+        TYPE_COUNT = UserMsgEntry::UTDBG_INFO + 1
+    };
+
+private:
+
+    //! An entry in the ring.
+    struct Slot {
+        UserMsgEntry entry; /**< the entry */
+        qint64 key; /**< local time of the entry in milliseconds */
+        quint64 prev_same_type; /**< 1 + index of previous entry of
+                                    same type; 0 for none */
+    };
+
+    //! The first entry in a time bucket.
+    struct Bucket {
+        qint64 id; /**< key of the entries divided by BUCKET_WIDTH */
+        quint64 first; /**< index of the first entry in this bucket */
+    };
+
+    QVector<Slot>
+    ring_; /**< the entries; index i is stored at i % capacity */
+
+    QVector<Bucket>
+    buckets_; /**< time index; bucket b is stored at b % capacity */
+
+    quint64
+    next_; /**< index of the next entry to be added */
+
+    quint64
+    bucket_next_; /**< index of the next bucket to be added */
+
+    quint64
+    last_of_type_[TYPE_COUNT]; /**< 1 + index of last entry of each type */
+
+public:
+
+    //! Default constructor.
+    UserMsgHist (
+            int capacity = 0);
+
+    //! Destructor.
+    virtual ~UserMsgHist();
+
+
+    //! The maximum number of entries that are kept.
+    int
+    capacity () const {
+        return ring_.count ();
+    }
+
+    //! Change the capacity; this also clears the history.
+    void
+    setCapacity (
+            int value);
+
+    //! The number of entries that are available.
+    int
+    count () const;
+
+    //! Remove all entries.
+    void
+    clear ();
+
+
+    //! Add an entry.
+    void
+    add (
+            const UserMsgEntry & e);
+
+    //! Add all the entries of a message.
+    void
+    add (
+            const UserMsg & um);
+
+
+    //! The last \p n entries, oldest first.
+    QVector<UserMsgEntry>
+    last (
+            int n) const;
+
+    //! The last \p n entries of a type, oldest first.
+    QVector<UserMsgEntry>
+    lastOfType (
+            UserMsgEntry::Type ty,
+            int n) const;
+
+    //! All the entries between two moments (inclusive), oldest first.
+    QVector<UserMsgEntry>
+    between (
+            const QDateTime & from,
+            const QDateTime & to) const;
+
+private:
+
+    //! Index of the oldest entry that is still available.
+    quint64
+    oldest () const {
+        quint64 cap = (quint64)ring_.count ();
+        return next_ > cap ? next_ - cap : 0;
+    }
+
+    //! The key used in time index.
+    static qint64
+    timeKey (
+            const QDateTime & moment);
+
+};
+
+#endif // GUARD_USERMSGHIST_H_INCLUDE
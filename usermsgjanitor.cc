@@ -0,0 +1,184 @@
+/**
+ * @file usermsgjanitor.cc
+ * @brief Definitions for UserMsgJanitor class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgjanitor.h"
+#include "usermsg-private.h"
+#include "usermsgreader.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+/**
+ * @class UserMsgJanitor
+ *
+ * The manager owns one instance. When the log file is rolled
+ * (UserMsgMan::_logRollFeature()) it is only renamed; removing the
+ * old files that are no longer wanted is left to this thread, so the
+ * thread that logs never waits for it.
+ *
+ * The old files (UserMsgReader::rolledFiles()) are considered from
+ * the most recent to the oldest. The first one that breaks a limit
+ * is removed along with all the older ones:
+ * - UserMsgStg::oldLogFilesCount(): how many are kept;
+ * - UserMsgStg::maxTotalSize(): the size of the log file and of the
+ *   old ones, time indexes included, may not exceed this;
+ * - UserMsgStg::maxAge(): files last written more than this many
+ *   seconds ago are removed.
+ *
+ * The log file itself is never removed. The oldest file goes first,
+ * so what is left is always the most recent part of the logs, even
+ * if the process exits half way. A roll only renames the log file
+ * to a new name, so the two never need to wait for each other.
+ */
+
+/* ------------------------------------------------------------------------- */
+UserMsgJanitor::UserMsgJanitor () :
+    QThread (),
+    mutex_ (),
+    wake_ (),
+    log_file_ (),
+    log_count_ (0),
+    max_total_size_ (0),
+    max_age_ (0),
+    pending_ (false),
+    stop_ (false)
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A sweep that was requested but did not run yet is skipped.
+ */
+UserMsgJanitor::~UserMsgJanitor()
+{
+    USERMSG_TRACE_ENTRY;
+    mutex_.lock ();
+    stop_ = true;
+    wake_.wakeAll ();
+    mutex_.unlock ();
+    wait ();
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The thread is started the first time there is a log file.
+ */
+void UserMsgJanitor::setPolicy (
+        const QString & log_file, int log_count,
+        qint64 max_total_size, int max_age)
+{
+    mutex_.lock ();
+    log_file_ = log_file;
+    log_count_ = log_count;
+    max_total_size_ = max_total_size;
+    max_age_ = max_age;
+    mutex_.unlock ();
+    if (!log_file.isEmpty () && !isRunning ()) {
+        start (QThread::LowPriority);
+    }
+    schedule ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgJanitor::schedule ()
+{
+    mutex_.lock ();
+    pending_ = true;
+    wake_.wakeAll ();
+    mutex_.unlock ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgJanitor::sweep ()
+{
+    USERMSG_TRACE_ENTRY;
+
+    mutex_.lock ();
+    QString log_file = log_file_;
+    int log_count = log_count_;
+    qint64 max_total_size = max_total_size_;
+    int max_age = max_age_;
+    mutex_.unlock ();
+    if (log_file.isEmpty ()) {
+        USERMSG_TRACE_EXIT;
+        return;
+    }
+
+    // the most recent first
+    QStringList old_files;
+    foreach(const QString & s_path, UserMsgReader::rolledFiles (log_file)) {
+        old_files.prepend (s_path);
+    }
+
+    qint64 total = QFileInfo (log_file).size () +
+            QFileInfo (UserMsgReader::indexPath (log_file)).size ();
+    QDateTime now = QDateTime::currentDateTimeUtc ();
+    int keep = old_files.count ();
+    for (int i = 0; i < old_files.count (); ++i) {
+        QFileInfo info (old_files.at (i));
+        qint64 size = info.size () +
+                QFileInfo (UserMsgReader::indexPath (old_files.at (i))).size ();
+        total += size;
+        if (((log_count > 0) && (i >= log_count)) ||
+                ((max_total_size > 0) && (total > max_total_size)) ||
+                ((max_age > 0) &&
+                 (info.lastModified ().toUTC ().secsTo (now) > max_age))) {
+            keep = i;
+            break;
+        }
+    }
+
+    for (int i = old_files.count () - 1; i >= keep; --i) {
+        const QString & s_path = old_files.at (i);
+        if (!QFile::remove (s_path)) {
+            printf("Cannot remove old log file");
+            break;
+        }
+        QFile::remove (UserMsgReader::indexPath (s_path));
+    }
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgJanitor::run ()
+{
+    mutex_.lock ();
+    while (!stop_) {
+        if (!pending_) {
+            if (max_age_ > 0) {
+                qint64 interval = qMin (
+                            (qint64)max_age_ * 1000,
+                            (qint64)AGE_CHECK_INTERVAL);
+                wake_.wait (&mutex_, (unsigned long)interval);
+            } else {
+                wake_.wait (&mutex_);
+            }
+            if (stop_)
+                break;
+        }
+        pending_ = false;
+        mutex_.unlock ();
+        sweep ();
+        mutex_.lock ();
+    }
+    mutex_.unlock ();
+}
+/* ========================================================================= */
@@ -0,0 +1,74 @@
+/**
+ * @file usermsgjanitor.h
+ * @brief Declarations for UserMsgJanitor class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGJANITOR_H_INCLUDE
+#define GUARD_USERMSGJANITOR_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+//! Removes the old log files that exceed the retention limits.
+class USERMSG_EXPORT UserMsgJanitor : public QThread {
+
+public:
+
+    enum {
+        //! the longest time between two checks of the age (ms)
+        AGE_CHECK_INTERVAL = 60 * 1000
+    };
+
+private:
+
+    QMutex mutex_; /**< protects the members below */
+    QWaitCondition wake_; /**< wakes the thread early */
+    QString log_file_; /**< the current log file; empty for none */
+    int log_count_; /**< old files to keep; 0 for no limit */
+    qint64 max_total_size_; /**< bytes for all files; 0 for no limit */
+    int max_age_; /**< seconds to keep an old file; 0 for no limit */
+    bool pending_; /**< a sweep was requested */
+    bool stop_; /**< asks the thread to exit */
+
+public:
+
+    //! Default constructor.
+    UserMsgJanitor ();
+
+    //! Destructor; stops the thread.
+    virtual ~UserMsgJanitor();
+
+
+    //! Change the limits and sweep soon.
+    void
+    setPolicy (
+            const QString & log_file,
+            int log_count,
+            qint64 max_total_size,
+            int max_age);
+
+    //! Sweep soon.
+    void
+    schedule ();
+
+    //! Remove the files that exceed the limits, in the calling thread.
+    void
+    sweep ();
+
+protected:
+
+    //! Sweeps when asked and periodically if there is an age limit.
+    void
+    run ();
+
+};
+
+#endif // GUARD_USERMSGJANITOR_H_INCLUDE
@@ -11,12 +11,37 @@
 #include "usermsg-private.h"
 #include "usermsg.h"
 #include "usermsgstg.h"
+#include "usermsgtime.h"
+#include "usermsghist.h"
+#include "usermsgreader.h"
+#include "usermsgcat.h"
+#include "usermsgqt.h"
+#include "usermsgcrash.h"
+#include "usermsgsink.h"
+#include "usermsgmetrics.h"
+#include "usermsgenc.h"
+#include "usermsgjanitor.h"
 
 #include <QThread>
-#include <QTextStream>
+#include <QMutex>
 #include <QDir>
 #include <QRegularExpression>
 #include <QStandardPaths>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QCoreApplication>
+#include <QEvent>
+#include <QFileSystemWatcher>
+#include <QStringList>
+#include <QSettings>
+#include <QFileInfo>
+
+#include <algorithm>
+
+#if defined(Q_OS_UNIX)
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
 
 /**
  * @class UserMsgMan
@@ -41,58 +66,300 @@
  * @endcode
  * at the beginning of your application.
  *
- *
+ * If a QCoreApplication exists when the manager is created the
+ * manager is moved to its thread, so the events and the timers
+ * used to deliver shown messages are handled there.
  */
 
-UserMsgMan * UserMsgMan::singleton_ = NULL;
+QAtomicPointer<UserMsgMan> UserMsgMan::singleton_;
+
+//! Serializes the creation and the destruction of the singleton.
+static QBasicMutex init_mutex;
+
+//! Source for UserMsgMan::generation_.
+static QAtomicInteger<quint64> last_generation;
+
+//! A message waiting in disabled mode.
+struct UserMsgQueued {
+    quint64 sequence; /**< global order of arrival */
+    UserMsg message; /**< the message itself */
+};
 
 enum LockState {
     StateLocked,
     StateUnlocked
 };
 
-//! Aquire the lock; wait for it if necesary.
-#define UM_AQUIRE_LOCK \
-    while (!singleton_->lock_.testAndSetAcquire (StateUnlocked, StateLocked)) { \
-    QThread::usleep (50); \
+//! Values for UserMsgMan::enabled_.
+enum EnableState {
+    ModeDisabled, /**< messages are queued */
+    ModeEnabled, /**< messages are shown */
+    ModeEnabling /**< still queued while enable() drains the queue */
+};
+
+/**
+ * The queue used by one thread in disabled mode.
+ *
+ * Only the owner thread appends to it; the lock is shared
+ * with the thread that drains all the shards in _showQueue().
+ *
+ * The shard is referenced by the manager and by the thread;
+ * whichever lets it go last deletes it. A shard that only the
+ * manager references belongs to a thread that exited and is
+ * removed the next time the queue is drained.
+ */
+class UserMsgQueueShard {
+public:
+    QAtomicInt lock_; /**< protects messages_ */
+    QAtomicInt refs_; /**< the manager and the owner thread */
+    QVector<UserMsgQueued> messages_; /**< messages in arrival order */
+
+    UserMsgQueueShard () :
+        lock_ (StateUnlocked), refs_ (2), messages_ () {}
+
+    //! Drop a reference; the last one deletes the shard.
+    void release () {
+        if (!refs_.deref ())
+            delete this;
+    }
+};
+
+//! The shard of the calling thread and the manager that owns it.
+struct UserMsgLocalShard {
+    quint64 generation; /**< UserMsgMan::generation_ of the owner */
+    UserMsgQueueShard * shard; /**< the shard */
+
+    //! The thread exits; the manager may reclaim the shard.
+    ~UserMsgLocalShard () {
+        if (shard != NULL)
+            shard->release ();
     }
+};
+
+static thread_local UserMsgLocalShard local_shard = { 0, NULL };
+
+//! Asks the manager to schedule the delivery of coalesced messages.
+static const QEvent::Type coalesce_event =
+        (QEvent::Type)QEvent::registerEventType ();
+
+//! Asks the manager to drain UserMsgMan::handoff_.
+static const QEvent::Type handoff_event =
+        (QEvent::Type)QEvent::registerEventType ();
+
+/**
+ * A message shown from another thread, waiting for the thread
+ * of the manager.
+ *
+ * The nodes form a Treiber stack: producers push with a single
+ * compare-and-swap and the consumer takes the whole stack at once
+ * with an exchange, so there is no ABA problem and no lock.
+ */
+struct UserMsgHandoff {
+    UserMsgHandoff * next; /**< the message shown before this one */
+    UserMsg message; /**< the message */
+};
 
-//! Release the lock.
-#define UM_RELEASE_LOCK \
-    while (!singleton_->lock_.testAndSetRelease (StateLocked, StateUnlocked)) { \
+/* ------------------------------------------------------------------------- */
+/**
+ * The time spent waiting is accounted for in UserMsgStats::lock_wait,
+ * so the histogram only describes the waits that were contended.
+ */
+static void acquireLockSlow (QAtomicInt & lock)
+{
+    QElapsedTimer timer;
+    timer.start ();
+    while (!lock.testAndSetAcquire (StateUnlocked, StateLocked)) {
+        QThread::usleep (50);
+    }
+    UserMsgMetrics::recordLockWait (timer.nsecsElapsed ());
+}
+/* ========================================================================= */
+
+/**
+ * Non-zero while the calling thread holds a lock of the manager or
+ * creates or destroys it; see UserMsgMan::_insideManager().
+ */
+static thread_local int inside_manager = 0;
+
+//! Marks the calling thread as inside the manager for its scope.
+class UserMsgInside {
+public:
+    UserMsgInside () { ++inside_manager; }
+    ~UserMsgInside () { --inside_manager; }
+private:
+    Q_DISABLE_COPY(UserMsgInside)
+};
+
+//! Aquire the lock of manager \p p; wait for it if necesary.
+#define UM_AQUIRE_LOCK(p) \
+    do { if (!(p)->lock_.testAndSetAcquire (StateUnlocked, StateLocked)) { \
+    acquireLockSlow ((p)->lock_); \
+    } ++inside_manager; } while (0)
+
+//! Release the lock of manager \p p.
+#define UM_RELEASE_LOCK(p) \
+    do { while (!(p)->lock_.testAndSetRelease (StateLocked, StateUnlocked)) { \
     QThread::usleep (50); \
+    } --inside_manager; } while (0)
+
+/**
+ * A hazard slot: the settings snapshot that one thread reads without
+ * the lock of the manager.
+ *
+ * Each thread that reads the settings that way takes a slot the first
+ * time and gives it back when it exits; slots are never freed, only
+ * reused, so the writer can walk the list at any time. A slot is only
+ * written by its owner, so readers never contend on a cache line.
+ */
+struct UserMsgStgHazard {
+    QAtomicPointer<const UserMsgStg> stg; /**< snapshot in use or NULL */
+    QAtomicInt used; /**< the slot belongs to a thread */
+    UserMsgStgHazard * next; /**< next slot; never changes once published */
+    char padding [64]; /**< keeps the slots on separate cache lines */
+};
+
+//! All the hazard slots ever created.
+static QAtomicPointer<UserMsgStgHazard> stg_hazards;
+
+//! The hazard slot of the calling thread.
+struct UserMsgLocalHazard {
+    UserMsgStgHazard * slot; /**< NULL until the thread reads the settings */
+    int depth; /**< nested readers in this thread */
+
+    //! The thread exits; the slot may be taken by another one.
+    ~UserMsgLocalHazard () {
+        if (slot != NULL) {
+            slot->stg.storeRelease (NULL);
+            slot->used.storeRelease (0);
+        }
+    }
+
+    //! Takes a free slot or adds a new one to the list.
+    UserMsgStgHazard * get () {
+        if (slot != NULL)
+            return slot;
+        for (UserMsgStgHazard * h = stg_hazards.loadAcquire ();
+             h != NULL; h = h->next) {
+            if (h->used.testAndSetAcquire (0, 1)) {
+                slot = h;
+                return slot;
+            }
+        }
+        UserMsgStgHazard * h = new UserMsgStgHazard ();
+        h->used.store (1);
+        UserMsgStgHazard * head = stg_hazards.loadAcquire ();
+        do {
+            h->next = head;
+        } while (!stg_hazards.testAndSetRelease (head, h, head));
+        slot = h;
+        return slot;
+    }
+};
+
+static thread_local UserMsgLocalHazard local_hazard = { NULL, 0 };
+
+/**
+ * Reads the settings snapshot without the lock of the manager.
+ *
+ * The snapshot is kept alive while the object exists: it is published
+ * in the hazard slot of the thread, which _reclaimSettings() checks
+ * before it frees a retired snapshot. Code that holds the lock may use
+ * UserMsgMan::_settings() directly.
+ *
+ * A reader created while another one exists in the same thread uses
+ * the snapshot of the outer one.
+ */
+class UserMsgStgReader {
+public:
+    const UserMsgStg * stg_; /**< the snapshot */
+
+    UserMsgStgReader (UserMsgMan * m) : stg_ (NULL) {
+        UserMsgStgHazard * h = local_hazard.get ();
+        if (local_hazard.depth++ > 0) {
+            stg_ = h->stg.load ();
+            return;
+        }
+        // the slot is set before the pointer is checked again, so
+        // either the writer sees the slot or this sees the new pointer
+        const UserMsgStg * p = m->_settings ();
+        for (;;) {
+            h->stg.fetchAndStoreOrdered (p);
+            const UserMsgStg * again = m->_settings ();
+            if (again == p)
+                break;
+            p = again;
+        }
+        stg_ = p;
+    }
+
+    ~UserMsgStgReader () {
+        if (--local_hazard.depth == 0) {
+            local_hazard.slot->stg.storeRelease (NULL);
+        }
+    }
+
+    const UserMsgStg * operator-> () const {
+        return stg_;
     }
 
+private:
+    Q_DISABLE_COPY(UserMsgStgReader)
+};
+
 /* ------------------------------------------------------------------------- */
 UserMsgMan * UserMsgMan::singleton ()
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
     USERMSG_TRACE_EXIT;
-    return singleton_;
+    return m;
 }
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
 /**
- * Sets the singleton to point to this instance.
+ * The instance is published as the singleton only after
+ * the constructor returns.
  */
 UserMsgMan::UserMsgMan() :
     QObject(),
-    enabled_ (true),
+    enabled_ (ModeEnabled),
+    draining_ (0),
     settings_ (new UserMsgStg()),
-    message_list_ (),
+    retired_settings_ (),
+    settings_watcher_ (NULL),
+    settings_file_ (),
+    shards_ (),
+    sequence_ (0),
+    generation_ (last_generation.fetchAndAddRelaxed (1) + 1),
     lock_ (StateUnlocked),
     kb_show_ (NULL),
     log_file_ (NULL),
-    logger_ (NULL)
+    index_file_ (NULL),
+    index_pending_ (0),
+    history_ (NULL),
+    sinks_ (),
+    sync_ (new UserMsgSync ()),
+    async_ (new UserMsgAsyncWriter (sync_)),
+    async_open_ (false),
+    janitor_ (new UserMsgJanitor ()),
+    sink_latency_ (),
+    stats_dump_ (NULL),
+    coalesced_ (),
+    last_delivery_ (),
+    coalesce_armed_ (false),
+    coalesce_urgent_ (false),
+    coalesce_timer_ (0),
+    handoff_ (NULL)
 {
     USERMSG_TRACE_ENTRY;
-    singleton_ = this;
 
     qRegisterMetaType<UserMsg>("UserMsg");
     qRegisterMetaType<UserMsgEntry>("UserMsgEntry");
 
+    history_ = new UserMsgHist (_settings ()->historyCapacity ());
+    UserMsgCat::applySettings (*_settings ());
+
     _openLogFile ();
 
     USERMSG_TRACE_EXIT;
@@ -101,20 +368,46 @@ UserMsgMan::UserMsgMan() :
 
 /* ------------------------------------------------------------------------- */
 /**
- * Resets the singleton to NULL.
+ * The singleton is reset to NULL by end().
  */
 UserMsgMan::~UserMsgMan()
 {
     USERMSG_TRACE_ENTRY;
-    if (logger_ != NULL) {
-        logger_->flush ();
-        delete logger_;
-    }
+    // the thread uses this instance, so it goes first
+    delete stats_dump_;
+    delete janitor_;
+    delete settings_watcher_;
+    UserMsgCrash::setAsyncWriter (NULL);
+    UserMsgCrash::setLogFile (QString ());
+    // writes what is still queued
+    delete async_;
     if (log_file_ != NULL) {
         delete log_file_;
     }
+    if (index_file_ != NULL) {
+        delete index_file_;
+    }
+    // after the log file was flushed, so nothing written is lost
+    delete sync_;
+    // messages that were not delivered, yet, are lost
+    int lost = coalesced_.count ();
+    UserMsgHandoff * node = handoff_.fetchAndStoreAcquire (NULL);
+    while (node != NULL) {
+        UserMsgHandoff * next = node->next;
+        delete node;
+        node = next;
+        ++lost;
+    }
+    foreach(UserMsgQueueShard * shard, shards_) {
+        lost += shard->messages_.count ();
+        shard->release ();
+    }
+    UserMsgMetrics::addQueued (-lost);
+    qDeleteAll (sink_latency_);
+    delete history_;
+    delete settings_.loadAcquire ();
+    qDeleteAll (retired_settings_);
 
-    singleton_ = NULL;
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
@@ -122,6 +415,14 @@ UserMsgMan::~UserMsgMan()
 /* ------------------------------------------------------------------------- */
 /**
  * A new instance is only created if the singleton is NULL.
+ * Concurrent callers are serialized, so only one instance is
+ * ever created.
+ *
+ * A manager that was created (by a message, for example) before the
+ * QCoreApplication existed lives in the thread that first used it.
+ * Calling this function from that thread once the application exists
+ * moves the manager to the thread of the application, where the
+ * handed off and the coalesced messages are then delivered.
  *
  * @returns true if everything went OK.
  */
@@ -130,8 +431,13 @@ bool UserMsgMan::init (bool start_disabled)
     USERMSG_TRACE_ENTRY;
 
     // create the thingy
-    if (singleton_ == NULL) {
-        new UserMsgMan ();
+    UserMsgMan * m = autostart ();
+
+    // only the thread that owns an object may move it
+    QCoreApplication * app = QCoreApplication::instance ();
+    if ((app != NULL) && (app->thread () != m->thread ()) &&
+            (m->thread () == QThread::currentThread ())) {
+        m->moveToThread (app->thread ());
     }
 
     // disable it
@@ -147,21 +453,41 @@ bool UserMsgMan::init (bool start_disabled)
 
 /* ------------------------------------------------------------------------- */
 /**
- * If the singleton exists is being destroyed.
+ * If the singleton exists is being destroyed. The Qt message handler
+ * (UserMsgQt) is removed first, so that a late qDebug() does not
+ * bring the manager back to life.
+ *
+ * @warning No other thread may be using the manager while
+ * this function runs.
  */
 void UserMsgMan::end ()
 {
     USERMSG_TRACE_ENTRY;
 
-    if (singleton_ != NULL) {
-        delete singleton_;
-        singleton_ = NULL;
+    UserMsgQt::uninstall ();
+    UserMsgInside inside;
+    QMutexLocker locker (&init_mutex);
+    UserMsgMan * m = singleton_.fetchAndStoreOrdered (NULL);
+    if (m != NULL) {
+        delete m;
     }
 
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * A message handler that would call the manager from such a thread
+ * (a Qt warning raised by QFile while the log file is opened, for
+ * example) must not do so; the thread would wait for itself.
+ */
+bool UserMsgMan::_insideManager ()
+{
+    return inside_manager != 0;
+}
+/* ========================================================================= */
+
 /* ------------------------------------------------------------------------- */
 /**
  * This is the only static function that will not create the singleton
@@ -172,7 +498,7 @@ bool UserMsgMan::isInitialized ()
 {
     USERMSG_TRACE_ENTRY;
 
-    bool b_ret = (singleton_ != NULL);
+    bool b_ret = (singleton_.loadAcquire () != NULL);
 
     USERMSG_TRACE_EXIT;
     return b_ret;
@@ -181,40 +507,65 @@ bool UserMsgMan::isInitialized ()
 
 /* ------------------------------------------------------------------------- */
 /**
- * @returns a constant reference to internal settings.
+ * The settings are never changed in place; each change publishes
+ * a new snapshot, so the copy is consistent.
+ *
+ * @returns a copy of the current settings.
  */
-const UserMsgStg & UserMsgMan::settings ()
+UserMsgStg UserMsgMan::settings ()
 {
-    autostart ();
-    return *singleton_->settings_;
+    UserMsgMan * m = autostart ();
+    UserMsgStgReader stg (m);
+    return *stg.stg_;
 }
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
 /**
- *
+ * Readers that loaded the previous snapshot keep using it; the
+ * ones that come after see the new one.
  */
 void UserMsgMan::setSettings (const UserMsgStg & value)
 {
-    autostart ();
-    *singleton_->settings_ = value;
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    const UserMsgStg * previous = m->_settings ();
+    m->_publishSettings (new UserMsgStg (value));
+    m->_applySettings (*previous);
+    m->_reclaimSettings ();
+    UM_RELEASE_LOCK(m);
 }
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
 /**
+ * The file is in INI format and the settings are read from the
+ * `UserMsg` group, as written by UserMsgStg::toQSettings().
+ * The file is loaded right away and then each time it changes.
+ * The watcher is created and configured in the thread of the
+ * manager (see updateSettingsWatcher()), where the changes are also
+ * applied, so an event loop must be running there. An empty path
+ * stops watching.
  *
+ * The log file is only changed if the file has a `s_log_file_` key.
+ *
+ * @returns false if the file could not be loaded.
  */
-void UserMsgMan::disable ()
+bool UserMsgMan::watchSettingsFile (const QString & path)
 {
     USERMSG_TRACE_ENTRY;
+    UserMsgMan * m = autostart ();
 
-    autostart ();
-    UM_AQUIRE_LOCK;
-    singleton_->enabled_ = false;
-    UM_RELEASE_LOCK;
+    UM_AQUIRE_LOCK(m);
+    m->settings_file_ = path;
+    UM_RELEASE_LOCK(m);
+    QMetaObject::invokeMethod (
+                m, "updateSettingsWatcher", Qt::QueuedConnection);
+
+    bool b_ret = path.isEmpty () || m->_loadSettingsFile ();
 
     USERMSG_TRACE_EXIT;
+    return b_ret;
 }
 /* ========================================================================= */
 
@@ -222,16 +573,65 @@ void UserMsgMan::disable ()
 /**
  *
  */
-void UserMsgMan::enable (bool collapse_messages)
+void UserMsgMan::disable ()
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
 
-    singleton_->_showQueue (collapse_messages);
+    UserMsgMan * m = autostart ();
+    m->enabled_.storeRelease (ModeDisabled);
 
-    UM_AQUIRE_LOCK;
-    singleton_->enabled_ = true;
-    UM_RELEASE_LOCK;
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * While the queue is drained the producers keep queuing, so a message
+ * shown concurrently is never presented before an older queued one.
+ * The manager is only switched to enabled mode with all the shards
+ * locked and found empty; a producer re-checks the mode under the
+ * lock of its shard, so it either queued its message before that
+ * (and the queue is drained again) or sees the manager enabled.
+ *
+ * If disable() is called meanwhile the manager stays disabled.
+ *
+ * Only one thread drains the queue at a time (draining_), so the
+ * queued messages are delivered in order even if the manager is
+ * disabled and enabled again while a previous call still drains;
+ * the thread that drains notices the new request and keeps going.
+ */
+void UserMsgMan::enable (bool collapse_messages)
+{
+    USERMSG_TRACE_ENTRY;
+    UserMsgMan * m = autostart ();
+
+    m->enabled_.testAndSetOrdered (ModeDisabled, ModeEnabling);
+
+    // a thread that finds draining_ set leaves its request to the
+    // owner, which checks the mode again after it lets go
+    while ((m->enabled_.loadAcquire () == ModeEnabling) &&
+           m->draining_.testAndSetOrdered (0, 1)) {
+        for (;;) {
+            m->_showQueue (collapse_messages);
+
+            UM_AQUIRE_LOCK(m);
+            bool empty = true;
+            foreach(UserMsgQueueShard * shard, m->shards_) {
+                UM_AQUIRE_LOCK(shard);
+                empty = empty && shard->messages_.isEmpty ();
+            }
+            if (empty) {
+                m->enabled_.testAndSetOrdered (ModeEnabling, ModeEnabled);
+            }
+            foreach(UserMsgQueueShard * shard, m->shards_) {
+                UM_RELEASE_LOCK(shard);
+            }
+            UM_RELEASE_LOCK(m);
+            if (empty || (m->enabled_.loadAcquire () != ModeEnabling))
+                break;
+        }
+        m->draining_.fetchAndStoreOrdered (0);
+    }
 
     USERMSG_TRACE_EXIT;
 }
@@ -241,9 +641,9 @@ void UserMsgMan::enable (bool collapse_messages)
 bool UserMsgMan::isEnabled()
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
     USERMSG_TRACE_EXIT;
-    return (singleton_->enabled_);
+    return (m->enabled_.loadAcquire () == ModeEnabled);
 }
 /* ========================================================================= */
 
@@ -251,9 +651,11 @@ bool UserMsgMan::isEnabled()
 bool UserMsgMan::isVisible (UserMsgEntry::Type value)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
+    UserMsgStgReader stg (m);
+    bool b_ret = stg->isEnabled (value);
     USERMSG_TRACE_EXIT;
-    return (singleton_->settings_->isEnabled (value));
+    return b_ret;
 }
 /* ========================================================================= */
 
@@ -262,8 +664,13 @@ void UserMsgMan::setVisible (
         UserMsgEntry::Type ty, bool b_visible)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
-    (singleton_->settings_->setEnabled (ty, b_visible));
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    UserMsgStg * stg = new UserMsgStg (*m->_settings ());
+    stg->setEnabled (ty, b_visible);
+    m->_publishSettings (stg);
+    m->_reclaimSettings ();
+    UM_RELEASE_LOCK(m);
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
@@ -272,8 +679,13 @@ void UserMsgMan::setVisible (
 void UserMsgMan::setAllVisible (bool include_debug)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
-    (singleton_->settings_->setAllEnabled (include_debug));
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    UserMsgStg * stg = new UserMsgStg (*m->_settings ());
+    stg->setAllEnabled (include_debug);
+    m->_publishSettings (stg);
+    m->_reclaimSettings ();
+    UM_RELEASE_LOCK(m);
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
@@ -282,9 +694,12 @@ void UserMsgMan::setAllVisible (bool include_debug)
 UserMsgMan::KbShowMessage UserMsgMan::callbackShow ()
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    KbShowMessage kb = m->kb_show_;
+    UM_RELEASE_LOCK(m);
     USERMSG_TRACE_EXIT;
-    return singleton_->kb_show_;
+    return kb;
 }
 /* ========================================================================= */
 
@@ -292,19 +707,22 @@ UserMsgMan::KbShowMessage UserMsgMan::callbackShow ()
 void UserMsgMan::setCallbackShow ( UserMsgMan::KbShowMessage value)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
-    singleton_->kb_show_ = value;
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    m->kb_show_ = value;
+    UM_RELEASE_LOCK(m);
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
-const QString & UserMsgMan::logFile()
+QString UserMsgMan::logFile()
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
+    UserMsgStgReader stg (m);
     USERMSG_TRACE_EXIT;
-    return singleton_->settings_->logFile ();
+    return stg->logFile ();
 }
 /* ========================================================================= */
 
@@ -312,12 +730,15 @@ const QString & UserMsgMan::logFile()
 void UserMsgMan::setLogFile (const QString & value)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
 
-    UM_AQUIRE_LOCK;
-    singleton_->settings_->setLogFile (value);
-    singleton_->_openLogFile ();
-    UM_RELEASE_LOCK;
+    UM_AQUIRE_LOCK(m);
+    UserMsgStg * stg = new UserMsgStg (*m->_settings ());
+    stg->setLogFile (value);
+    m->_publishSettings (stg);
+    m->_openLogFile ();
+    m->_reclaimSettings ();
+    UM_RELEASE_LOCK(m);
 
     USERMSG_TRACE_EXIT;
 }
@@ -352,11 +773,57 @@ void UserMsgMan::autosetLogFile (const QString & base_name)
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
-void UserMsgMan::autostart()
+/**
+ * The log file is only rolled when it is opened; a process that logs
+ * for a long time calls this now and then to keep the file within
+ * UserMsgStg::maxLogFileSize(). The writes in flight end before the
+ * file is rolled and the same file is opened again.
+ *
+ * @returns true if the file was rolled
+ */
+bool UserMsgMan::rollLogFile ()
 {
-    if (singleton_ == NULL) {
-        init ();
+    USERMSG_TRACE_ENTRY;
+    UserMsgMan * m = autostart ();
+    bool b_ret = false;
+
+    UM_AQUIRE_LOCK(m);
+    if ((m->log_file_ != NULL) && (m->_settings ()->oldLogFilesCount () > 0)) {
+        qint64 size = m->async_open_ ?
+                    m->async_->position () : m->log_file_->size ();
+        if (size >= m->_settings ()->maxLogFileSize ()) {
+            m->_openLogFile ();
+            b_ret = true;
+        }
+    }
+    UM_RELEASE_LOCK(m);
+
+    USERMSG_TRACE_EXIT;
+    return b_ret;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * This is the slow path of autostart(); the instance is created
+ * under a lock and published with release semantics, so that
+ * the acquire load in autostart() sees a fully constructed manager.
+ */
+UserMsgMan * UserMsgMan::autostartSlow ()
+{
+    UserMsgInside inside;
+    QMutexLocker locker (&init_mutex);
+    UserMsgMan * m = singleton_.loadAcquire ();
+    if (m == NULL) {
+        m = new UserMsgMan ();
+        // events and timers of the manager are handled by the main thread
+        QCoreApplication * app = QCoreApplication::instance ();
+        if ((app != NULL) && (app->thread () != m->thread ())) {
+            m->moveToThread (app->thread ());
+        }
+        singleton_.storeRelease (m);
     }
+    return m;
 }
 /* ========================================================================= */
 
@@ -367,15 +834,15 @@ void UserMsgMan::autostart()
 void UserMsgMan::show (const UserMsg & um)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
 
-    if (singleton_->enabled_) {
-        singleton_->_showMessage (um);
+    if (m->enabled_.loadAcquire () == ModeEnabled) {
+        m->_showMessage (um);
     } else {
-        singleton_->_addMessageToQueue (um);
+        m->_addMessageToQueue (um);
     }
 
-    singleton_->_logMessage (um);
+    m->_logMessage (um);
 
     USERMSG_TRACE_EXIT;
 }
@@ -385,9 +852,9 @@ void UserMsgMan::show (const UserMsg & um)
 void UserMsgMan::logMessage (const UserMsg &um)
 {
     USERMSG_TRACE_ENTRY;
-    autostart ();
+    UserMsgMan * m = autostart ();
 
-    singleton_->_logMessage (um);
+    m->_logMessage (um);
 
     USERMSG_TRACE_EXIT;
 }
@@ -395,23 +862,254 @@ void UserMsgMan::logMessage (const UserMsg &um)
 
 /* ------------------------------------------------------------------------- */
 /**
- * If log is available logs the message, otherwise does nothing.
+ * Pushes everything that was logged so far to the operating system
+ * (the log file and its index).
  */
-void UserMsgMan::_logPrefix (const UserMsgEntry & e)
+void UserMsgMan::flush ()
 {
     USERMSG_TRACE_ENTRY;
-    (*logger_) << "  "
-               << e.moment ().toString (Qt::ISODate)
-               << " ";
+    UserMsgMan * m = autostart ();
+
+    UM_AQUIRE_LOCK(m);
+    if (m->log_file_ != NULL) {
+        m->log_file_->flush ();
+    }
+    if (m->async_open_) {
+        m->async_->flush ();
+    }
+    if (m->index_file_ != NULL) {
+        m->index_file_->flush ();
+    }
+    foreach(UserMsgSink * sink, m->sinks_) {
+        sink->flush ();
+    }
+    UM_RELEASE_LOCK(m);
+
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * The counters are process-wide (see UserMsgMetrics); the sinks and
+ * the synchronization statistics belong to the current manager.
+ */
+UserMsgStats UserMsgMan::stats ()
+{
+    UserMsgMan * m = autostart ();
+    return m->_stats ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgStats UserMsgMan::_stats ()
+{
+    UserMsgStats result;
+    UserMsgMetrics::fill (result);
+    result.sync = sync_->stats ();
+    result.dropped = 0;
+
+    UM_AQUIRE_LOCK(this);
+    result.sinks.reserve (sinks_.count ());
+    for (int i = 0; i < sinks_.count (); ++i) {
+        UserMsgStats::Sink s;
+        s.name = sinks_.at (i)->name ();
+        s.dropped = sinks_.at (i)->dropped ();
+        s.latency = sink_latency_.at (i)->data ();
+        result.dropped += s.dropped;
+        result.sinks.append (s);
+    }
+    UM_RELEASE_LOCK(this);
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The counters kept by the sinks themselves (UserMsgSink::dropped())
+ * are not affected.
+ */
+void UserMsgMan::resetStats ()
+{
+    UserMsgMan * m = autostart ();
+    UserMsgMetrics::reset ();
+    m->sync_->resetStats ();
+    UM_AQUIRE_LOCK(m);
+    foreach(UserMsgHistogram * h, m->sink_latency_) {
+        h->reset ();
+    }
+    UM_RELEASE_LOCK(m);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The file is rewritten in the format of UserMsgStats::toText(); a
+ * previous dump, if any, is stopped first (after a last write).
+ */
+void UserMsgMan::setStatsDump (const QString & path, int interval)
+{
+    UserMsgMan * m = autostart ();
+    UserMsgInside inside;
+    QMutexLocker locker (&init_mutex);
+    if (m->stats_dump_ != NULL) {
+        m->stats_dump_->stop ();
+        m->stats_dump_->dump ();
+        delete m->stats_dump_;
+        m->stats_dump_ = NULL;
+    }
+    if (!path.isEmpty () && (interval > 0)) {
+        m->stats_dump_ = new UserMsgStatsDump (m, path, interval);
+        m->stats_dump_->start (QThread::LowPriority);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * What is measured depends on UserMsgStg::syncMode() (see UserMsgSync).
+ */
+UserMsgSyncStats UserMsgMan::syncStats ()
+{
+    UserMsgMan * m = autostart ();
+    return m->sync_->stats ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMan::resetSyncStats ()
+{
+    UserMsgMan * m = autostart ();
+    m->sync_->resetStats ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The writer is only used if UserMsgStg::asyncWrite() is set.
+ */
+UserMsgAsyncStats UserMsgMan::asyncStats ()
+{
+    UserMsgMan * m = autostart ();
+    return m->async_->stats ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The manager does not take ownership of the sink; a sink that is
+ * already registered is not added again.
+ */
+void UserMsgMan::addSink (UserMsgSink * sink)
+{
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    if ((sink != NULL) && !m->sinks_.contains (sink)) {
+        m->sinks_.append (sink);
+        m->sink_latency_.append (new UserMsgHistogram ());
+    }
+    UM_RELEASE_LOCK(m);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Once this function returns the sink is no longer used by the manager
+ * and may be destroyed.
+ */
+void UserMsgMan::removeSink (UserMsgSink * sink)
+{
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    int i = m->sinks_.indexOf (sink);
+    if (i != -1) {
+        m->sinks_.remove (i);
+        delete m->sink_latency_.at (i);
+        m->sink_latency_.remove (i);
+    }
+    UM_RELEASE_LOCK(m);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The size of the history is set using
+ * UserMsgStg::setHistoryCapacity().
+ */
+QVector<UserMsgEntry> UserMsgMan::recentEntries (int count)
+{
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    QVector<UserMsgEntry> result = m->history_->last (count);
+    UM_RELEASE_LOCK(m);
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The cost is proportional to the number of entries that are
+ * returned, not to the size of the history.
+ */
+QVector<UserMsgEntry> UserMsgMan::recentEntries (
+        UserMsgEntry::Type ty, int count)
+{
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    QVector<UserMsgEntry> result = m->history_->lastOfType (ty, count);
+    UM_RELEASE_LOCK(m);
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The first entry is located using a time index, so the cost is
+ * proportional to the number of entries that are returned.
+ */
+QVector<UserMsgEntry> UserMsgMan::recentEntries (
+        const QDateTime & from, const QDateTime & to)
+{
+    UserMsgMan * m = autostart ();
+    UM_AQUIRE_LOCK(m);
+    QVector<UserMsgEntry> result = m->history_->between (from, to);
+    UM_RELEASE_LOCK(m);
+    return result;
+}
+/* ========================================================================= */
+
+
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The log file is not buffered, so its size is the offset where
+ * next line starts. Neither is the index: each point reaches the file
+ * with a single write, so a reader never sees half of it.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_logIndexPoint (const UserMsgEntry & e)
+{
+    USERMSG_TRACE_ENTRY;
+    QByteArray point;
+    QDataStream out (&point, QIODevice::WriteOnly);
+    qint64 offset = async_open_ ? async_->position () : log_file_->size ();
+    out << (qint64)e.moment ().toMSecsSinceEpoch ()
+        << offset;
+    index_file_->write (point);
+    index_pending_ = 0;
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
 /**
  * If log is available logs the message, otherwise does nothing.
  *
+ * Every UserMsgStg::indexInterval() entries (rounded up to the end
+ * of a message) a point is added to the time index of the log file;
+ * see UserMsgReader.
+ *
  * Each line in the log file starts with a preamble that tells the time
  * when that message was produced, the type of the message and actual content.
  * When a message has more than one line the text is padded without
@@ -425,64 +1123,108 @@ void UserMsgMan::_logPrefix (const UserMsgEntry & e)
  * |                              : that extends on two lines.
  * |  2017-02-10T21:37:46 warning : Warning message
  * |  2017-02-10T21:37:46 debug   : Debug message
+ * |  2017-02-10T21:37:47 info    : Transfer complete bytes=4096 rate=1.5
  * @endcode
+ *
+ * Typed fields of an entry are appended to its last line as
+ * `key=value` pairs (see UserMsgEntry::fieldsText()).
+ *
+ * The message is then passed to the sinks (see addSink()), even if
+ * there is no log file.
+ *
+ * The lines of the message are rendered by the UserMsgEncoder of the
+ * calling thread and written with a single call.
+ *
+ * The log file is pushed to the disk as UserMsgStg::syncMode() asks.
  */
 void UserMsgMan::_logMessage (const UserMsg & um)
 {
     USERMSG_TRACE_ENTRY;
 
-    if (logger_ != NULL) {
+    int i_max = um.count ();
+    if (i_max > 0) {
 
-        int i_max = um.count ();
-        if (i_max > 0) {
+        // rendered before the lock is taken; there is a log file
+        // if the settings name one
+        UserMsgEncoder & enc = UserMsgEncoder::local ();
+        enc.reset ();
+        if (!UserMsgStgReader (this)->logFile ().isEmpty ()) {
+            enc.encodeMessage (um);
+        }
 
-            UM_AQUIRE_LOCK;
-            const QString & t = um.title ();
-            if (t.isEmpty ()) {
-                _logPrefix (um.at (0));
-                (*logger_) << "title   ";
-                (*logger_) << um.title () << endl;
+        // synchronized after the lock is released (SYNC_ERRORS)
+        int sync_fd = -1;
+        bool sync_async = false;
+
+        UM_AQUIRE_LOCK(this);
+        history_->add (um);
+        if ((log_file_ != NULL) && (enc.size () > 0)) {
+            int sync_mode = _settings ()->syncMode ();
+            bool has_error = false;
+
+            if (index_file_ != NULL) {
+                if (index_pending_ >= _settings ()->indexInterval ()) {
+                    _logIndexPoint (um.at (0));
+                }
+                index_pending_ += i_max;
             }
 
             for (int i = 0; i < i_max; ++i) {
                 const UserMsgEntry & e = um.at (i);
-                _logPrefix (e);
-
-                switch (e.type ()) {
-                case UserMsgEntry::UTERROR: {
-                    (*logger_) << "error   ";
-                    break; }
-                case UserMsgEntry::UTWARNING: {
-                    (*logger_) << "warning ";
-                    break; }
-                case UserMsgEntry::UTINFO: {
-                    (*logger_) << "info    ";
-                    break; }
-                case UserMsgEntry::UTDBG_ERROR: {
-                    (*logger_) << "derror  ";
-                    break; }
-                case UserMsgEntry::UTDBG_WARNING: {
-                    (*logger_) << "dwarning";
-                    break; }
-                case UserMsgEntry::UTDBG_INFO: {
-                    (*logger_) << "debug   ";
-                    break; }
-                default: {
-                    (*logger_) << "null    ";
-                    break; }
+                UserMsgMetrics::countAccepted (e.type ());
+                if ((e.type () == UserMsgEntry::UTERROR) ||
+                        (e.type () == UserMsgEntry::UTDBG_ERROR)) {
+                    has_error = true;
+                }
+            }
+
+            if (async_open_) {
+                async_->write (enc.data (), enc.size ());
+                UserMsgMetrics::addBytesWritten (enc.size ());
+            } else {
+                QElapsedTimer write_timer;
+                write_timer.start ();
+                qint64 written = log_file_->write (enc.data (), enc.size ());
+                if (sync_mode == UserMsgStg::SYNC_DSYNC) {
+                    // the write waited for the disk
+                    sync_->recordLatency (write_timer.nsecsElapsed ());
                 }
-                (*logger_) << ": ";
-
-                // Have the start of the text align with the rest of the
-                // message in lines other than the first
-                // for redability.
-                static QChar new_line ('\n');
-                static QLatin1String new_line_padding (
-                            "\n                              : ");
-                QString final = e.message ();
-                (*logger_) << final.replace (new_line, new_line_padding, Qt::CaseInsensitive) << endl;
+                if (written > 0) {
+                    UserMsgMetrics::addBytesWritten (written);
+                }
+            }
+
+            if (UserMsgCrash::isInstalled ()) {
+                for (int i = 0; i < i_max; ++i) {
+                    UserMsgCrash::record (um.at (i));
+                }
+            }
+
+            if (sync_mode == UserMsgStg::SYNC_PERIODIC) {
+                sync_->markDirty ();
+            } else if ((sync_mode == UserMsgStg::SYNC_ERRORS) && has_error) {
+                // the file may be rolled meanwhile; the copy stays valid
+                sync_fd = UserMsgSync::duplicate (log_file_->handle ());
+                sync_async = async_open_;
+            }
+        } else {
+            for (int i = 0; i < i_max; ++i) {
+                UserMsgMetrics::countAccepted (um.at (i).type ());
             }
-            UM_RELEASE_LOCK;
+        }
+        for (int i = 0; i < sinks_.count (); ++i) {
+            QElapsedTimer sink_timer;
+            sink_timer.start ();
+            sinks_.at (i)->write (um);
+            sink_latency_.at (i)->record (sink_timer.nsecsElapsed ());
+        }
+        UM_RELEASE_LOCK(this);
+
+        if (sync_fd != -1) {
+            if (sync_async) {
+                async_->flush ();
+            }
+            sync_->syncDuplicate (sync_fd);
         }
     }
 
@@ -493,13 +1235,122 @@ void UserMsgMan::_logMessage (const UserMsg & um)
 /* ------------------------------------------------------------------------- */
 /**
  * Presents a message to the user.
+ *
+ * With UserMsgStg::showHandoff() a message shown from a thread other
+ * than the one of the manager is pushed on a lock-free stack and the
+ * function returns at once; the first message pushed on an empty stack
+ * posts a single event and the thread of the manager then delivers
+ * everything that was pushed, in order. The thread of the manager
+ * delivers what is waiting before its own messages, so the order is
+ * preserved for it as well.
+ *
+ * The thread of the manager is the one of the QCoreApplication, if
+ * one existed when the manager was created; otherwise it is the
+ * thread that first used the manager, until init() is called from
+ * that thread once the application exists (see init()). That thread
+ * needs an event loop for the messages to be delivered.
  */
 void UserMsgMan::_showMessage (const UserMsg & um)
 {
     USERMSG_TRACE_ENTRY;
 
-    if (kb_show_ != NULL)
-        kb_show_ (um);
+    bool handoff = UserMsgStgReader (this)->showHandoff ();
+
+    if (handoff && (QThread::currentThread () != thread ())) {
+        UserMsgHandoff * node = new UserMsgHandoff ();
+        node->message = um;
+        UserMsgHandoff * head = handoff_.loadAcquire ();
+        do {
+            node->next = head;
+        } while (!handoff_.testAndSetRelease (head, node, head));
+        UserMsgMetrics::addQueued (1);
+        if (head == NULL) {
+            QCoreApplication::postEvent (this, new QEvent (handoff_event));
+        }
+        return;
+    }
+
+    if (handoff_.loadAcquire () != NULL) {
+        _drainHandoff ();
+    }
+    _presentMessage (um);
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The stack is taken in one step and reversed, so the messages are
+ * delivered in the order they were shown.
+ */
+void UserMsgMan::_drainHandoff ()
+{
+    USERMSG_TRACE_ENTRY;
+
+    UserMsgHandoff * node = handoff_.fetchAndStoreAcquire (NULL);
+    UserMsgHandoff * ordered = NULL;
+    while (node != NULL) {
+        UserMsgHandoff * next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+    }
+    while (ordered != NULL) {
+        UserMsgHandoff * next = ordered->next;
+        UserMsgMetrics::addQueued (-1);
+        _presentMessage (ordered->message);
+        delete ordered;
+        ordered = next;
+    }
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Invokes the callback and emits the signal for a message.
+ *
+ * If UserMsgStg::coalesceInterval() is not 0 the message is added to
+ * the ones waiting and they are delivered together, merged by moment,
+ * at most once per interval. The delivery always happens in the
+ * thread where the manager lives (an event loop must run there): the
+ * first message that finds nothing scheduled posts an event and a
+ * timer of that thread delivers the rest, so batches are never
+ * delivered by two threads at once. A message with errors asks for
+ * a delivery without waiting for the interval if
+ * UserMsgStg::coalesceErrors() is set.
+ */
+void UserMsgMan::_presentMessage (const UserMsg & um)
+{
+    USERMSG_TRACE_ENTRY;
+
+    UM_AQUIRE_LOCK(this);
+    KbShowMessage kb = kb_show_;
+    if (_settings ()->coalesceInterval () > 0) {
+        coalesced_.append (um);
+        UserMsgMetrics::addQueued (1);
+        bool post = !coalesce_armed_;
+        coalesce_armed_ = true;
+        if (!coalesce_urgent_ && _settings ()->coalesceErrors () &&
+                (um.errorCount () > 0)) {
+            // the timer may be waiting; wake the thread of the manager
+            coalesce_urgent_ = true;
+            post = true;
+        }
+        UM_RELEASE_LOCK(this);
+
+        if (post) {
+            QCoreApplication::postEvent (this, new QEvent (coalesce_event));
+        }
+        USERMSG_TRACE_EXIT;
+        return;
+    }
+    UM_RELEASE_LOCK(this);
+
+    if (kb != NULL)
+        kb (um);
     emit signalShow (um);
 
     USERMSG_TRACE_EXIT;
@@ -508,97 +1359,295 @@ void UserMsgMan::_showMessage (const UserMsg & um)
 
 /* ------------------------------------------------------------------------- */
 /**
- * .
+ * The waiting messages are merged in a single one (see
+ * UserMsg::mergeSorted()); the callback and the signal are invoked
+ * without holding the lock. Only the thread of the manager calls
+ * this, so the batches are delivered in order.
+ *
+ * @returns the number of milliseconds until the messages may be
+ * delivered or 0 if there was nothing left to deliver
+ */
+int UserMsgMan::_deliverCoalesced (bool force)
+{
+    USERMSG_TRACE_ENTRY;
+
+    UM_AQUIRE_LOCK(this);
+    if (coalesced_.isEmpty ()) {
+        UM_RELEASE_LOCK(this);
+        return 0;
+    }
+    qint64 interval = _settings ()->coalesceInterval ();
+    qint64 elapsed = last_delivery_.isValid () ?
+                last_delivery_.elapsed () : interval;
+    if (!force && !coalesce_urgent_ && (elapsed < interval)) {
+        UM_RELEASE_LOCK(this);
+        return (int)(interval - elapsed);
+    }
+    QVector<UserMsg> batch;
+    batch.swap (coalesced_);
+    coalesce_armed_ = false;
+    coalesce_urgent_ = false;
+    last_delivery_.start ();
+    KbShowMessage kb = kb_show_;
+    UM_RELEASE_LOCK(this);
+
+    UserMsgMetrics::addQueued (-batch.count ());
+    UserMsgMetrics::addSuppressed (batch.count () - 1);
+    UserMsg um = batch.count () == 1 ?
+                batch.first () : UserMsg::mergeSorted (batch);
+    if (kb != NULL)
+        kb (um);
+    emit signalShow (um);
+
+    USERMSG_TRACE_EXIT;
+    return 0;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Useful when there is no event loop in the thread of the manager
+ * or before the application quits. The messages handed off by other
+ * threads (UserMsgStg::showHandoff()) are delivered as well.
+ *
+ * Messages are only delivered by the thread of the manager: called
+ * from another thread, this asks that thread to deliver them as soon
+ * as its event loop runs and returns at once.
+ */
+void UserMsgMan::deliverShown ()
+{
+    USERMSG_TRACE_ENTRY;
+    UserMsgMan * m = autostart ();
+    if (QThread::currentThread () == m->thread ()) {
+        m->_drainHandoff ();
+        m->_deliverCoalesced (true);
+    } else {
+        UM_AQUIRE_LOCK(m);
+        bool post = !m->coalesced_.isEmpty ();
+        m->coalesce_armed_ = m->coalesce_armed_ || post;
+        m->coalesce_urgent_ = m->coalesce_urgent_ || post;
+        UM_RELEASE_LOCK(m);
+        QCoreApplication::postEvent (m, new QEvent (handoff_event));
+        if (post) {
+            QCoreApplication::postEvent (m, new QEvent (coalesce_event));
+        }
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Runs in the thread of the manager, which owns the timer.
+ */
+void UserMsgMan::customEvent (QEvent * event)
+{
+    if (event->type () == handoff_event) {
+        _drainHandoff ();
+        return;
+    }
+    if (event->type () != coalesce_event) {
+        QObject::customEvent (event);
+        return;
+    }
+    int remaining = _deliverCoalesced (false);
+    if (remaining > 0) {
+        if (coalesce_timer_ == 0) {
+            coalesce_timer_ = startTimer (remaining, Qt::PreciseTimer);
+        }
+    } else if (coalesce_timer_ != 0) {
+        // an urgent delivery took what the timer was waiting for
+        killTimer (coalesce_timer_);
+        coalesce_timer_ = 0;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMan::timerEvent (QTimerEvent * event)
+{
+    if (event->timerId () != coalesce_timer_) {
+        QObject::timerEvent (event);
+        return;
+    }
+    killTimer (coalesce_timer_);
+    coalesce_timer_ = 0;
+    int remaining = _deliverCoalesced (false);
+    if (remaining > 0) {
+        coalesce_timer_ = startTimer (remaining, Qt::PreciseTimer);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Orders queued messages by the moment of their first entry and,
+ * for equal moments or empty messages, by the order of arrival.
+ */
+static inline bool queuedBefore (
+        const UserMsgQueued & a, const UserMsgQueued & b)
+{
+    if ((a.message.count () > 0) && (b.message.count () > 0)) {
+        const QDateTime & ma = a.message.at (0).moment ();
+        const QDateTime & mb = b.message.at (0).moment ();
+        if (ma < mb) return true;
+        if (mb < ma) return false;
+    }
+    return a.sequence < b.sequence;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Position inside one of the shards being merged.
+struct UserMsgCursor {
+    const QVector<UserMsgQueued> * list; /**< the messages of a shard */
+    int index; /**< next message to take */
+};
+
+//! Heap order for cursors; the smallest message ends up on top.
+static inline bool cursorAfter (
+        const UserMsgCursor & a, const UserMsgCursor & b)
+{
+    return queuedBefore (b.list->at (b.index), a.list->at (a.index));
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Each shard is swapped out under its own lock, so producers are
+ * only held for the duration of a swap. The shards are then merged
+ * (k-way, using a heap) by timestamp and sequence number, so the
+ * order in which the messages are presented does not depend on the
+ * thread that produced them.
+ *
+ * The callback and the signal are invoked without holding any lock.
  */
 void UserMsgMan::_showQueue (bool collapse_messages)
 {
     USERMSG_TRACE_ENTRY;
-    UM_AQUIRE_LOCK;
 
-    if (collapse_messages) {
-        UserMsg um_all;
-        foreach(const UserMsg & um, message_list_) {
-            um_all.append (um);
+    QVector<QVector<UserMsgQueued> > drained;
+    UM_AQUIRE_LOCK(this);
+    KbShowMessage kb = kb_show_;
+    drained.reserve (shards_.count ());
+    for (int i = shards_.count () - 1; i >= 0; --i) {
+        UserMsgQueueShard * shard = shards_.at (i);
+        UM_AQUIRE_LOCK(shard);
+        if (!shard->messages_.isEmpty ()) {
+            drained.append (QVector<UserMsgQueued> ());
+            drained.last ().swap (shard->messages_);
+        }
+        // the owner exited, so nothing will be added to it any more
+        bool orphan = (shard->refs_.loadAcquire () == 1);
+        UM_RELEASE_LOCK(shard);
+        if (orphan) {
+            shards_.remove (i);
+            shard->release ();
         }
-        if (kb_show_ != NULL)
-            kb_show_ (um_all);
+    }
+    UM_RELEASE_LOCK(this);
+
+    QVector<UserMsgCursor> heap;
+    int total = 0;
+    heap.reserve (drained.count ());
+    for (int i = 0; i < drained.count (); ++i) {
+        UserMsgCursor c = { &drained.at (i), 0 };
+        heap.append (c);
+        total += drained.at (i).count ();
+    }
+    UserMsgMetrics::addQueued (-total);
+    std::make_heap (heap.begin (), heap.end (), cursorAfter);
+
+    QVector<const UserMsg *> ordered;
+    ordered.reserve (total);
+    while (!heap.isEmpty ()) {
+        std::pop_heap (heap.begin (), heap.end (), cursorAfter);
+        UserMsgCursor & c = heap.last ();
+        ordered.append (&c.list->at (c.index).message);
+        if (++c.index < c.list->count ()) {
+            std::push_heap (heap.begin (), heap.end (), cursorAfter);
+        } else {
+            heap.removeLast ();
+        }
+    }
+
+    if (ordered.isEmpty ()) {
+        // nothing to show
+    } else if (collapse_messages) {
+        UserMsgMetrics::addSuppressed (ordered.count () - 1);
+        UserMsg um_all = UserMsg::mergeSorted (
+                    ordered.constData (), ordered.count ());
+        if (kb != NULL)
+            kb (um_all);
         emit signalShow (um_all);
     } else {
-        foreach(const UserMsg & um, message_list_) {
-            if (kb_show_ != NULL)
-                kb_show_ (um);
-            emit signalShow (um);
+        foreach(const UserMsg * um, ordered) {
+            if (kb != NULL)
+                kb (*um);
+            emit signalShow (*um);
         }
     }
 
-    message_list_.clear ();
-    UM_RELEASE_LOCK;
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * An existing \p to (a stale time index, for example) is replaced.
+ */
+static bool moveFile (const QString & from, const QString & to)
+{
+    if (!QFile::exists (from))
+        return true;
+#if defined(Q_OS_UNIX)
+    return ::rename (
+                QFile::encodeName (from).constData (),
+                QFile::encodeName (to).constData ()) == 0;
+#else
+    QFile::remove (to);
+    return QFile::rename (from, to);
+#endif
+}
+/* ========================================================================= */
+
 /* ------------------------------------------------------------------------- */
 /**
  * This method checks to see if the trigger file size was reached an,
- * if so, starts the roll feature:
+ * if so, renames the current log file after the moment it was rolled
+ * (see UserMsgReader::rolledPath()).
+ *
+ * The old files keep their names, so a roll is a single rename no
+ * matter how many there are, and none is removed here; the files
+ * beyond UserMsgStg::oldLogFilesCount() and those that exceed the
+ * other limits are removed by the janitor thread (see UserMsgJanitor),
+ * which does not need to be stopped meanwhile.
  *
- * - deletes last possible log file;
- * - moves each log file to next number;
- * - moves current log file to log.1.
+ * The time index of the file (see UserMsgReader) follows its file.
  */
 void UserMsgMan::_logRollFeature (const QString & s_log_file_path)
 {
     USERMSG_TRACE_ENTRY;
 
-    for (;;) {
-        int roll_trigger = settings_->maxLogFileSize ();
-        int log_count = settings_->oldLogFilesCount ();
+    int roll_trigger = _settings ()->maxLogFileSize ();
 
-        // Check the size to see if we need to do this at this time?
-        QFile current_file (s_log_file_path);
-        if (current_file.size() < roll_trigger) {
-            break;
-        }
+    // Check the size to see if we need to do this at this time?
+    if (QFileInfo (s_log_file_path).size () >= roll_trigger) {
 
-        // We do; start by deleting the last file, if any.
-        static const QString roll_files ("%1.%2");
-        QFile last_file (
-                    QString (roll_files)
-                    .arg (s_log_file_path)
-                    .arg (log_count));
-        if (last_file.exists()) {
-            if (!last_file.remove ()) {
-                printf("Cannot remove last log file");
-            }
+        // a later moment if the file was rolled in the same millisecond
+        QDateTime moment = QDateTime::currentDateTimeUtc ();
+        QString to = UserMsgReader::rolledPath (s_log_file_path, moment);
+        while (QFile::exists (to)) {
+            moment = moment.addMSecs (1);
+            to = UserMsgReader::rolledPath (s_log_file_path, moment);
         }
 
-        // Next, move each file to next number.
-        QString to = last_file.fileName ();
-        QString from;
-        for (int i = log_count-1; i > 0; --i) {
-            from = QString (roll_files)
-                    .arg (s_log_file_path)
-                    .arg (i);
-            QFile file (from);
-            if (file.exists()) {
-                if (!file.copy (to)) {
-                    printf("Cannot copy log file");
-                }
-                if (!file.remove ()) {
-                    printf("Cannot move log file");
-                }
-            }
-            to = from;
-        }
-
-        // Finally move current file out of the way.
-        if (!current_file.copy (to)) {
-            printf("Cannot copy current log file");
-        }
-        if (!current_file.remove ()) {
+        if (!moveFile (s_log_file_path, to)) {
             printf("Cannot move current log file");
         }
-        break;
+        moveFile (
+                    UserMsgReader::indexPath (s_log_file_path),
+                    UserMsgReader::indexPath (to));
     }
 
     USERMSG_TRACE_EXIT;
@@ -613,11 +1662,11 @@ void UserMsgMan::_openLogFile ()
 {
     USERMSG_TRACE_ENTRY;
 
-    if (logger_ != NULL) {
-        logger_->flush ();
-        delete logger_;
-        logger_ = NULL;
-    }
+    UserMsgCrash::setAsyncWriter (NULL);
+    UserMsgCrash::setLogFile (QString ());
+    // the writes in flight end before the files are rolled
+    async_->setFile (QString ());
+    async_open_ = false;
 
     if (log_file_ != NULL) {
         if (log_file_->isOpen ()) {
@@ -627,11 +1676,18 @@ void UserMsgMan::_openLogFile ()
         log_file_ = NULL;
     }
 
-    const QString & s_log_file_path = settings_->logFile ();
+    if (index_file_ != NULL) {
+        delete index_file_;
+        index_file_ = NULL;
+    }
+
+    const QString & s_log_file_path = _settings ()->logFile ();
     if (!s_log_file_path.isEmpty ()) {
 
-        int flg = QIODevice::WriteOnly | QIODevice::Text;
-        if (settings_->oldLogFilesCount () == 0) {
+        // each message is written with a single call, so QFile
+        // does not need to buffer it
+        int flg = QIODevice::WriteOnly | QIODevice::Text | QIODevice::Unbuffered;
+        if (_settings ()->oldLogFilesCount () == 0) {
             // 0 will overwrite the log file on each start
         } else {
             flg = flg | QIODevice::Append;
@@ -639,8 +1695,45 @@ void UserMsgMan::_openLogFile ()
         }
 
         log_file_ = new QFile (s_log_file_path);
-        if (log_file_->open ((QIODevice::OpenModeFlag)flg)) {
-            logger_ = new QTextStream (log_file_);
+        bool b_open = false;
+#if defined(Q_OS_UNIX) && defined(O_DSYNC)
+        if (_settings ()->syncMode () == UserMsgStg::SYNC_DSYNC) {
+            int fd = ::open (
+                        QFile::encodeName (s_log_file_path).constData (),
+                        O_WRONLY | O_CREAT | O_CLOEXEC | O_DSYNC |
+                        ((flg & QIODevice::Append) ? O_APPEND : O_TRUNC),
+                        0666);
+            if (fd != -1) {
+                b_open = log_file_->open (
+                            fd, (QIODevice::OpenModeFlag)flg,
+                            QFileDevice::AutoCloseHandle);
+                if (!b_open) {
+                    ::close (fd);
+                }
+            }
+        } else {
+            b_open = log_file_->open ((QIODevice::OpenModeFlag)flg);
+        }
+#else
+        b_open = log_file_->open ((QIODevice::OpenModeFlag)flg);
+#endif
+        if (b_open) {
+            if (_settings ()->asyncWrite ()) {
+                // falls back to writing log_file_ if the file cannot
+                // be opened a second time
+                async_open_ = async_->setFile (
+                            s_log_file_path,
+                            _settings ()->syncMode () == UserMsgStg::SYNC_DSYNC);
+            }
+            UserMsgCrash::setLogFile (s_log_file_path);
+            if (async_open_) {
+                UserMsgCrash::setAsyncWriter (async_);
+            }
+            if (_settings ()->indexInterval () > 0) {
+                // unbuffered, so a reader sees each point at once
+                _openIndexFile ((QIODevice::OpenModeFlag)(
+                        flg & ~QIODevice::Text));
+            }
         } else {
             printf("Failed to open log file; logging will "
                    "be disabled in this session.\n");
@@ -648,6 +1741,210 @@ void UserMsgMan::_openLogFile ()
             log_file_ = NULL;
         }
     }
+    _applySyncMode ();
+    _applyRetention ();
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Writers are serialized by the lock. The old snapshot may still
+ * be in use by a reader, so it is only retired; the caller frees it
+ * with _reclaimSettings() once it no longer needs it either.
+ *
+ * The categories (UserMsgCat) are resolved again from the new
+ * snapshot in the same critical section, so two setters running
+ * at the same time cannot leave them with the older settings.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_publishSettings (UserMsgStg * value)
+{
+    const UserMsgStg * previous = settings_.fetchAndStoreOrdered (value);
+    retired_settings_.append (previous);
+    UserMsgCat::applySettings (*value);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A reader that does not hold the lock (UserMsgStgReader) publishes
+ * the snapshot it uses in the hazard slot of its thread and then
+ * checks that the pointer did not change, while the writer walks the
+ * slots after the new snapshot was published. Both steps are ordered,
+ * so a retired snapshot that no slot holds cannot be in use.
+ *
+ * Only the snapshots that a reader still holds are kept, so at most
+ * one per thread reading at the time survives a call; they are freed
+ * by a later setter or by the destructor.
+ *
+ * Readers that hold the lock never see a snapshot freed under them,
+ * as this runs with the lock held.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_reclaimSettings ()
+{
+    if (retired_settings_.isEmpty ())
+        return;
+    QVector<const UserMsgStg*> in_use;
+    for (UserMsgStgHazard * h = stg_hazards.loadAcquire ();
+         h != NULL; h = h->next) {
+        const UserMsgStg * p = h->stg.loadAcquire ();
+        if (p != NULL)
+            in_use.append (p);
+    }
+    QVector<const UserMsgStg*> kept;
+    foreach(const UserMsgStg * p, retired_settings_) {
+        if (in_use.contains (p)) {
+            kept.append (p);
+        } else {
+            delete p;
+        }
+    }
+    retired_settings_.swap (kept);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Called after the new snapshot was published.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_applySettings (const UserMsgStg & previous)
+{
+    const UserMsgStg * current = _settings ();
+    if (history_->capacity () != current->historyCapacity ()) {
+        history_->setCapacity (current->historyCapacity ());
+    }
+    bool was_dsync = (previous.syncMode () == UserMsgStg::SYNC_DSYNC);
+    bool is_dsync = (current->syncMode () == UserMsgStg::SYNC_DSYNC);
+    if ((previous.logFile () != current->logFile ()) ||
+            ((log_file_ != NULL) &&
+             ((was_dsync != is_dsync) ||
+              (previous.asyncWrite () != current->asyncWrite ())))) {
+        // O_DSYNC can only be set when the file is opened
+        _openLogFile ();
+    } else {
+        _applySyncMode ();
+        _applyRetention ();
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The path of the log file is kept unless the file names one.
+ */
+bool UserMsgMan::_loadSettingsFile ()
+{
+    UM_AQUIRE_LOCK(this);
+    QString path = settings_file_;
+    QString log_file = _settings ()->logFile ();
+    UM_RELEASE_LOCK(this);
+    if (path.isEmpty () || !QFileInfo (path).isFile ())
+        return false;
+
+    QSettings file (path, QSettings::IniFormat);
+    UserMsgStg stg;
+    if (!stg.fromQSettings (&file))
+        return false;
+    if (!file.contains ("UserMsg/s_log_file_")) {
+        stg.setLogFile (log_file);
+    }
+    setSettings (stg);
+    return true;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Runs in the thread of the manager, which owns the watcher, so
+ * the watcher is used without the lock of the manager.
+ */
+void UserMsgMan::updateSettingsWatcher ()
+{
+    USERMSG_TRACE_ENTRY;
+    UM_AQUIRE_LOCK(this);
+    QString path = settings_file_;
+    UM_RELEASE_LOCK(this);
+
+    if (settings_watcher_ == NULL) {
+        settings_watcher_ = new QFileSystemWatcher (this);
+        connect (settings_watcher_, &QFileSystemWatcher::fileChanged,
+                 this, &UserMsgMan::settingsFileChanged);
+    }
+    QStringList watched = settings_watcher_->files ();
+    if (!watched.isEmpty ()) {
+        settings_watcher_->removePaths (watched);
+    }
+    if (!path.isEmpty ()) {
+        settings_watcher_->addPath (path);
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Editors often save by writing a new file and renaming it over the
+ * old one, which removes the path from the watcher; it is added back.
+ */
+void UserMsgMan::settingsFileChanged (const QString & path)
+{
+    USERMSG_TRACE_ENTRY;
+    UM_AQUIRE_LOCK(this);
+    bool current = (path == settings_file_);
+    UM_RELEASE_LOCK(this);
+    if (current) {
+        if (!settings_watcher_->files ().contains (path)) {
+            settings_watcher_->addPath (path);
+        }
+        _loadSettingsFile ();
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The janitor sweeps the old log files soon after.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_applyRetention ()
+{
+    const UserMsgStg * stg = _settings ();
+    janitor_->setPolicy (
+                log_file_ != NULL ? stg->logFile () : QString (),
+                stg->oldLogFilesCount (),
+                stg->maxTotalSize (),
+                stg->maxAge ());
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The thread only runs in UserMsgStg::SYNC_PERIODIC mode and only
+ * while a log file is open.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_applySyncMode ()
+{
+    USERMSG_TRACE_ENTRY;
+
+    if ((log_file_ != NULL) &&
+            (_settings ()->syncMode () == UserMsgStg::SYNC_PERIODIC)) {
+        sync_->setHandle (log_file_->handle ());
+        sync_->startPeriodic (_settings ()->syncInterval ());
+    } else {
+        sync_->stopPeriodic ();
+        sync_->setHandle (-1);
+    }
 
     USERMSG_TRACE_EXIT;
 }
@@ -655,21 +1952,79 @@ void UserMsgMan::_openLogFile ()
 
 /* ------------------------------------------------------------------------- */
 /**
- * .
+ * The index is opened with the same mode as the log file, so it is
+ * either continued or truncated along with it. The first message
+ * logged after this call starts a new index point.
+ *
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgMan::_openIndexFile (int flg)
+{
+    USERMSG_TRACE_ENTRY;
+
+    index_file_ = new QFile (UserMsgReader::indexPath (log_file_->fileName ()));
+    if (index_file_->open ((QIODevice::OpenModeFlag)flg)) {
+        if (index_file_->size () == 0) {
+            index_file_->write (
+                        UserMsgReader::index_magic,
+                        sizeof(UserMsgReader::index_magic));
+        }
+        index_pending_ = _settings ()->indexInterval ();
+    } else {
+        printf("Failed to open log index file; the log will "
+               "not be indexed in this session.\n");
+        delete index_file_;
+        index_file_ = NULL;
+    }
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The message goes to the shard of the calling thread, so producers
+ * on different threads do not contend with each other.
  */
 void UserMsgMan::_addMessageToQueue (const UserMsg & um)
 {
     USERMSG_TRACE_ENTRY;
-    UM_AQUIRE_LOCK;
-    if (enabled_) {
-        UM_RELEASE_LOCK;
+    UserMsgQueueShard * shard = _localShard ();
+    UM_AQUIRE_LOCK(shard);
+    if (enabled_.loadAcquire () == ModeEnabled) {
+        UM_RELEASE_LOCK(shard);
         _showMessage (um);
     } else {
-        message_list_.append (um);
-        UM_RELEASE_LOCK;
+        UserMsgQueued q = { sequence_.fetchAndAddRelaxed (1), um };
+        shard->messages_.append (q);
+        UM_RELEASE_LOCK(shard);
+        UserMsgMetrics::addQueued (1);
     }
     USERMSG_TRACE_EXIT;
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * The shard is created and registered with the manager the first
+ * time a thread needs it; afterwards it is found in thread-local
+ * storage without any locking.
+ */
+UserMsgQueueShard * UserMsgMan::_localShard ()
+{
+    if (local_shard.generation != generation_) {
+        // the shard of a previous manager
+        if (local_shard.shard != NULL)
+            local_shard.shard->release ();
+        UserMsgQueueShard * shard = new UserMsgQueueShard ();
+        UM_AQUIRE_LOCK(this);
+        shards_.append (shard);
+        UM_RELEASE_LOCK(this);
+        local_shard.generation = generation_;
+        local_shard.shard = shard;
+    }
+    return local_shard.shard;
+}
+/* ========================================================================= */
+
 void UserMsgMan::anchorVtable () const {}
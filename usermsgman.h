@@ -12,22 +12,36 @@
 
 #include <usermsg/usermsg-config.h>
 #include <usermsg/usermsg.h>
+#include <usermsg/usermsgsync.h>
+#include <usermsg/usermsgasync.h>
+#include <usermsg/usermsgmetrics.h>
 
 #include <QObject>
 #include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
 #include <QFile>
 
 class UserMsgStg;
 class UserMsg;
 class LogMsg;
+class UserMsgQueueShard;
+struct UserMsgHandoff;
+class UserMsgHist;
+class UserMsgSink;
+class UserMsgJanitor;
 
-class QTextStream;
+class QFileSystemWatcher;
 
 //! brief description
 class USERMSG_EXPORT UserMsgMan : public QObject {
     Q_OBJECT
 
     friend class LogMsg;
+    friend class UserMsgQt;
+    friend class UserMsgStatsDump;
+    friend class UserMsgStgReader;
 
 public:
 
@@ -36,14 +50,32 @@ public:
 
 private:
 
-    bool
-    enabled_; /**< cache mode (false) or display mode (true) */
+    QAtomicInt
+    enabled_; /**< cache, display or switching mode (see enable()) */
+
+    QAtomicInt
+    draining_; /**< set while a thread drains the queue in enable() */
 
-    UserMsgStg *
-    settings_; /**< the settings */
+    QAtomicPointer<const UserMsgStg>
+    settings_; /**< the settings; an immutable snapshot */
 
-    QVector<UserMsg>
-    message_list_; /**< the list of messages */
+    QVector<const UserMsgStg*>
+    retired_settings_; /**< replaced snapshots; see _reclaimSettings() */
+
+    QFileSystemWatcher *
+    settings_watcher_; /**< watches the settings file; manager thread only */
+
+    QString
+    settings_file_; /**< the settings file being watched */
+
+    QVector<UserMsgQueueShard*>
+    shards_; /**< per-thread queues used in disabled mode */
+
+    QAtomicInteger<quint64>
+    sequence_; /**< global order of the queued messages */
+
+    quint64
+    generation_; /**< unique for each instance of the manager */
 
     QAtomicInt
     lock_; /** lock for using shared resources*/
@@ -54,10 +86,55 @@ private:
     QFile *
     log_file_; /**< log file */
 
-    QTextStream *
-    logger_; /**< log file */
+    QFile *
+    index_file_; /**< sparse time index of the log file */
 
-    static UserMsgMan *
+    int
+    index_pending_; /**< entries logged since last index point */
+
+    UserMsgHist *
+    history_; /**< recent entries */
+
+    QVector<UserMsgSink*>
+    sinks_; /**< other destinations for logged messages (not owned) */
+
+    UserMsgSync *
+    sync_; /**< pushes the log file to the disk */
+
+    UserMsgAsyncWriter *
+    async_; /**< writes the log file in the background */
+
+    bool
+    async_open_; /**< async_ writes the log file (UserMsgStg::asyncWrite()) */
+
+    UserMsgJanitor *
+    janitor_; /**< removes the old log files */
+
+    QVector<UserMsgHistogram*>
+    sink_latency_; /**< time spent in each of sinks_ */
+
+    UserMsgStatsDump *
+    stats_dump_; /**< writes the statistics to a file, if requested */
+
+    QVector<UserMsg>
+    coalesced_; /**< shown messages waiting to be delivered together */
+
+    QElapsedTimer
+    last_delivery_; /**< when coalesced messages were last delivered */
+
+    bool
+    coalesce_armed_; /**< a delivery of coalesced_ is scheduled */
+
+    bool
+    coalesce_urgent_; /**< deliver coalesced_ without waiting for the interval */
+
+    int
+    coalesce_timer_; /**< timer that delivers coalesced_ (0 if none) */
+
+    QAtomicPointer<UserMsgHandoff>
+    handoff_; /**< messages shown from other threads, newest first */
+
+    static QAtomicPointer<UserMsgMan>
     singleton_; /**< the one and only instance */
 
 private:
@@ -88,8 +165,8 @@ public:
     isInitialized();
 
 
-    //! Get the settings.
-    static const UserMsgStg &
+    //! Get a copy of the settings.
+    static UserMsgStg
     settings ();
 
     //! Copy the settings to internal storage.
@@ -97,6 +174,11 @@ public:
     setSettings (
             const UserMsgStg & value);
 
+    //! Load the settings from a file now and whenever it changes.
+    static bool
+    watchSettingsFile (
+            const QString & path);
+
 
     //! Get the callback.
     static KbShowMessage
@@ -109,7 +191,7 @@ public:
 
 
     //! The path to the log file.
-    static const QString &
+    static QString
     logFile ();
 
     //! Set the path to the log file
@@ -122,6 +204,10 @@ public:
     autosetLogFile (
             const QString & base_name);
 
+    //! Roll the log file if it reached the size limit.
+    static bool
+    rollLogFile ();
+
 
     //! Sets the cache mode; no messages are being shown.
     static void
@@ -163,11 +249,86 @@ public:
     logMessage (
             const UserMsg & um);
 
+    //! Deliver now the shown messages that are being coalesced.
+    static void
+    deliverShown ();
+
+    //! Write all buffered log output to the file.
+    static void
+    flush ();
+
+    //! The time spent waiting for the log file to reach the disk.
+    static UserMsgSyncStats
+    syncStats ();
+
+    //! Start the statistics returned by syncStats() anew.
+    static void
+    resetSyncStats ();
+
+    //! The work done by the background writer of the log file.
+    static UserMsgAsyncStats
+    asyncStats ();
+
+    //! A snapshot of the counters of the logging pipeline.
+    static UserMsgStats
+    stats ();
+
+    //! Start the statistics anew.
+    static void
+    resetStats ();
+
+    //! Write stats() to a file every \p interval ms (0 stops).
+    static void
+    setStatsDump (
+            const QString & path,
+            int interval);
+
+    //! Send logged messages to a sink as well.
+    static void
+    addSink (
+            UserMsgSink * sink);
+
+    //! Stop sending logged messages to a sink.
+    static void
+    removeSink (
+            UserMsgSink * sink);
+
+
+    //! The most recent entries that were shown or logged, oldest first.
+    static QVector<UserMsgEntry>
+    recentEntries (
+            int count);
+
+    //! The most recent entries of a type, oldest first.
+    static QVector<UserMsgEntry>
+    recentEntries (
+            UserMsgEntry::Type ty,
+            int count);
+
+    //! The recent entries produced between two moments, oldest first.
+    static QVector<UserMsgEntry>
+    recentEntries (
+            const QDateTime & from,
+            const QDateTime & to);
+
 protected:
 
     //! used internally to start the manager if not started already
-    static void
-    autostart ();
+    static inline UserMsgMan *
+    autostart () {
+        UserMsgMan * result = singleton_.loadAcquire ();
+        if (Q_UNLIKELY(result == NULL))
+            result = autostartSlow ();
+        return result;
+    }
+
+    //! Tells if the calling thread is inside a locked section of the manager.
+    static bool
+    _insideManager ();
+
+    //! creates the manager; the slow path of autostart()
+    static UserMsgMan *
+    autostartSlow ();
 
 
     //! Appends the message to the queue.
@@ -175,11 +336,41 @@ protected:
     _addMessageToQueue (
             const UserMsg & um);
 
+    //! The queue of the calling thread.
+    UserMsgQueueShard *
+    _localShard ();
+
     //! Shows an error message.
     void
     _showMessage (
             const UserMsg & um);
 
+    //! Delivers a message, possibly coalescing it with others.
+    void
+    _presentMessage (
+            const UserMsg & um);
+
+    //! Delivers the messages handed off by other threads.
+    void
+    _drainHandoff ();
+
+    //! Delivers coalesced_ if it is time, if \p force is true or if
+    //! an urgent delivery was requested; manager thread only.
+    int
+    _deliverCoalesced (
+            bool force);
+
+    //! Starts the timer that delivers coalesced messages or drains
+    //! the messages handed off by other threads.
+    virtual void
+    customEvent (
+            QEvent * event);
+
+    //! Delivers coalesced messages once the interval has passed.
+    virtual void
+    timerEvent (
+            QTimerEvent * event);
+
     //! Presents the queue to the user.
     void
     _showQueue (
@@ -189,13 +380,55 @@ protected:
     void
     _openLogFile ();
 
+    //! A snapshot of the counters of the logging pipeline.
+    UserMsgStats
+    _stats ();
+
+    //! The current settings snapshot.
+    inline const UserMsgStg *
+    _settings () const {
+        return settings_.loadAcquire ();
+    }
+
+    //! Publishes a new settings snapshot and retires the old one.
+    void
+    _publishSettings (
+            UserMsgStg * value);
+
+    //! Frees the retired snapshots if no thread can be reading them.
+    void
+    _reclaimSettings ();
+
+    //! Applies the settings that changed between two snapshots.
+    void
+    _applySettings (
+            const UserMsgStg & previous);
+
+    //! Loads the watched settings file.
+    bool
+    _loadSettingsFile ();
+
+    //! Starts or stops the periodic synchronization of the log file.
+    void
+    _applySyncMode ();
+
+    //! Gives the retention limits to the janitor.
+    void
+    _applyRetention ();
+
+    //! Prepares the time index of the log file.
+    void
+    _openIndexFile (
+            int flg);
+
     //! Log the message.
     void
     _logMessage (
             const UserMsg & um);
 
+    //! Records the current position of the log file in the index.
     void
-    _logPrefix (
+    _logIndexPoint (
             const UserMsgEntry &e);
 
     //! Feature that keeps the log files from filling the disk.
@@ -203,6 +436,17 @@ protected:
     _logRollFeature (
             const QString &s_log_file_path);
 
+private slots:
+
+    //! Points the watcher at UserMsgMan::settings_file_.
+    void
+    updateSettingsWatcher ();
+
+    //! The watched settings file was changed.
+    void
+    settingsFileChanged (
+            const QString & path);
+
 signals:
 
     //! A message should be shown.
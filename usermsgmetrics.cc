@@ -0,0 +1,406 @@
+/**
+ * @file usermsgmetrics.cc
+ * @brief Definitions for UserMsgMetrics and related classes.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgmetrics.h"
+#include "usermsgman.h"
+#include "usermsg-private.h"
+
+#include <QSaveFile>
+#include <QtAlgorithms>
+
+/**
+ * @class UserMsgMetrics
+ *
+ * The counters are plain atomic integers updated with relaxed
+ * ordering, so counting never takes a lock. They live for the whole
+ * process and are not reset when the manager is recreated.
+ *
+ * UserMsgMan::stats() combines them with the state of the manager
+ * (the sinks and the synchronization of the log file).
+ */
+
+/**
+ * @class UserMsgHistogram
+ *
+ * Bucket `i` counts the durations `d` with `2^i <= d < 2^(i+1)`
+ * nanoseconds (bucket 0 also counts zero); the last bucket also
+ * takes everything that is longer.
+ */
+
+/**
+ * @class UserMsgStatsDump
+ *
+ * Owned by the manager (see UserMsgMan::setStatsDump()). The file is
+ * replaced atomically, so a reader never sees a partial dump.
+ */
+
+//! The counters behind UserMsgMetrics; constant-initialized.
+static struct {
+    QAtomicInteger<quint64> accepted [UserMsgStats::TYPES];
+    QAtomicInteger<quint64> filtered [UserMsgStats::TYPES];
+    QAtomicInteger<quint64> bytes_written;
+    QAtomicInteger<qint64> queue_depth;
+    QAtomicInteger<qint64> queue_high_water;
+    QAtomicInteger<quint64> suppressed;
+} counters;
+
+//! Time spent in UM_AQUIRE_LOCK when the lock was taken.
+static UserMsgHistogram lock_wait;
+
+//! Names of the message types in the output.
+static const char * const type_labels [UserMsgStats::TYPES] = {
+    "error", "warning", "info", "derror", "dwarning", "debug"
+};
+
+/* ------------------------------------------------------------------------- */
+UserMsgHistogram::UserMsgHistogram () :
+    count_ (0),
+    sum_ns_ (0),
+    max_ns_ (0)
+{
+    reset ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+int UserMsgHistogram::bucketOf (quint64 nsecs)
+{
+    if (nsecs < 2)
+        return 0;
+    int result = 63 - (int)qCountLeadingZeroBits (nsecs);
+    return result >= BUCKETS ? BUCKETS - 1 : result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgHistogram::record (qint64 nsecs)
+{
+    quint64 value = nsecs < 0 ? 0 : (quint64)nsecs;
+    buckets_[bucketOf (value)].fetchAndAddRelaxed (1);
+    count_.fetchAndAddRelaxed (1);
+    sum_ns_.fetchAndAddRelaxed (value);
+    quint64 prev = max_ns_.load ();
+    while ((value > prev) && !max_ns_.testAndSetRelaxed (prev, value, prev)) {
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The values are read one at a time, so a copy taken while other
+ * threads record may be slightly inconsistent.
+ */
+UserMsgHistogram::Data UserMsgHistogram::data () const
+{
+    Data result;
+    result.count = count_.load ();
+    result.sum_ns = sum_ns_.load ();
+    result.max_ns = max_ns_.load ();
+    for (int i = 0; i < BUCKETS; ++i) {
+        result.buckets[i] = buckets_[i].load ();
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgHistogram::reset ()
+{
+    count_.store (0);
+    sum_ns_.store (0);
+    max_ns_.store (0);
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets_[i].store (0);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::countAccepted (UserMsgEntry::Type ty)
+{
+    if (((int)ty >= 0) && ((int)ty < UserMsgStats::TYPES)) {
+        counters.accepted[ty].fetchAndAddRelaxed (1);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::countFiltered (UserMsgEntry::Type ty)
+{
+    if (((int)ty >= 0) && ((int)ty < UserMsgStats::TYPES)) {
+        counters.filtered[ty].fetchAndAddRelaxed (1);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::addBytesWritten (qint64 value)
+{
+    if (value > 0) {
+        counters.bytes_written.fetchAndAddRelaxed ((quint64)value);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::addQueued (int delta)
+{
+    qint64 depth = counters.queue_depth.fetchAndAddRelaxed (delta) + delta;
+    qint64 prev = counters.queue_high_water.load ();
+    while ((depth > prev) &&
+           !counters.queue_high_water.testAndSetRelaxed (prev, depth, prev)) {
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::addSuppressed (int value)
+{
+    if (value > 0) {
+        counters.suppressed.fetchAndAddRelaxed ((quint64)value);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::recordLockWait (qint64 nsecs)
+{
+    lock_wait.record (nsecs);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only the process-wide counters are filled; the fields that
+ * describe the manager are left alone.
+ */
+void UserMsgMetrics::fill (UserMsgStats & out)
+{
+    for (int i = 0; i < UserMsgStats::TYPES; ++i) {
+        out.accepted[i] = counters.accepted[i].load ();
+        out.filtered[i] = counters.filtered[i].load ();
+    }
+    out.bytes_written = counters.bytes_written.load ();
+    qint64 depth = counters.queue_depth.load ();
+    out.queue_depth = depth < 0 ? 0 : (quint64)depth;
+    out.queue_high_water = (quint64)counters.queue_high_water.load ();
+    out.suppressed = counters.suppressed.load ();
+    out.lock_wait = lock_wait.data ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgMetrics::reset ()
+{
+    for (int i = 0; i < UserMsgStats::TYPES; ++i) {
+        counters.accepted[i].store (0);
+        counters.filtered[i].store (0);
+    }
+    counters.bytes_written.store (0);
+    counters.queue_high_water.store (counters.queue_depth.load ());
+    counters.suppressed.store (0);
+    lock_wait.reset ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void appendValue (
+        QByteArray & out, const char * name,
+        const QByteArray & labels, quint64 value)
+{
+    out.append (name);
+    if (!labels.isEmpty ()) {
+        out.append ('{');
+        out.append (labels);
+        out.append ('}');
+    }
+    out.append (' ');
+    out.append (QByteArray::number (value));
+    out.append ('\n');
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Buckets past the last one that is used are left out; `+Inf`
+ * is always present.
+ */
+static void appendHistogram (
+        QByteArray & out, const char * name,
+        const QByteArray & labels, const UserMsgHistogram::Data & h)
+{
+    QByteArray prefix = labels.isEmpty () ? labels : labels + ',';
+    QByteArray bucket_name = QByteArray (name) + "_bucket";
+    int last = UserMsgHistogram::BUCKETS - 1;
+    while ((last > 0) && (h.buckets[last] == 0)) {
+        --last;
+    }
+    quint64 cumulated = 0;
+    for (int i = 0; i <= last && i < UserMsgHistogram::BUCKETS - 1; ++i) {
+        cumulated += h.buckets[i];
+        double limit = (double)((quint64)2 << i) / 1e9;
+        appendValue (out, bucket_name.constData (),
+                     prefix + "le=\"" + QByteArray::number (limit, 'g', 6) + '"',
+                     cumulated);
+    }
+    appendValue (out, bucket_name.constData (),
+                 prefix + "le=\"+Inf\"", h.count);
+    out.append (name);
+    out.append ("_sum");
+    if (!labels.isEmpty ()) {
+        out.append ('{');
+        out.append (labels);
+        out.append ('}');
+    }
+    out.append (' ');
+    out.append (QByteArray::number ((double)h.sum_ns / 1e9, 'g', 9));
+    out.append ('\n');
+    appendValue (out, (QByteArray (name) + "_count").constData (),
+                 labels, h.count);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Counters end in `_total`, durations are histograms in seconds.
+ */
+QByteArray UserMsgStats::toText () const
+{
+    QByteArray out;
+
+    out.append ("# TYPE usermsg_accepted_total counter\n");
+    for (int i = 0; i < TYPES; ++i) {
+        appendValue (out, "usermsg_accepted_total",
+                     QByteArray ("type=\"") + type_labels[i] + '"',
+                     accepted[i]);
+    }
+    out.append ("# TYPE usermsg_filtered_total counter\n");
+    for (int i = 0; i < TYPES; ++i) {
+        appendValue (out, "usermsg_filtered_total",
+                     QByteArray ("type=\"") + type_labels[i] + '"',
+                     filtered[i]);
+    }
+    out.append ("# TYPE usermsg_bytes_written_total counter\n");
+    appendValue (out, "usermsg_bytes_written_total", QByteArray (), bytes_written);
+    out.append ("# TYPE usermsg_queue_depth gauge\n");
+    appendValue (out, "usermsg_queue_depth", QByteArray (), queue_depth);
+    out.append ("# TYPE usermsg_queue_high_water gauge\n");
+    appendValue (out, "usermsg_queue_high_water", QByteArray (), queue_high_water);
+    out.append ("# TYPE usermsg_dropped_total counter\n");
+    appendValue (out, "usermsg_dropped_total", QByteArray (), dropped);
+    out.append ("# TYPE usermsg_suppressed_total counter\n");
+    appendValue (out, "usermsg_suppressed_total", QByteArray (), suppressed);
+
+    out.append ("# TYPE usermsg_lock_wait_seconds histogram\n");
+    appendHistogram (out, "usermsg_lock_wait_seconds", QByteArray (), lock_wait);
+
+    out.append ("# TYPE usermsg_sync_total counter\n");
+    appendValue (out, "usermsg_sync_total", QByteArray (), sync.count);
+    out.append ("# TYPE usermsg_sync_seconds_total counter\n");
+    out.append ("usermsg_sync_seconds_total ");
+    out.append (QByteArray::number ((double)sync.total_ns / 1e9, 'g', 9));
+    out.append ('\n');
+    out.append ("# TYPE usermsg_sync_max_seconds gauge\n");
+    out.append ("usermsg_sync_max_seconds ");
+    out.append (QByteArray::number ((double)sync.max_ns / 1e9, 'g', 9));
+    out.append ('\n');
+
+    if (!sinks.isEmpty ()) {
+        out.append ("# TYPE usermsg_sink_dropped_total counter\n");
+        for (int i = 0; i < sinks.count (); ++i) {
+            const Sink & s = sinks.at (i);
+            appendValue (out, "usermsg_sink_dropped_total",
+                         "sink=\"" + s.name.toUtf8 () + "\",index=\"" +
+                         QByteArray::number (i) + '"',
+                         s.dropped);
+        }
+        out.append ("# TYPE usermsg_sink_write_seconds histogram\n");
+        for (int i = 0; i < sinks.count (); ++i) {
+            const Sink & s = sinks.at (i);
+            appendHistogram (out, "usermsg_sink_write_seconds",
+                             "sink=\"" + s.name.toUtf8 () + "\",index=\"" +
+                             QByteArray::number (i) + '"',
+                             s.latency);
+        }
+    }
+    return out;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @param manager the source of the statistics; must outlive the thread
+ * @param path the file to write
+ * @param interval time between two dumps (ms)
+ */
+UserMsgStatsDump::UserMsgStatsDump (
+        UserMsgMan * manager, const QString & path, int interval) :
+    QThread (),
+    manager_ (manager),
+    path_ (path),
+    interval_ (interval),
+    mutex_ (),
+    wake_ (),
+    stop_ (false)
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgStatsDump::~UserMsgStatsDump()
+{
+    USERMSG_TRACE_ENTRY;
+    stop ();
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgStatsDump::stop ()
+{
+    if (!isRunning ())
+        return;
+    mutex_.lock ();
+    stop_ = true;
+    wake_.wakeAll ();
+    mutex_.unlock ();
+    wait ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgStatsDump::dump ()
+{
+    UserMsgStats st = manager_->_stats ();
+    QSaveFile file (path_);
+    if (!file.open (QIODevice::WriteOnly))
+        return false;
+    file.write (st.toText ());
+    return file.commit ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A last dump is written when the thread is stopped.
+ */
+void UserMsgStatsDump::run ()
+{
+    QMutexLocker locker (&mutex_);
+    while (!stop_) {
+        wake_.wait (&mutex_, (unsigned long)interval_);
+        locker.unlock ();
+        dump ();
+        locker.relock ();
+    }
+}
+/* ========================================================================= */
@@ -0,0 +1,195 @@
+/**
+ * @file usermsgmetrics.h
+ * @brief Declarations for UserMsgMetrics and related classes
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGMETRICS_H_INCLUDE
+#define GUARD_USERMSGMETRICS_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+#include <usermsg/usermsgsync.h>
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+class UserMsgMan;
+
+//! Distribution of durations in power of two buckets.
+class USERMSG_EXPORT UserMsgHistogram {
+
+public:
+
+    enum {
+        //! bucket `i` holds durations below 2^(i+1) nanoseconds
+        BUCKETS = 40
+    };
+
+    //! A copy of the values.
+    struct Data {
+        quint64 count; /**< number of recorded durations */
+        quint64 sum_ns; /**< their sum */
+        quint64 max_ns; /**< the longest one */
+        quint64 buckets [BUCKETS]; /**< the distribution */
+    };
+
+private:
+
+    QAtomicInteger<quint64> count_; /**< see Data */
+    QAtomicInteger<quint64> sum_ns_; /**< see Data */
+    QAtomicInteger<quint64> max_ns_; /**< see Data */
+    QAtomicInteger<quint64> buckets_ [BUCKETS]; /**< see Data */
+
+public:
+
+    //! Default constructor.
+    UserMsgHistogram ();
+
+
+    //! Account for a duration.
+    void
+    record (
+            qint64 nsecs);
+
+    //! A copy of the values.
+    Data
+    data () const;
+
+    //! Start anew.
+    void
+    reset ();
+
+
+    //! The bucket where a duration belongs.
+    static int
+    bucketOf (
+            quint64 nsecs);
+};
+
+//! A snapshot of the state of the logging pipeline.
+struct USERMSG_EXPORT UserMsgStats {
+
+    enum {
+        //! number of message types
+        TYPES = UserMsgEntry::UTDBG_INFO + 1
+    };
+
+    //! The state of a sink.
+    struct Sink {
+        QString name; /**< UserMsgSink::name() */
+        quint64 dropped; /**< UserMsgSink::dropped() */
+        UserMsgHistogram::Data latency; /**< time spent in UserMsgSink::write() */
+    };
+
+    quint64 accepted [TYPES]; /**< entries that reached the manager, by type */
+    quint64 filtered [TYPES]; /**< entries rejected by their category, by type */
+    quint64 bytes_written; /**< bytes written to the log file */
+    quint64 queue_depth; /**< messages queued, handed off or coalesced */
+    quint64 queue_high_water; /**< most messages ever waiting */
+    quint64 dropped; /**< entries the sinks could not keep */
+    quint64 suppressed; /**< messages merged into others when shown */
+    UserMsgHistogram::Data lock_wait; /**< time spent waiting for locks */
+    UserMsgSyncStats sync; /**< see UserMsgMan::syncStats() */
+    QVector<Sink> sinks; /**< one for each registered sink */
+
+
+    //! The values in Prometheus text exposition format.
+    QByteArray
+    toText () const;
+};
+
+//! Process-wide counters of the logging pipeline.
+class USERMSG_EXPORT UserMsgMetrics {
+
+public:
+
+    //! An entry reached the manager.
+    static void
+    countAccepted (
+            UserMsgEntry::Type ty);
+
+    //! An entry was rejected by its category.
+    static void
+    countFiltered (
+            UserMsgEntry::Type ty);
+
+    //! Bytes were written to the log file.
+    static void
+    addBytesWritten (
+            qint64 value);
+
+    //! Messages started (positive) or stopped waiting to be shown.
+    static void
+    addQueued (
+            int delta);
+
+    //! Messages were merged into others.
+    static void
+    addSuppressed (
+            int value);
+
+    //! Account for time spent waiting for a lock.
+    static void
+    recordLockWait (
+            qint64 nsecs);
+
+    //! Copy the counters into a snapshot.
+    static void
+    fill (
+            UserMsgStats & out);
+
+    //! Start the counters anew (the queue depth is kept).
+    static void
+    reset ();
+};
+
+//! Writes UserMsgMan::stats() to a file periodically.
+class USERMSG_EXPORT UserMsgStatsDump : public QThread {
+
+private:
+
+    UserMsgMan * manager_; /**< the source of the statistics */
+    QString path_; /**< the file to write */
+    int interval_; /**< time between two dumps (ms) */
+    QMutex mutex_; /**< protects stop_ */
+    QWaitCondition wake_; /**< wakes the thread early */
+    bool stop_; /**< asks the thread to exit */
+
+public:
+
+    //! Constructor.
+    UserMsgStatsDump (
+            UserMsgMan * manager,
+            const QString & path,
+            int interval);
+
+    //! Destructor; stops the thread.
+    virtual ~UserMsgStatsDump();
+
+
+    //! Ask the thread to exit and wait for it.
+    void
+    stop ();
+
+    //! Write the statistics now.
+    bool
+    dump ();
+
+protected:
+
+    //! The periodic dump.
+    void
+    run ();
+
+};
+
+#endif // GUARD_USERMSGMETRICS_H_INCLUDE
@@ -0,0 +1,193 @@
+/**
+ * @file usermsgqt.cc
+ * @brief Definitions for UserMsgQt class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgqt.h"
+#include "usermsgcat.h"
+#include "usermsgman.h"
+#include "usermsg.h"
+#include "usermsg-private.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <stdio.h>
+
+/**
+ * @class UserMsgQt
+ *
+ * Once install() is called each message produced by Qt's logging
+ * functions becomes an entry in the log file of UserMsgMan. The
+ * QtMsgType is mapped to a UserMsgEntry::Type (see typeFromQt()).
+ * The category and, when Qt provides them, the source file, line
+ * and function are attached to the entry as fields.
+ *
+ * Each Qt logging category is mirrored by a UserMsgCat with the
+ * same name, so the rules in UserMsgStg::categoryRules() filter
+ * these messages just like the native ones.
+ *
+ * Messages that are produced while the handler is already running
+ * on the same thread (for example a warning from QFile while the
+ * log is written) are not routed again; they go to the previous
+ * handler or, if there was none, to the standard error.
+ *
+ * With `forward` set in install() each message also goes to the
+ * previous handler, so the output on the console is preserved.
+ */
+
+//! A UserMsgCat that owns its name.
+struct UserMsgQtCategory {
+    QByteArray name; /**< the name of the Qt category */
+    UserMsgCat cat; /**< the category; its name points inside name */
+
+    UserMsgQtCategory (const char * s_name) :
+        name (s_name),
+        cat (name.constData ())
+    {}
+};
+
+//! The handler that was active before install().
+static QtMessageHandler previous_handler = NULL;
+
+//! Also send the messages to previous_handler.
+static bool forward_messages = false;
+
+//! Set while UserMsgQt::install() is in effect.
+static QAtomicInt installed;
+
+//! Guards qt_categories.
+static QMutex categories_mutex;
+
+//! The categories created for Qt categories, by name.
+static QHash<QByteArray, UserMsgQtCategory*> qt_categories;
+
+//! Set while the handler runs on this thread.
+static thread_local bool in_handler = false;
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The categories are never released because the Qt categories
+ * are usually static and few.
+ */
+static const UserMsgCat & categoryFor (const char * name)
+{
+    if (name == NULL)
+        name = "default";
+    QByteArray key (name);
+    QMutexLocker locker (&categories_mutex);
+    UserMsgQtCategory * result = qt_categories.value (key, NULL);
+    if (result == NULL) {
+        result = new UserMsgQtCategory (name);
+        qt_categories.insert (key, result);
+    }
+    return result->cat;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The default handler of Qt is restored by uninstall() if there was
+ * no handler before.
+ */
+void UserMsgQt::install (bool forward)
+{
+    if (!installed.testAndSetOrdered (0, 1))
+        return;
+    forward_messages = forward;
+    previous_handler = qInstallMessageHandler (handler);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgQt::uninstall ()
+{
+    if (!installed.testAndSetOrdered (1, 0))
+        return;
+    qInstallMessageHandler (previous_handler);
+    previous_handler = NULL;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgQt::isInstalled ()
+{
+    return installed.loadAcquire () != 0;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Debug messages become debug entries; info, warning, critical and
+ * fatal messages become info, warning and error entries.
+ */
+UserMsgEntry::Type UserMsgQt::typeFromQt (QtMsgType ty)
+{
+    switch (ty) {
+    case QtDebugMsg: return UserMsgEntry::UTDBG_INFO;
+    case QtInfoMsg: return UserMsgEntry::UTINFO;
+    case QtWarningMsg: return UserMsgEntry::UTWARNING;
+    case QtCriticalMsg: return UserMsgEntry::UTERROR;
+    case QtFatalMsg: return UserMsgEntry::UTERROR;
+    default: return UserMsgEntry::UTINFO;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Fatal messages are never filtered out. Qt aborts the program as
+ * soon as the handler returns, so the log file is flushed first;
+ * with UserMsgStg::asyncWrite() the entry would otherwise still be
+ * waiting in the buffers of the writer.
+ */
+void UserMsgQt::handler (
+        QtMsgType ty, const QMessageLogContext & context,
+        const QString & s_message)
+{
+    // the manager may be locked by this very thread
+    if (in_handler || UserMsgMan::_insideManager ()) {
+        if (previous_handler != NULL) {
+            previous_handler (ty, context, s_message);
+        } else {
+            fprintf (stderr, "%s\n", s_message.toLocal8Bit ().constData ());
+        }
+        return;
+    }
+    in_handler = true;
+
+    UserMsgEntry::Type um_ty = typeFromQt (ty);
+    const UserMsgCat & cat = categoryFor (context.category);
+    if ((ty == QtFatalMsg) || cat.isEnabled (um_ty)) {
+        static QLatin1String logtitle ("   ");
+        UserMsg um (logtitle);
+        um.addMsg (um_ty, s_message);
+        um.addField ("category", cat.name ());
+        if (context.file != NULL) {
+            um.addField ("file", context.file);
+            um.addField ("line", context.line);
+        }
+        if (context.function != NULL) {
+            um.addField ("function", context.function);
+        }
+        UserMsgMan::singleton ()->_logMessage (um);
+        if (ty == QtFatalMsg) {
+            UserMsgMan::flush ();
+        }
+    } else {
+        UserMsgMetrics::countFiltered (um_ty);
+    }
+
+    if (forward_messages && (previous_handler != NULL)) {
+        previous_handler (ty, context, s_message);
+    }
+
+    in_handler = false;
+}
+/* ========================================================================= */
@@ -0,0 +1,52 @@
+/**
+ * @file usermsgqt.h
+ * @brief Declarations for UserMsgQt class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGQT_H_INCLUDE
+#define GUARD_USERMSGQT_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+
+#include <QtGlobal>
+
+//! Routes the output of qDebug(), qWarning() and friends to the log.
+class USERMSG_EXPORT UserMsgQt {
+
+public:
+
+    //! Install the message handler.
+    static void
+    install (
+            bool forward = false);
+
+    //! Restore the handler that was active before install().
+    static void
+    uninstall ();
+
+    //! Tell if the message handler is installed.
+    static bool
+    isInstalled ();
+
+    //! The type of entry used for a type of Qt message.
+    static UserMsgEntry::Type
+    typeFromQt (
+            QtMsgType ty);
+
+private:
+
+    //! The handler passed to qInstallMessageHandler().
+    static void
+    handler (
+            QtMsgType ty,
+            const QMessageLogContext & context,
+            const QString & s_message);
+
+};
+
+#endif // GUARD_USERMSGQT_H_INCLUDE
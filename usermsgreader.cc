@@ -0,0 +1,512 @@
+/**
+ * @file usermsgreader.cc
+ * @brief Definitions for UserMsgReader class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgreader.h"
+#include "usermsg-private.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QHash>
+
+#include <algorithm>
+#include <limits>
+#include <string.h>
+
+/**
+ * @class UserMsgReader
+ *
+ * UserMsgMan writes one line per entry (see UserMsgMan::_logMessage()
+ * for the format) and, every few entries, appends a record to an
+ * index file that sits next to the log file (`file.log.idx`).
+ * Each record holds the moment of an entry (milliseconds since
+ * epoch, UTC) and the byte offset of its line in the log file.
+ * Index files are rotated together with the log files.
+ *
+ * locate() uses the first record of each index to binary-search the
+ * rotation set for the files that cover a time range, then the
+ * records of the first and last file to narrow the range down to
+ * a span of bytes. Files that have no index are read entirely.
+ *
+ * The index assumes that entries are logged in roughly chronological
+ * order; readEntries() filters the entries on their exact moment.
+ */
+
+const char UserMsgReader::index_magic[8] = {
+    'U', 'M', 'S', 'G', 'I', 'D', 'X', '1'
+};
+
+//! Size of an index record on disk.
+#define INDEX_RECORD_SIZE 16
+
+//! Prefix of the lines that continue the message on previous line.
+static const char continuation[] = "                              : ";
+
+//! Length of continuation.
+#define CONTINUATION_LENGTH 32
+
+/* ------------------------------------------------------------------------- */
+QString UserMsgReader::indexPath (const QString & log_file)
+{
+    return log_file + QLatin1String (".idx");
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The rolled files followed by the log file itself.
+ */
+QStringList UserMsgReader::rotationSet (const QString & log_file)
+{
+    QStringList result = rolledFiles (log_file);
+    if (QFile::exists (log_file)) {
+        result.append (log_file);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Length of the time stamp in the name of a rolled file.
+#define ROLLED_STAMP_LENGTH 17
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A rolled file is named after the moment it was rolled
+ * (see rolledPath()), so sorting the names sorts the files.
+ * Files from older versions, named `file.log.1` (most recent) to
+ * `file.log.N`, are older than any of those and come first.
+ *
+ * The directory is listed once; no name is probed.
+ */
+QStringList UserMsgReader::rolledFiles (const QString & log_file)
+{
+    QFileInfo info (log_file);
+    QString prefix = info.fileName () + QChar ('.');
+    QDir dir (info.absolutePath ());
+    QStringList names = dir.entryList (
+                QStringList () << (prefix + QChar ('*')),
+                QDir::Files, QDir::Name);
+
+    QStringList stamped;
+    QVector<int> numbered;
+    foreach(const QString & name, names) {
+        QString suffix = name.mid (prefix.length ());
+        bool digits = !suffix.isEmpty ();
+        for (int i = 0; digits && (i < suffix.length ()); ++i) {
+            digits = suffix.at (i).isDigit ();
+        }
+        if (!digits) {
+            // the time indexes and unrelated files
+        } else if (suffix.length () == ROLLED_STAMP_LENGTH) {
+            stamped.append (dir.filePath (name));
+        } else if (suffix.length () < ROLLED_STAMP_LENGTH) {
+            numbered.append (suffix.toInt ());
+        }
+    }
+
+    QStringList result;
+    std::sort (numbered.begin (), numbered.end ());
+    for (int i = numbered.count () - 1; i >= 0; --i) {
+        result.append (dir.filePath (prefix + QString::number (numbered.at (i))));
+    }
+    // entryList() already sorted them by name
+    result.append (stamped);
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The name is the log file followed by the UTC time stamp in
+ * milliseconds, for example `file.log.20141012153000123`. The caller
+ * picks a later moment if the name is taken.
+ */
+QString UserMsgReader::rolledPath (
+        const QString & log_file, const QDateTime & moment)
+{
+    return log_file + QChar ('.') +
+            moment.toUTC ().toString (QLatin1String ("yyyyMMddHHmmsszzz"));
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads at most \p max_points records; a truncated last record
+ * (the process died while writing it) is ignored.
+ */
+static QVector<UserMsgReader::IndexPoint> readIndex (
+        const QString & log_file, int max_points)
+{
+    QVector<UserMsgReader::IndexPoint> result;
+    QFile f (UserMsgReader::indexPath (log_file));
+    if (!f.open (QIODevice::ReadOnly))
+        return result;
+
+    char magic [sizeof(UserMsgReader::index_magic)];
+    if ((f.read (magic, sizeof(magic)) != (qint64)sizeof(magic)) ||
+            (memcmp (magic, UserMsgReader::index_magic, sizeof(magic)) != 0)) {
+        return result;
+    }
+
+    qint64 available = (f.size () - f.pos ()) / INDEX_RECORD_SIZE;
+    if (available > max_points)
+        available = max_points;
+    result.reserve ((int)available);
+
+    QDataStream in (&f);
+    for (qint64 i = 0; i < available; ++i) {
+        UserMsgReader::IndexPoint pt;
+        in >> pt.moment >> pt.offset;
+        result.append (pt);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+QVector<UserMsgReader::IndexPoint> UserMsgReader::loadIndex (
+        const QString & log_file)
+{
+    return readIndex (log_file, std::numeric_limits<int>::max ());
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! How much of a file without an index is read at a time.
+#define FIRST_ENTRY_CHUNK 4096
+
+//! How far into a file without an index the first entry is looked for.
+#define FIRST_ENTRY_LIMIT (1024 * 1024)
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The moment of the first index point or, for a file without an
+ * index (a file rolled while indexing was off, for example), the
+ * moment of the first entry in the file.
+ *
+ * A file without an index is read in chunks and only the lines that
+ * each chunk completes are parsed, so the work is linear in the part
+ * of the file that is read.
+ *
+ * @returns false if no entry was found.
+ */
+static bool firstMoment (const QString & log_file, qint64 * moment)
+{
+    QVector<UserMsgReader::IndexPoint> pts = readIndex (log_file, 1);
+    if (!pts.isEmpty ()) {
+        *moment = pts.first ().moment;
+        return true;
+    }
+
+    QFile f (log_file);
+    if (!f.open (QIODevice::ReadOnly))
+        return false;
+    QByteArray pending; // a line that is not complete, yet
+    QVector<UserMsgEntry> parsed;
+    qint64 total = 0;
+    while (total < FIRST_ENTRY_LIMIT) {
+        QByteArray chunk = f.read (FIRST_ENTRY_CHUNK);
+        if (chunk.isEmpty ())
+            break;
+        total += chunk.size ();
+        pending.append (chunk);
+        int complete = pending.lastIndexOf ('\n') + 1;
+        if (complete == 0)
+            continue;
+        UserMsgReader::parseBuffer (pending.constData (), complete, parsed);
+        if (!parsed.isEmpty ()) {
+            *moment = parsed.first ().moment ().toMSecsSinceEpoch ();
+            return true;
+        }
+        pending.remove (0, complete);
+    }
+    return false;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Binary search in \p files for the first file, at or after \p lo,
+ * that starts after \p moment.
+ *
+ * The first moment of each file is looked up once and kept in
+ * \p cache. A file in which no entry can be found has no place in
+ * the order, so it is removed from \p files when the search meets it.
+ */
+static int firstFileAfter (
+        QStringList & files, QHash<QString, qint64> & cache,
+        int lo, qint64 moment)
+{
+    int hi = files.count ();
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const QString & file = files.at (mid);
+        qint64 first;
+        if (cache.contains (file)) {
+            first = cache.value (file);
+        } else if (firstMoment (file, &first)) {
+            cache.insert (file, first);
+        } else {
+            files.removeAt (mid);
+            --hi;
+            continue;
+        }
+        if (first <= moment) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Order index points by moment.
+static inline bool pointBefore (
+        qint64 moment, const UserMsgReader::IndexPoint & pt)
+{
+    return moment < pt.moment;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @returns the ranges in chronological order.
+ */
+QVector<UserMsgReader::Range> UserMsgReader::locate (
+        const QString & log_file,
+        const QDateTime & from, const QDateTime & to)
+{
+    QVector<Range> result;
+    QStringList files = rotationSet (log_file);
+    int n = files.count ();
+    qint64 f = from.toMSecsSinceEpoch ();
+    qint64 t = to.toMSecsSinceEpoch ();
+    if ((n == 0) || (t < f))
+        return result;
+
+    QHash<QString, qint64> cache;
+
+    // the last file that starts at or before from (or the first file)
+    int lo = firstFileAfter (files, cache, 0, f);
+    int first_file = lo > 0 ? lo - 1 : 0;
+
+    // the last file that starts at or before to
+    int last_file = firstFileAfter (files, cache, first_file, t) - 1;
+    if ((last_file < first_file) || (files.isEmpty ()))
+        return result;
+
+    for (int i = first_file; i <= last_file; ++i) {
+        Range r;
+        r.file = files.at (i);
+        r.begin = 0;
+        r.end = -1;
+        if ((i == first_file) || (i == last_file)) {
+            QVector<IndexPoint> pts = loadIndex (r.file);
+            if (i == first_file) {
+                const IndexPoint * it = std::upper_bound (
+                            pts.constBegin (), pts.constEnd (), f, pointBefore);
+                if (it != pts.constBegin ()) {
+                    r.begin = (it - 1)->offset;
+                }
+            }
+            if (i == last_file) {
+                const IndexPoint * it = std::upper_bound (
+                            pts.constBegin (), pts.constEnd (), t, pointBefore);
+                if (it != pts.constEnd ()) {
+                    r.end = it->offset;
+                }
+            }
+        }
+        result.append (r);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+QVector<UserMsgEntry> UserMsgReader::readEntries (
+        const QString & log_file,
+        const QDateTime & from, const QDateTime & to)
+{
+    QVector<UserMsgEntry> result;
+    QVector<UserMsgEntry> parsed;
+    foreach(const Range & r, locate (log_file, from, to)) {
+        QFile f (r.file);
+        if (!f.open (QIODevice::ReadOnly))
+            continue;
+        if (!f.seek (r.begin))
+            continue;
+        QByteArray data = (r.end < 0) ? f.readAll () : f.read (r.end - r.begin);
+
+        parsed.clear ();
+        parseBuffer (data.constData (), data.size (), parsed);
+        foreach(const UserMsgEntry & e, parsed) {
+            if ((e.moment () >= from) && (e.moment () <= to)) {
+                result.append (e);
+            }
+        }
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static inline int parseDigits (const char * p, int count, bool * ok)
+{
+    int result = 0;
+    for (int i = 0; i < count; ++i) {
+        char c = p[i];
+        if ((c < '0') || (c > '9')) {
+            *ok = false;
+            return 0;
+        }
+        result = result * 10 + (c - '0');
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Accepts the output of UserMsgTime::formatIso(): the date and time,
+ * optional milliseconds and an optional zone (`Z` or `+HH:MM`).
+ *
+ * @returns an invalid QDateTime if the text could not be parsed.
+ */
+QDateTime UserMsgReader::parseMoment (const char * data, int size)
+{
+    if ((size < 19) || (data[4] != '-') || (data[7] != '-') ||
+            (data[10] != 'T') || (data[13] != ':') || (data[16] != ':'))
+        return QDateTime ();
+
+    bool ok = true;
+    int year = parseDigits (data, 4, &ok);
+    int month = parseDigits (data + 5, 2, &ok);
+    int day = parseDigits (data + 8, 2, &ok);
+    int hour = parseDigits (data + 11, 2, &ok);
+    int minute = parseDigits (data + 14, 2, &ok);
+    int second = parseDigits (data + 17, 2, &ok);
+    int msec = 0;
+    int pos = 19;
+    if ((pos + 4 <= size) && (data[pos] == '.')) {
+        msec = parseDigits (data + pos + 1, 3, &ok);
+        pos += 4;
+    }
+    if (!ok)
+        return QDateTime ();
+
+    QDate dt (year, month, day);
+    QTime tm (hour, minute, second, msec);
+    if (pos == size) {
+        return QDateTime (dt, tm, Qt::LocalTime);
+    } else if ((data[pos] == 'Z') && (pos + 1 == size)) {
+        return QDateTime (dt, tm, Qt::UTC);
+    } else if ((pos + 6 == size) &&
+               ((data[pos] == '+') || (data[pos] == '-')) &&
+               (data[pos + 3] == ':')) {
+        int offset = parseDigits (data + pos + 1, 2, &ok) * 3600 +
+                parseDigits (data + pos + 4, 2, &ok) * 60;
+        if (!ok)
+            return QDateTime ();
+        if (data[pos] == '-')
+            offset = -offset;
+        return QDateTime (dt, tm, Qt::OffsetFromUTC, offset);
+    }
+    return QDateTime ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static UserMsgEntry::Type typeFromLabel (const char * label, bool * ok)
+{
+    static const struct {
+        const char * label;
+        UserMsgEntry::Type ty;
+    } labels [] = {
+        { "error   ", UserMsgEntry::UTERROR },
+        { "warning ", UserMsgEntry::UTWARNING },
+        { "info    ", UserMsgEntry::UTINFO },
+        { "derror  ", UserMsgEntry::UTDBG_ERROR },
+        { "dwarning", UserMsgEntry::UTDBG_WARNING },
+        { "debug   ", UserMsgEntry::UTDBG_INFO },
+    };
+    for (size_t i = 0; i < sizeof(labels) / sizeof(labels[0]); ++i) {
+        if (memcmp (label, labels[i].label, 8) == 0) {
+            *ok = true;
+            return labels[i].ty;
+        }
+    }
+    *ok = false;
+    return UserMsgEntry::UTERROR;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Lines that do not follow the log format (for example a partial
+ * line at the start of the buffer) and title lines are skipped.
+ * Continuation lines are appended to the message of the entry
+ * that precedes them.
+ */
+void UserMsgReader::parseBuffer (
+        const char * data, qint64 size, QVector<UserMsgEntry> & out)
+{
+    const char * p = data;
+    const char * end = data + size;
+    int first_new = out.count ();
+    bool after_entry = false;
+
+    while (p < end) {
+        const char * eol = (const char *)memchr (p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        int len = (int)(eol - p);
+        if ((len > 0) && (p[len - 1] == '\r'))
+            --len;
+
+        if ((len >= CONTINUATION_LENGTH) &&
+                (memcmp (p, continuation, CONTINUATION_LENGTH) == 0)) {
+            if (after_entry && (out.count () > first_new)) {
+                UserMsgEntry & e = out.last ();
+                QString s_message = e.message ();
+                s_message.append (QChar ('\n'));
+                s_message.append (QString::fromUtf8 (
+                            p + CONTINUATION_LENGTH, len - CONTINUATION_LENGTH));
+                e.setMessage (s_message);
+            }
+        } else if ((len > 2) && (p[0] == ' ') && (p[1] == ' ')) {
+            after_entry = false;
+            const char * ts = p + 2;
+            const char * ts_end = (const char *)memchr (ts, ' ', len - 2);
+            if ((ts_end != NULL) && (ts_end + 1 + 8 + 2 <= p + len) &&
+                    (ts_end[9] == ':') && (ts_end[10] == ' ')) {
+                bool ok;
+                UserMsgEntry::Type ty = typeFromLabel (ts_end + 1, &ok);
+                QDateTime moment = parseMoment (ts, (int)(ts_end - ts));
+                if (ok && moment.isValid ()) {
+                    const char * msg = ts_end + 11;
+                    out.append (UserMsgEntry (
+                                    ty,
+                                    QString::fromUtf8 (msg, (int)(p + len - msg)),
+                                    moment));
+                    after_entry = true;
+                }
+            }
+        } else {
+            after_entry = false;
+        }
+
+        p = eol + 1;
+    }
+}
+/* ========================================================================= */
@@ -0,0 +1,98 @@
+/**
+ * @file usermsgreader.h
+ * @brief Declarations for UserMsgReader class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGREADER_H_INCLUDE
+#define GUARD_USERMSGREADER_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QDateTime>
+
+//! Reads the log files produced by UserMsgMan.
+class USERMSG_EXPORT UserMsgReader {
+
+public:
+
+    //! A point in the sparse time index.
+    struct IndexPoint {
+        qint64 moment; /**< milliseconds since epoch (UTC) */
+        qint64 offset; /**< byte offset of the line in the log file */
+    };
+
+    //! A range of bytes in a log file.
+    struct Range {
+        QString file; /**< path of the log file */
+        qint64 begin; /**< offset of the first byte */
+        qint64 end; /**< offset past the last byte; -1 for end of file */
+    };
+
+    //! The path of the index that goes with a log file.
+    static QString
+    indexPath (
+            const QString & log_file);
+
+    //! The files in the rotation set of a log file, oldest first.
+    static QStringList
+    rotationSet (
+            const QString & log_file);
+
+    //! The rolled (old) files of a log file, oldest first.
+    static QStringList
+    rolledFiles (
+            const QString & log_file);
+
+    //! The name a log file gets when it is rolled at \p moment.
+    static QString
+    rolledPath (
+            const QString & log_file,
+            const QDateTime & moment);
+
+    //! Load the time index of a log file.
+    static QVector<IndexPoint>
+    loadIndex (
+            const QString & log_file);
+
+    //! The parts of the rotation set that cover a time range.
+    static QVector<Range>
+    locate (
+            const QString & log_file,
+            const QDateTime & from,
+            const QDateTime & to);
+
+    //! Read the entries logged between two moments (inclusive).
+    static QVector<UserMsgEntry>
+    readEntries (
+            const QString & log_file,
+            const QDateTime & from,
+            const QDateTime & to);
+
+    //! Parse the lines in a buffer and append the entries to \p out.
+    static void
+    parseBuffer (
+            const char * data,
+            qint64 size,
+            QVector<UserMsgEntry> & out);
+
+    //! Parse a timestamp in the format used by the log.
+    static QDateTime
+    parseMoment (
+            const char * data,
+            int size);
+
+    //! The magic string at the start of an index file.
+    static const char
+    index_magic[8];
+
+};
+
+#endif // GUARD_USERMSGREADER_H_INCLUDE
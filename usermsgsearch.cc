@@ -0,0 +1,320 @@
+/**
+ * @file usermsgsearch.cc
+ * @brief Definitions for UserMsgSearch class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgsearch.h"
+#include "usermsgreader.h"
+#include "usermsg-private.h"
+
+#include <QFile>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QtAlgorithms>
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+/**
+ * @class UserMsgSearch
+ *
+ * Each file is mapped in memory and split in chunks that are searched
+ * in parallel on a private thread pool. Chunk boundaries are moved
+ * to the start of an entry, so an entry (including its continuation
+ * lines) always belongs to a single chunk and no entry is reported
+ * twice.
+ *
+ * For each occurrence of the needle the whole entry that contains it
+ * is parsed with UserMsgReader::parseBuffer() and the search resumes
+ * after that entry. The results are returned in the order in which
+ * they appear in the files, which is chronological order.
+ *
+ * The needle is matched against the bytes in the file (UTF-8), so
+ * the search is case sensitive and a needle that spans several lines
+ * of a message will not match. Only the text from the `: `
+ * separator of a line onward counts, so the moment and the type of an
+ * entry are never matched.
+ */
+
+//! Chunks are never smaller than this, to keep the overhead low.
+#define MIN_CHUNK_SIZE (1024 * 1024)
+
+//! Prefix of the lines that continue the message on previous line.
+static const char continuation[] = "                              : ";
+
+//! Length of continuation.
+#define CONTINUATION_LENGTH 32
+
+/* ------------------------------------------------------------------------- */
+static inline bool isContinuation (const char * p, const char * end)
+{
+    return (end - p >= CONTINUATION_LENGTH) &&
+            (memcmp (p, continuation, CONTINUATION_LENGTH) == 0);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! The start of the line after the one that contains \p p (or \p end).
+static inline const char * nextLine (const char * p, const char * end)
+{
+    const char * eol = (const char *)memchr (p, '\n', end - p);
+    return eol == NULL ? end : eol + 1;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! The first entry that starts at or after \p p.
+static const char * entryStart (
+        const char * begin, const char * p, const char * end)
+{
+    if ((p > begin) && (p[-1] != '\n')) {
+        p = nextLine (p, end);
+    }
+    while ((p < end) && isContinuation (p, end)) {
+        p = nextLine (p, end);
+    }
+    return p;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Searches a chunk of a mapped file.
+class UserMsgSearchTask : public QRunnable {
+
+public:
+    const char * begin_; /**< first byte of the chunk */
+    const char * end_; /**< past the last byte of the chunk */
+    const QByteArray * needle_; /**< what we're searching for */
+    QVector<UserMsgEntry> result_; /**< the entries that were found */
+
+    UserMsgSearchTask () :
+        QRunnable (),
+        begin_ (NULL),
+        end_ (NULL),
+        needle_ (NULL),
+        result_ ()
+    {
+        setAutoDelete (false);
+    }
+
+    void run ();
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSearchTask::run ()
+{
+    // separates the moment and the type from the message
+    static const QByteArray separator (": ");
+    const char * p = begin_;
+    while (p < end_) {
+        qint64 found = UserMsgSearch::find (p, end_ - p, *needle_);
+        if (found < 0)
+            break;
+        const char * hit = p + found;
+
+        // back to the start of the entry
+        const char * e_begin = hit;
+        while ((e_begin > begin_) && (e_begin[-1] != '\n'))
+            --e_begin;
+
+        // a hit in the moment or the type of the line is not a match
+        const char * sep_end = qMin (hit + separator.size (), end_);
+        if (UserMsgSearch::find (e_begin, sep_end - e_begin, separator) < 0) {
+            p = hit + 1;
+            continue;
+        }
+        while ((e_begin > begin_) && isContinuation (e_begin, end_)) {
+            --e_begin;
+            while ((e_begin > begin_) && (e_begin[-1] != '\n'))
+                --e_begin;
+        }
+
+        // forward to the end of the entry
+        const char * e_end = nextLine (hit, end_);
+        while ((e_end < end_) && isContinuation (e_end, end_)) {
+            e_end = nextLine (e_end, end_);
+        }
+
+        UserMsgReader::parseBuffer (e_begin, e_end - e_begin, result_);
+        p = e_end;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * When \p from or \p to are valid the time index is used to restrict
+ * the search to the parts of the files that may contain entries in
+ * that range, and the entries are filtered on their moment.
+ * An invalid \p from or \p to leaves that side of the range open.
+ *
+ * @param threads the number of threads to use; 0 uses
+ * QThread::idealThreadCount()
+ */
+QVector<UserMsgEntry> UserMsgSearch::search (
+        const QString & log_file, const QString & text,
+        const QDateTime & from, const QDateTime & to, int threads)
+{
+    QVector<UserMsgEntry> result;
+    QByteArray needle = text.toUtf8 ();
+    if (needle.isEmpty ())
+        return result;
+
+    if (!from.isValid () && !to.isValid ()) {
+        foreach(const QString & s_file, UserMsgReader::rotationSet (log_file)) {
+            result += searchFile (s_file, needle, 0, -1, threads);
+        }
+        return result;
+    }
+
+    QDateTime d_from = from.isValid () ? from :
+            QDateTime (QDate (1, 1, 1), QTime (0, 0), Qt::UTC);
+    QDateTime d_to = to.isValid () ? to :
+            QDateTime (QDate (9999, 12, 31), QTime (23, 59, 59, 999), Qt::UTC);
+    foreach(const UserMsgReader::Range & r,
+            UserMsgReader::locate (log_file, d_from, d_to)) {
+        foreach(const UserMsgEntry & e,
+                searchFile (r.file, needle, r.begin, r.end, threads)) {
+            if ((e.moment () >= d_from) && (e.moment () <= d_to)) {
+                result.append (e);
+            }
+        }
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @param begin offset of the first byte; should be the start of a line
+ * @param end offset past the last byte; -1 for the end of the file
+ */
+QVector<UserMsgEntry> UserMsgSearch::searchFile (
+        const QString & file, const QByteArray & needle,
+        qint64 begin, qint64 end, int threads)
+{
+    QVector<UserMsgEntry> result;
+    QFile f (file);
+    if (needle.isEmpty () || !f.open (QIODevice::ReadOnly))
+        return result;
+
+    qint64 size = f.size ();
+    if ((end < 0) || (end > size))
+        end = size;
+    if (begin < 0)
+        begin = 0;
+    if (end <= begin)
+        return result;
+
+    uchar * mapped = f.map (begin, end - begin);
+    if (mapped == NULL)
+        return result;
+    const char * data = (const char *)mapped;
+    const char * data_end = data + (end - begin);
+
+    if (threads <= 0)
+        threads = QThread::idealThreadCount ();
+    if (threads <= 0)
+        threads = 1;
+    qint64 chunk_size = (end - begin) / threads + 1;
+    if (chunk_size < MIN_CHUNK_SIZE)
+        chunk_size = MIN_CHUNK_SIZE;
+
+    // split in chunks that start at an entry
+    QVector<UserMsgSearchTask*> tasks;
+    const char * p = data;
+    while (p < data_end) {
+        const char * c_end = data_end;
+        if (data_end - p > chunk_size) {
+            c_end = entryStart (data, p + chunk_size, data_end);
+        }
+        UserMsgSearchTask * task = new UserMsgSearchTask ();
+        task->begin_ = p;
+        task->end_ = c_end;
+        task->needle_ = &needle;
+        tasks.append (task);
+        p = c_end;
+    }
+
+    if (tasks.count () == 1) {
+        tasks.first ()->run ();
+    } else {
+        QThreadPool pool;
+        pool.setMaxThreadCount (threads);
+        foreach(UserMsgSearchTask * task, tasks) {
+            pool.start (task);
+        }
+        pool.waitForDone ();
+    }
+
+    foreach(UserMsgSearchTask * task, tasks) {
+        result += task->result_;
+    }
+    qDeleteAll (tasks);
+
+    f.unmap (mapped);
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * With SSE2 sixteen candidate positions are tested at once by
+ * comparing both the first and the last byte of the needle; only
+ * the positions where both match are compared in full. Without
+ * SSE2 memchr() is used to locate the candidates.
+ *
+ * @returns the offset of the first occurrence or -1 if not found
+ */
+qint64 UserMsgSearch::find (
+        const char * data, qint64 size, const QByteArray & needle)
+{
+    const char * n = needle.constData ();
+    qint64 k = needle.size ();
+    if ((k == 0) || (k > size))
+        return k == 0 ? 0 : -1;
+
+    qint64 i = 0;
+#if defined(__SSE2__)
+    if (k > 1) {
+        const __m128i first = _mm_set1_epi8 (n[0]);
+        const __m128i last = _mm_set1_epi8 (n[k - 1]);
+        for (; i + k - 1 + 16 <= size; i += 16) {
+            __m128i b_first = _mm_loadu_si128 ((const __m128i *)(data + i));
+            __m128i b_last = _mm_loadu_si128 (
+                        (const __m128i *)(data + i + k - 1));
+            quint32 mask = (quint32)_mm_movemask_epi8 (_mm_and_si128 (
+                        _mm_cmpeq_epi8 (first, b_first),
+                        _mm_cmpeq_epi8 (last, b_last)));
+            while (mask != 0) {
+                qint64 pos = i + qCountTrailingZeroBits (mask);
+                if (memcmp (data + pos + 1, n + 1, k - 2) == 0)
+                    return pos;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    const char * end = data + size - k + 1;
+    const char * p = data + i;
+    while (p < end) {
+        p = (const char *)memchr (p, n[0], end - p);
+        if (p == NULL)
+            return -1;
+        if (memcmp (p + 1, n + 1, k - 1) == 0)
+            return p - data;
+        ++p;
+    }
+    return -1;
+}
+/* ========================================================================= */
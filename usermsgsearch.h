@@ -0,0 +1,53 @@
+/**
+ * @file usermsgsearch.h
+ * @brief Declarations for UserMsgSearch class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGSEARCH_H_INCLUDE
+#define GUARD_USERMSGSEARCH_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgentry.h>
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QString>
+#include <QVector>
+
+//! Full-text search over the log files produced by UserMsgMan.
+class USERMSG_EXPORT UserMsgSearch {
+
+public:
+
+    //! Search the rotation set of a log file.
+    static QVector<UserMsgEntry>
+    search (
+            const QString & log_file,
+            const QString & text,
+            const QDateTime & from = QDateTime (),
+            const QDateTime & to = QDateTime (),
+            int threads = 0);
+
+    //! Search a range of bytes in a single file.
+    static QVector<UserMsgEntry>
+    searchFile (
+            const QString & file,
+            const QByteArray & needle,
+            qint64 begin = 0,
+            qint64 end = -1,
+            int threads = 0);
+
+    //! Find the first occurence of \p needle in \p data.
+    static qint64
+    find (
+            const char * data,
+            qint64 size,
+            const QByteArray & needle);
+
+};
+
+#endif // GUARD_USERMSGSEARCH_H_INCLUDE
@@ -0,0 +1,543 @@
+/**
+ * @file usermsgshm.cc
+ * @brief Definitions for UserMsgShmRing and UserMsgShmSink classes.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgshm.h"
+#include "usermsg-private.h"
+
+#include <QAtomicInteger>
+#include <QDir>
+#include <QFile>
+
+#include <atomic>
+#include <string.h>
+
+#if defined(Q_OS_UNIX)
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <signal.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+/**
+ * @class UserMsgShmRing
+ *
+ * The shared memory object starts with a header (UserMsgShmHeader)
+ * followed by the ring. The producer advances `head` and the consumer
+ * advances `tail`; both only grow, and the position in the ring is the
+ * counter modulo the capacity. There is exactly one producer (the
+ * sink, called under the lock of UserMsgMan) and one consumer (the
+ * collector), so the ring needs no lock and the producer never makes
+ * a system call for a message. When the ring is full the entry is
+ * dropped and counted.
+ *
+ * Each record is a 32-bit length followed by the entry: the moment
+ * (milliseconds since epoch, UTC), the type, the message in UTF-8 and
+ * the typed fields. Values are stored with the byte order of the host.
+ *
+ * Only POSIX systems are supported; elsewhere create() and attach()
+ * fail.
+ */
+
+/**
+ * @class UserMsgShmSink
+ *
+ * Register an instance with UserMsgMan::addSink() and run
+ * `usermsg_collect` to gather the entries of all the processes
+ * on the host in a single log file.
+ */
+
+//! Placed at the start of the shared memory object.
+struct UserMsgShmHeader {
+    char magic [8]; /**< UMSGSHM1; written last by the producer */
+    quint64 capacity; /**< size of the ring in bytes */
+    qint64 pid; /**< the process that created the ring */
+    QAtomicInteger<quint64> head; /**< bytes written by the producer */
+    QAtomicInteger<quint64> tail; /**< bytes read by the consumer */
+    QAtomicInteger<quint64> dropped; /**< entries that did not fit */
+};
+
+//! The magic string at the start of the shared memory.
+static const char shm_magic [8] = {
+    'U', 'M', 'S', 'G', 'S', 'H', 'M', '1'
+};
+
+//! Size of the length that precedes each record.
+#define RECORD_LENGTH_SIZE 4
+
+/* ------------------------------------------------------------------------- */
+template <typename T>
+static inline void appendValue (QByteArray & out, T value)
+{
+    out.append ((const char *)&value, (int)sizeof(T));
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+//! Reads values from a record, keeping track of the remaining bytes.
+struct UserMsgShmReader {
+    const char * p; /**< next byte */
+    const char * end; /**< past the last byte */
+    bool ok; /**< false once a read went past the end */
+
+    template <typename T>
+    T value () {
+        T result = T();
+        if (end - p < (qint64)sizeof(T)) {
+            ok = false;
+            return result;
+        }
+        memcpy (&result, p, sizeof(T));
+        p += sizeof(T);
+        return result;
+    }
+
+    const char * bytes (quint32 len) {
+        if ((quint64)(end - p) < len) {
+            ok = false;
+            return NULL;
+        }
+        const char * result = p;
+        p += len;
+        return result;
+    }
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void encodeEntry (const UserMsgEntry & e, QByteArray & out)
+{
+    QByteArray message = e.message ().toUtf8 ();
+    appendValue<qint64> (out, e.moment ().toMSecsSinceEpoch ());
+    appendValue<qint32> (out, (qint32)e.type ());
+    appendValue<quint32> (out, (quint32)message.size ());
+    out.append (message);
+
+    const QVector<UserMsgEntry::Field> & fields = e.fields ();
+    appendValue<quint16> (out, (quint16)fields.count ());
+    foreach(const UserMsgEntry::Field & f, fields) {
+        quint16 key_len = (quint16)f.key.size ();
+        appendValue<quint16> (out, key_len);
+        out.append (f.key.constData (), key_len);
+        appendValue<quint8> (out, (quint8)f.kind);
+        switch (f.kind) {
+        case UserMsgEntry::FINT64: {
+            appendValue<qint64> (out, f.value.i);
+            break; }
+        case UserMsgEntry::FDOUBLE: {
+            appendValue<double> (out, f.value.d);
+            break; }
+        case UserMsgEntry::FBOOL: {
+            appendValue<quint8> (out, f.value.b ? 1 : 0);
+            break; }
+        default: {
+            QByteArray text = f.text.toUtf8 ();
+            appendValue<quint32> (out, (quint32)text.size ());
+            out.append (text);
+            break; }
+        }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static bool decodeEntry (const char * data, quint32 len, UserMsgEntry & e)
+{
+    UserMsgShmReader r;
+    r.p = data;
+    r.end = data + len;
+    r.ok = true;
+
+    qint64 moment = r.value<qint64> ();
+    qint32 ty = r.value<qint32> ();
+    quint32 msg_len = r.value<quint32> ();
+    const char * msg = r.bytes (msg_len);
+    if (!r.ok || (ty < UserMsgEntry::UTERROR) || (ty > UserMsgEntry::UTDBG_INFO))
+        return false;
+
+    e = UserMsgEntry (
+                (UserMsgEntry::Type)ty,
+                QString::fromUtf8 (msg, (int)msg_len),
+                QDateTime::fromMSecsSinceEpoch (moment));
+
+    quint16 count = r.value<quint16> ();
+    for (quint16 i = 0; (i < count) && r.ok; ++i) {
+        quint16 key_len = r.value<quint16> ();
+        const char * key = r.bytes (key_len);
+        quint8 kind = r.value<quint8> ();
+        if (!r.ok)
+            break;
+        // the key is not terminated in the ring
+        QByteArray key_copy (key, key_len);
+        switch (kind) {
+        case UserMsgEntry::FINT64: {
+            qint64 v = r.value<qint64> ();
+            if (r.ok) e.addField (key_copy.constData (), v);
+            break; }
+        case UserMsgEntry::FDOUBLE: {
+            double v = r.value<double> ();
+            if (r.ok) e.addField (key_copy.constData (), v);
+            break; }
+        case UserMsgEntry::FBOOL: {
+            bool v = r.value<quint8> () != 0;
+            if (r.ok) e.addField (key_copy.constData (), v);
+            break; }
+        case UserMsgEntry::FSTRING: {
+            quint32 text_len = r.value<quint32> ();
+            const char * text = r.bytes (text_len);
+            if (r.ok) e.addField (key_copy.constData (), QString::fromUtf8 (text, (int)text_len));
+            break; }
+        default: {
+            r.ok = false;
+            break; }
+        }
+    }
+    return r.ok;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgShmRing::UserMsgShmRing () :
+    name_ (),
+    header_ (NULL),
+    data_ (NULL),
+    capacity_ (0),
+    map_size_ (0),
+    scratch_ ()
+{
+    USERMSG_TRACE_ENTRY;
+    scratch_.reserve (1024);
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The shared memory object is not removed, so that the collector can
+ * read the entries that are still in the ring; the collector removes
+ * it once the producer has exited.
+ */
+UserMsgShmRing::~UserMsgShmRing()
+{
+    USERMSG_TRACE_ENTRY;
+    close ();
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * An existing object with the same name is replaced.
+ *
+ * @param name the name of the object; starts with a slash
+ * @param capacity the size of the ring in bytes; rounded up to a
+ * power of two
+ */
+bool UserMsgShmRing::create (const QString & name, int capacity)
+{
+    close ();
+#if defined(Q_OS_UNIX)
+    quint64 cap = 4096;
+    while ((cap < (quint64)capacity) && (cap < (1ULL << 30)))
+        cap <<= 1;
+    quint64 size = sizeof(UserMsgShmHeader) + cap;
+
+    QByteArray s_name = QFile::encodeName (name);
+    int fd = shm_open (s_name.constData (), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1)
+        return false;
+    if ((ftruncate (fd, (off_t)size) != 0) || !mapObject (fd, size)) {
+        ::close (fd);
+        shm_unlink (s_name.constData ());
+        return false;
+    }
+    ::close (fd);
+
+    name_ = name;
+    header_->capacity = cap;
+    header_->pid = (qint64)getpid ();
+    header_->head.store (0);
+    header_->tail.store (0);
+    header_->dropped.store (0);
+    capacity_ = cap;
+    std::atomic_thread_fence (std::memory_order_release);
+    memcpy (header_->magic, shm_magic, sizeof(shm_magic));
+    return true;
+#else
+    Q_UNUSED(name);
+    Q_UNUSED(capacity);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Fails if the object does not exist or was not (yet) initialized
+ * by its producer.
+ */
+bool UserMsgShmRing::attach (const QString & name)
+{
+    close ();
+#if defined(Q_OS_UNIX)
+    QByteArray s_name = QFile::encodeName (name);
+    int fd = shm_open (s_name.constData (), O_RDWR, 0);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    bool b_ret = (fstat (fd, &st) == 0) &&
+            ((quint64)st.st_size > sizeof(UserMsgShmHeader)) &&
+            mapObject (fd, (quint64)st.st_size);
+    ::close (fd);
+    if (!b_ret)
+        return false;
+
+    if ((memcmp (header_->magic, shm_magic, sizeof(shm_magic)) != 0) ||
+            (header_->capacity + sizeof(UserMsgShmHeader) != (quint64)st.st_size) ||
+            ((header_->capacity & (header_->capacity - 1)) != 0)) {
+        close ();
+        return false;
+    }
+    name_ = name;
+    capacity_ = header_->capacity;
+    return true;
+#else
+    Q_UNUSED(name);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgShmRing::mapObject (int fd, quint64 size)
+{
+#if defined(Q_OS_UNIX)
+    void * p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    header_ = (UserMsgShmHeader *)p;
+    map_size_ = size;
+    data_ = (char *)p + sizeof(UserMsgShmHeader);
+    return true;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(size);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgShmRing::close (bool unlink)
+{
+#if defined(Q_OS_UNIX)
+    if (header_ != NULL) {
+        munmap (header_, (size_t)map_size_);
+    }
+    if (unlink && !name_.isEmpty ()) {
+        shm_unlink (QFile::encodeName (name_).constData ());
+    }
+#else
+    Q_UNUSED(unlink);
+#endif
+    header_ = NULL;
+    data_ = NULL;
+    capacity_ = 0;
+    map_size_ = 0;
+    name_.clear ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+qint64 UserMsgShmRing::ownerPid () const
+{
+    return header_ == NULL ? -1 : header_->pid;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgShmRing::isOwnerAlive () const
+{
+#if defined(Q_OS_UNIX)
+    if (header_ == NULL)
+        return false;
+    return (kill ((pid_t)header_->pid, 0) == 0) || (errno != ESRCH);
+#else
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+quint64 UserMsgShmRing::dropped () const
+{
+    return header_ == NULL ? 0 : header_->dropped.load ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgShmRing::copyIn (quint64 pos, const void * src, quint64 len)
+{
+    quint64 offset = pos & (capacity_ - 1);
+    quint64 first = capacity_ - offset;
+    if (first >= len) {
+        memcpy (data_ + offset, src, len);
+    } else {
+        memcpy (data_ + offset, src, first);
+        memcpy (data_, (const char *)src + first, len - first);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgShmRing::copyOut (quint64 pos, void * dst, quint64 len) const
+{
+    quint64 offset = pos & (capacity_ - 1);
+    quint64 first = capacity_ - offset;
+    if (first >= len) {
+        memcpy (dst, data_ + offset, len);
+    } else {
+        memcpy (dst, data_ + offset, first);
+        memcpy ((char *)dst + first, data_, len - first);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only one thread may push at a time.
+ *
+ * @returns false if the ring is not open or is full; in the latter
+ * case the entry is counted as dropped
+ */
+bool UserMsgShmRing::push (const UserMsgEntry & e)
+{
+    if (header_ == NULL)
+        return false;
+
+    scratch_.resize (0);
+    encodeEntry (e, scratch_);
+    quint64 len = (quint64)scratch_.size ();
+    quint64 need = RECORD_LENGTH_SIZE + len;
+
+    quint64 head = header_->head.load ();
+    quint64 tail = header_->tail.loadAcquire ();
+    if (need > capacity_ - (head - tail)) {
+        header_->dropped.fetchAndAddRelaxed (1);
+        return false;
+    }
+
+    quint32 len32 = (quint32)len;
+    copyIn (head, &len32, RECORD_LENGTH_SIZE);
+    copyIn (head + RECORD_LENGTH_SIZE, scratch_.constData (), len);
+    header_->head.storeRelease (head + need);
+    return true;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only one thread may pop at a time. A malformed record (the ring
+ * was corrupted) discards everything that is in the ring.
+ *
+ * @returns the number of entries that were appended to \p out
+ */
+int UserMsgShmRing::pop (QVector<UserMsgEntry> & out, int max)
+{
+    if (header_ == NULL)
+        return 0;
+
+    quint64 tail = header_->tail.load ();
+    quint64 head = header_->head.loadAcquire ();
+    int count = 0;
+    QByteArray record;
+    while ((tail + RECORD_LENGTH_SIZE <= head) && ((max < 0) || (count < max))) {
+        quint32 len;
+        copyOut (tail, &len, RECORD_LENGTH_SIZE);
+        if ((quint64)len + RECORD_LENGTH_SIZE > head - tail) {
+            tail = head;
+            break;
+        }
+        record.resize ((int)len);
+        copyOut (tail + RECORD_LENGTH_SIZE, record.data (), len);
+        tail += RECORD_LENGTH_SIZE + len;
+
+        UserMsgEntry e;
+        if (decodeEntry (record.constData (), len, e)) {
+            out.append (e);
+            ++count;
+        }
+    }
+    header_->tail.storeRelease (tail);
+    return count;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+QString UserMsgShmRing::defaultName ()
+{
+#if defined(Q_OS_UNIX)
+    return QString ("/usermsg.%1").arg ((qint64)getpid ());
+#else
+    return QString ("/usermsg");
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The rings are found by listing `/dev/shm`, where Linux keeps the
+ * POSIX shared memory objects; the names that start with `usermsg.`
+ * are returned. On other systems the list is empty.
+ */
+QStringList UserMsgShmRing::available ()
+{
+    QStringList result;
+    QDir d ("/dev/shm");
+    foreach(const QString & s_name,
+            d.entryList (QStringList () << "usermsg.*",
+                         QDir::Files | QDir::System | QDir::Hidden)) {
+        result.append (QChar ('/') + s_name);
+    }
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgShmSink::UserMsgShmSink (const QString & name, int capacity) :
+    UserMsgSink (),
+    ring_ ()
+{
+    USERMSG_TRACE_ENTRY;
+    if (!ring_.create (name, capacity)) {
+        USERMSG_DEBUGM ("Failed to create shared memory ring.\n");
+    }
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+UserMsgShmSink::~UserMsgShmSink()
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgShmSink::write (const UserMsg & um)
+{
+    int i_max = um.count ();
+    for (int i = 0; i < i_max; ++i) {
+        ring_.push (um.at (i));
+    }
+}
+/* ========================================================================= */
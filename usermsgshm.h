@@ -0,0 +1,178 @@
+/**
+ * @file usermsgshm.h
+ * @brief Declarations for UserMsgShmRing and UserMsgShmSink classes
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGSHM_H_INCLUDE
+#define GUARD_USERMSGSHM_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgsink.h>
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+struct UserMsgShmHeader;
+
+//! A ring buffer of entries in POSIX shared memory.
+class USERMSG_EXPORT UserMsgShmRing {
+
+private:
+
+    QString name_; /**< the name of the shared memory object */
+    UserMsgShmHeader * header_; /**< start of the mapped memory */
+    char * data_; /**< the ring itself, right after the header */
+    quint64 capacity_; /**< size of the ring in bytes (a power of two) */
+    quint64 map_size_; /**< size of the mapped memory */
+    QByteArray scratch_; /**< encoded record, reused */
+
+public:
+
+    //! Default constructor.
+    UserMsgShmRing ();
+
+    //! Destructor.
+    virtual ~UserMsgShmRing();
+
+
+    //! Create the ring as its producer.
+    bool
+    create (
+            const QString & name,
+            int capacity);
+
+    //! Open an existing ring as its consumer.
+    bool
+    attach (
+            const QString & name);
+
+    //! Unmap the ring and optionally remove the shared memory object.
+    void
+    close (
+            bool unlink = false);
+
+    //! Tell if the ring is mapped.
+    bool
+    isOpen () const {
+        return header_ != NULL;
+    }
+
+    //! The name of the shared memory object.
+    const QString &
+    name () const {
+        return name_;
+    }
+
+    //! The process that created the ring.
+    qint64
+    ownerPid () const;
+
+    //! Tell if the process that created the ring is still running.
+    bool
+    isOwnerAlive () const;
+
+    //! The number of entries that did not fit in the ring.
+    quint64
+    dropped () const;
+
+
+    //! Append an entry (producer side).
+    bool
+    push (
+            const UserMsgEntry & e);
+
+    //! Remove up to \p max entries and append them to \p out (consumer side).
+    int
+    pop (
+            QVector<UserMsgEntry> & out,
+            int max = -1);
+
+
+    //! The name used by default for the ring of this process.
+    static QString
+    defaultName ();
+
+    //! The names of the rings that exist on this host.
+    static QStringList
+    available ();
+
+private:
+
+    //! Map an open shared memory object.
+    bool
+    mapObject (
+            int fd,
+            quint64 size);
+
+    //! Copy bytes into the ring at a position (wraps around).
+    void
+    copyIn (
+            quint64 pos,
+            const void * src,
+            quint64 len);
+
+    //! Copy bytes out of the ring from a position (wraps around).
+    void
+    copyOut (
+            quint64 pos,
+            void * dst,
+            quint64 len) const;
+
+};
+
+//! Sends the logged entries to a shared memory ring.
+class USERMSG_EXPORT UserMsgShmSink : public UserMsgSink {
+
+private:
+
+    UserMsgShmRing ring_; /**< the ring */
+
+public:
+
+    //! Constructor; creates the ring.
+    UserMsgShmSink (
+            const QString & name = UserMsgShmRing::defaultName (),
+            int capacity = 1024 * 1024);
+
+    //! Destructor.
+    virtual ~UserMsgShmSink();
+
+
+    //! Tell if the ring was created.
+    bool
+    isOpen () const {
+        return ring_.isOpen ();
+    }
+
+    //! The ring used by this sink.
+    const UserMsgShmRing &
+    ring () const {
+        return ring_;
+    }
+
+    //! Append the entries of the message to the ring.
+    void
+    write (
+            const UserMsg & um);
+
+    //! Returns `shm`.
+    QString
+    name () const {
+        return QLatin1String ("shm");
+    }
+
+    //! The number of entries that did not fit in the ring.
+    quint64
+    dropped () const {
+        return ring_.dropped ();
+    }
+
+};
+
+#endif // GUARD_USERMSGSHM_H_INCLUDE
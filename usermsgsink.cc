@@ -0,0 +1,73 @@
+/**
+ * @file usermsgsink.cc
+ * @brief Definitions for UserMsgSink class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgsink.h"
+#include "usermsg-private.h"
+
+/**
+ * @class UserMsgSink
+ *
+ * Sinks are registered with UserMsgMan::addSink() and receive each
+ * message that is logged, right after it was written to the log file.
+ *
+ * write() and flush() are called while the manager holds its lock,
+ * so they are never called concurrently but they should return
+ * quickly and must not call back into the manager.
+ */
+
+/* ------------------------------------------------------------------------- */
+UserMsgSink::UserMsgSink ()
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The sink should be removed from the manager (UserMsgMan::removeSink())
+ * before it is destroyed.
+ */
+UserMsgSink::~UserMsgSink()
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The default implementation does nothing.
+ */
+void UserMsgSink::flush ()
+{
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The default implementation returns `sink`.
+ */
+QString UserMsgSink::name () const
+{
+    return QLatin1String ("sink");
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The default implementation returns 0.
+ */
+quint64 UserMsgSink::dropped () const
+{
+    return 0;
+}
+/* ========================================================================= */
@@ -0,0 +1,47 @@
+/**
+ * @file usermsgsink.h
+ * @brief Declarations for UserMsgSink class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGSINK_H_INCLUDE
+#define GUARD_USERMSGSINK_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsg.h>
+
+//! A destination for logged messages besides the log file.
+class USERMSG_EXPORT UserMsgSink {
+
+public:
+
+    //! Default constructor.
+    UserMsgSink ();
+
+    //! Destructor.
+    virtual ~UserMsgSink();
+
+
+    //! Receive a message that was logged.
+    virtual void
+    write (
+            const UserMsg & um) = 0;
+
+    //! Push the output that is buffered, if any.
+    virtual void
+    flush ();
+
+    //! A short name used in the statistics.
+    virtual QString
+    name () const;
+
+    //! The number of entries that could not be delivered.
+    virtual quint64
+    dropped () const;
+
+};
+
+#endif // GUARD_USERMSGSINK_H_INCLUDE
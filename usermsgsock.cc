@@ -0,0 +1,449 @@
+/**
+ * @file usermsgsock.cc
+ * @brief Definitions for UserMsgSocketSink class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgsock.h"
+#include "usermsgtime.h"
+#include "usermsg-private.h"
+
+#include <QFile>
+#include <QThread>
+#include <QtNumeric>
+
+#include <string.h>
+
+#if defined(Q_OS_UNIX)
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#   define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * @class UserMsgSocketSink
+ *
+ * Each entry becomes a JSON object on one line (NDJSON) with the
+ * type, the moment, the message and the typed fields; by default
+ * each line is also preceded by its length as a 32-bit big endian
+ * integer, so the collector can read whole records without scanning.
+ * The records are written to a Unix-domain stream socket.
+ *
+ * The socket is non-blocking, so the thread that logs never waits
+ * for the collector. Records are batched in a bounded buffer and
+ * sent once enough bytes are pending, once the oldest one is old
+ * enough or when flush() is called. While the collector is down the
+ * buffer keeps the records and the sink tries to reconnect, waiting
+ * twice as long after each failure (MIN_BACKOFF to MAX_BACKOFF).
+ * Records that do not fit in the buffer are dropped and counted.
+ *
+ * The age of the batch and the reconnection are checked by a
+ * thread of the sink as well, so the records are sent even if
+ * nothing else is logged.
+ *
+ * Only POSIX systems are supported; elsewhere the sink never connects.
+ */
+
+/* ------------------------------------------------------------------------- */
+//! The thread that sends the records of a quiet sink.
+class UserMsgSocketFlusher : public QThread {
+
+private:
+
+    UserMsgSocketSink * sink_; /**< the sink it works for */
+
+public:
+
+    //! Constructor.
+    UserMsgSocketFlusher (
+            UserMsgSocketSink * sink) :
+        QThread (),
+        sink_ (sink)
+    {}
+
+protected:
+
+    //! See UserMsgSocketSink::runFlusher().
+    void
+    run () {
+        sink_->runFlusher ();
+    }
+
+};
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @param path the path of the socket the collector listens on
+ * @param max_buffer the maximum number of bytes kept while the
+ * collector is not reachable
+ */
+UserMsgSocketSink::UserMsgSocketSink (const QString & path, int max_buffer) :
+    UserMsgSink (),
+    mutex_ (),
+    wake_ (),
+    flusher_ (NULL),
+    stop_ (false),
+    path_ (path),
+    fd_ (-1),
+    pending_ (),
+    sent_ (0),
+    max_buffer_ (max_buffer),
+    batch_size_ (16 * 1024),
+    batch_delay_ (100),
+    length_prefix_ (true),
+    backoff_ (MIN_BACKOFF),
+    next_attempt_ (0),
+    batch_started_ (0),
+    dropped_ (0),
+    clock_ ()
+{
+    USERMSG_TRACE_ENTRY;
+    clock_.start ();
+    pending_.reserve (batch_size_);
+    tryConnect ();
+    flusher_ = new UserMsgSocketFlusher (this);
+    flusher_->start (QThread::LowPriority);
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A last attempt is made to send the pending records.
+ */
+UserMsgSocketSink::~UserMsgSocketSink()
+{
+    USERMSG_TRACE_ENTRY;
+    mutex_.lock ();
+    stop_ = true;
+    wake_.wakeAll ();
+    mutex_.unlock ();
+    flusher_->wait ();
+    delete flusher_;
+
+    flush ();
+#if defined(Q_OS_UNIX)
+    if (fd_ != -1) {
+        ::close (fd_);
+    }
+#endif
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Wakes up every batch delay (MIN_BACKOFF if there is none) and
+ * sends the records once the oldest one is old enough or, while
+ * disconnected, tries to reconnect when the back-off allows it.
+ */
+void UserMsgSocketSink::runFlusher ()
+{
+    QMutexLocker locker (&mutex_);
+    while (!stop_) {
+        int delay = batch_delay_ > 0 ? batch_delay_ : (int)MIN_BACKOFF;
+        wake_.wait (&mutex_, (unsigned long)delay);
+        if (stop_ || pending_.isEmpty ())
+            continue;
+        if ((fd_ == -1) ||
+                (clock_.elapsed () - batch_started_ >= batch_delay_)) {
+            sendPending ();
+        }
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @warning The caller must acquire the lock itself.
+ */
+bool UserMsgSocketSink::tryConnect ()
+{
+#if defined(Q_OS_UNIX)
+    if (fd_ != -1)
+        return true;
+    if (clock_.elapsed () < next_attempt_)
+        return false;
+
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    QByteArray s_path = QFile::encodeName (path_);
+    if (s_path.isEmpty () || (s_path.size () >= (int)sizeof(addr.sun_path))) {
+        disconnect ();
+        return false;
+    }
+    memcpy (addr.sun_path, s_path.constData (), s_path.size ());
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        disconnect ();
+        return false;
+    }
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+#   if defined(SO_NOSIGPIPE)
+    int one = 1;
+    setsockopt (fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#   endif
+
+    if (::connect (fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ::close (fd);
+        disconnect ();
+        return false;
+    }
+    fd_ = fd;
+    backoff_ = MIN_BACKOFF;
+    return true;
+#else
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The pending records are kept; they are sent after reconnecting.
+ * A record that was partially sent is sent again from its start, so
+ * the collector should drop a truncated record when the connection
+ * closes.
+ */
+void UserMsgSocketSink::disconnect ()
+{
+#if defined(Q_OS_UNIX)
+    if (fd_ != -1) {
+        ::close (fd_);
+        fd_ = -1;
+    }
+#endif
+    compact ();
+    sent_ = 0;
+    next_attempt_ = clock_.elapsed () + backoff_;
+    backoff_ = backoff_ * 2;
+    if (backoff_ > MAX_BACKOFF)
+        backoff_ = MAX_BACKOFF;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Each record ends with a new line (new lines inside the JSON
+ * strings are escaped); with the length prefix the length is used
+ * because the prefix itself may contain that byte.
+ */
+int UserMsgSocketSink::recordEnd (int start) const
+{
+    if (length_prefix_) {
+        const uchar * p = (const uchar *)pending_.constData () + start;
+        quint32 len = ((quint32)p[0] << 24) | ((quint32)p[1] << 16) |
+                ((quint32)p[2] << 8) | (quint32)p[3];
+        return start + 4 + (int)len;
+    }
+    int eol = pending_.indexOf ('\n', start);
+    return eol == -1 ? pending_.size () : eol + 1;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSocketSink::compact ()
+{
+    int b = 0;
+    while (b < sent_) {
+        int e = recordEnd (b);
+        if (e > sent_)
+            break;
+        b = e;
+    }
+    if (b > 0) {
+        pending_.remove (0, b);
+        sent_ -= b;
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSocketSink::send ()
+{
+#if defined(Q_OS_UNIX)
+    while (sent_ < pending_.size ()) {
+        ssize_t n = ::send (fd_, pending_.constData () + sent_,
+                            pending_.size () - sent_, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent_ += (int)n;
+        } else if ((n == -1) && (errno == EINTR)) {
+            continue;
+        } else if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        } else {
+            disconnect ();
+            return;
+        }
+    }
+
+    if (sent_ == pending_.size ()) {
+        pending_.resize (0);
+        sent_ = 0;
+        batch_started_ = 0;
+    } else {
+        compact ();
+        batch_started_ = clock_.elapsed ();
+    }
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Never blocks; if the collector is not reachable the records
+ * stay in the buffer.
+ */
+void UserMsgSocketSink::write (const UserMsg & um)
+{
+    QMutexLocker locker (&mutex_);
+    int i_max = um.count ();
+    for (int i = 0; i < i_max; ++i) {
+        int start = pending_.size ();
+        if (length_prefix_) {
+            pending_.append ("\0\0\0\0", 4);
+        }
+        encodeJson (um.at (i), pending_);
+        int len = pending_.size () - start;
+        if (pending_.size () > max_buffer_) {
+            pending_.resize (start);
+            ++dropped_;
+            continue;
+        }
+        if (length_prefix_) {
+            quint32 payload = (quint32)(len - 4);
+            char * p = pending_.data () + start;
+            p[0] = (char)(payload >> 24);
+            p[1] = (char)(payload >> 16);
+            p[2] = (char)(payload >> 8);
+            p[3] = (char)payload;
+        }
+        if (start == 0) {
+            batch_started_ = clock_.elapsed ();
+        }
+    }
+
+    if (pending_.isEmpty ())
+        return;
+    if ((pending_.size () >= batch_size_) ||
+            (clock_.elapsed () - batch_started_ >= batch_delay_)) {
+        sendPending ();
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSocketSink::flush ()
+{
+    QMutexLocker locker (&mutex_);
+    sendPending ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @warning The caller must acquire the lock itself.
+ */
+void UserMsgSocketSink::sendPending ()
+{
+    if (pending_.isEmpty ())
+        return;
+    if (tryConnect ()) {
+        send ();
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void appendJsonString (QByteArray & out, const QString & s)
+{
+    static const char hex[] = "0123456789abcdef";
+    QByteArray utf8 = s.toUtf8 ();
+    out.append ('"');
+    const char * p = utf8.constData ();
+    const char * end = p + utf8.size ();
+    for (; p < end; ++p) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"') {
+            out.append ("\\\"", 2);
+        } else if (c == '\\') {
+            out.append ("\\\\", 2);
+        } else if (c == '\n') {
+            out.append ("\\n", 2);
+        } else if (c == '\r') {
+            out.append ("\\r", 2);
+        } else if (c == '\t') {
+            out.append ("\\t", 2);
+        } else if (c < 0x20) {
+            char esc [6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            out.append (esc, 6);
+        } else {
+            out.append ((char)c);
+        }
+    }
+    out.append ('"');
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The object ends with a new line. Non-finite floating point values
+ * are written as `null`.
+ */
+void UserMsgSocketSink::encodeJson (const UserMsgEntry & e, QByteArray & out)
+{
+    static const char * const labels [] = {
+        "error", "warning", "info", "derror", "dwarning", "debug"
+    };
+    int ty = (int)e.type ();
+    char date_buffer [UserMsgTime::ISO_MAX_LENGTH];
+    int date_len = UserMsgTime::formatIso (e.moment (), date_buffer, true);
+
+    out.append ("{\"type\":\"");
+    out.append ((ty >= 0) && (ty <= UserMsgEntry::UTDBG_INFO) ?
+                    labels[ty] : "null");
+    out.append ("\",\"moment\":\"");
+    out.append (date_buffer, date_len);
+    out.append ("\",\"message\":");
+    appendJsonString (out, e.message ());
+
+    const QVector<UserMsgEntry::Field> & fields = e.fields ();
+    if (!fields.isEmpty ()) {
+        out.append (",\"fields\":{");
+        bool first = true;
+        foreach(const UserMsgEntry::Field & f, fields) {
+            if (!first) out.append (',');
+            first = false;
+            appendJsonString (out, QString::fromUtf8 (f.key));
+            out.append (':');
+            switch (f.kind) {
+            case UserMsgEntry::FSTRING: {
+                appendJsonString (out, f.text);
+                break; }
+            case UserMsgEntry::FDOUBLE: {
+                if (qIsFinite (f.value.d)) out.append (f.toString ().toLatin1 ());
+                else out.append ("null");
+                break; }
+            default: {
+                out.append (f.toString ().toLatin1 ());
+                break; }
+            }
+        }
+        out.append ('}');
+    }
+    out.append ("}\n");
+}
+/* ========================================================================= */
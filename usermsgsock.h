@@ -0,0 +1,171 @@
+/**
+ * @file usermsgsock.h
+ * @brief Declarations for UserMsgSocketSink class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGSOCK_H_INCLUDE
+#define GUARD_USERMSGSOCK_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+#include <usermsg/usermsgsink.h>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QWaitCondition>
+
+class UserMsgSocketFlusher;
+
+//! Sends the logged entries to a local collector over a Unix socket.
+class USERMSG_EXPORT UserMsgSocketSink : public UserMsgSink {
+
+public:
+
+    enum {
+        //! first delay between two connection attempts (ms)
+        MIN_BACKOFF = 100,
+        //! longest delay between two connection attempts (ms)
+        MAX_BACKOFF = 30000
+    };
+
+private:
+
+    mutable QMutex mutex_; /**< protects the members below */
+    QWaitCondition wake_; /**< wakes the flusher thread */
+    UserMsgSocketFlusher * flusher_; /**< sends old records and reconnects */
+    bool stop_; /**< asks the flusher thread to exit */
+    QString path_; /**< path of the socket */
+    int fd_; /**< the socket; -1 when not connected */
+    QByteArray pending_; /**< records that were not sent, yet */
+    int sent_; /**< bytes at the start of pending_ already sent */
+    int max_buffer_; /**< upper limit for the size of pending_ */
+    int batch_size_; /**< send once this many bytes are pending */
+    int batch_delay_; /**< send once the oldest record is this old (ms) */
+    bool length_prefix_; /**< prefix each record with its length */
+    int backoff_; /**< current delay between connection attempts */
+    qint64 next_attempt_; /**< when to try to connect again (ms) */
+    qint64 batch_started_; /**< when the oldest pending record was added */
+    quint64 dropped_; /**< records that did not fit in the buffer */
+    QElapsedTimer clock_; /**< time source for the delays */
+
+public:
+
+    //! Constructor.
+    UserMsgSocketSink (
+            const QString & path,
+            int max_buffer = 1024 * 1024);
+
+    //! Destructor.
+    virtual ~UserMsgSocketSink();
+
+
+    //! Tell if the socket is connected.
+    bool
+    isConnected () const {
+        QMutexLocker locker (&mutex_);
+        return fd_ != -1;
+    }
+
+    //! The number of records that did not fit in the buffer.
+    quint64
+    dropped () const {
+        QMutexLocker locker (&mutex_);
+        return dropped_;
+    }
+
+    //! Returns `socket`.
+    QString
+    name () const {
+        return QLatin1String ("socket");
+    }
+
+    //! The number of bytes waiting to be sent.
+    int
+    pendingBytes () const {
+        QMutexLocker locker (&mutex_);
+        return pending_.size ();
+    }
+
+    //! Send once this many bytes are pending (0 sends each message).
+    void
+    setBatchSize (
+            int value) {
+        QMutexLocker locker (&mutex_);
+        batch_size_ = value;
+    }
+
+    //! Send once the oldest pending record is this old (ms).
+    void
+    setBatchDelay (
+            int value) {
+        QMutexLocker locker (&mutex_);
+        batch_delay_ = value;
+    }
+
+    //! Prefix each record with its length (4 bytes, big endian);
+    //! set before the first message is written.
+    void
+    setLengthPrefix (
+            bool value) {
+        QMutexLocker locker (&mutex_);
+        length_prefix_ = value;
+    }
+
+
+    //! Queue the entries of the message and send them if it is time.
+    void
+    write (
+            const UserMsg & um);
+
+    //! Send everything that is pending, if connected.
+    void
+    flush ();
+
+    //! Encode an entry as a JSON object on a single line.
+    static void
+    encodeJson (
+            const UserMsgEntry & e,
+            QByteArray & out);
+
+private:
+
+    friend class UserMsgSocketFlusher;
+
+    //! Send the old records and reconnect until asked to stop.
+    void
+    runFlusher ();
+
+    //! Send everything that is pending, if connected.
+    void
+    sendPending ();
+
+    //! Try to connect unless it is too early.
+    bool
+    tryConnect ();
+
+    //! Close the socket and schedule a new connection attempt.
+    void
+    disconnect ();
+
+    //! Send as much of pending_ as the socket accepts.
+    void
+    send ();
+
+    //! The offset past the record that starts at \p start in pending_.
+    int
+    recordEnd (
+            int start) const;
+
+    //! Remove the records that were sent completely.
+    void
+    compact ();
+
+};
+
+#endif // GUARD_USERMSGSOCK_H_INCLUDE
@@ -28,6 +28,14 @@
 
 static QString guard_string ("./guard/.");
 static QString ver2_string ("./ver2/.");
+static QString ver3_string ("./ver3/.");
+static QString ver4_string ("./ver4/.");
+static QString ver5_string ("./ver5/.");
+static QString ver6_string ("./ver6/.");
+static QString ver7_string ("./ver7/.");
+static QString ver8_string ("./ver8/.");
+static QString ver9_string ("./ver9/.");
+static QString ver10_string ("./ver10/.");
 
 enum TypeFlag {
     TF_NONE = 0x0000,
@@ -80,7 +88,18 @@ UserMsgStg::UserMsgStg() :
     enabled_flags_(TF_ALL_NON_DEBUG),
     s_log_file_(),
     log_count_ (10), // keep ten old logs
-    roll_trigger_ (1024*1024*2) // two megabytes log size by default
+    roll_trigger_ (1024*1024*2), // two megabytes log size by default
+    history_capacity_ (1000),
+    index_interval_ (256),
+    category_rules_ (),
+    sync_mode_ (SYNC_NONE),
+    sync_interval_ (1000),
+    coalesce_interval_ (0),
+    coalesce_errors_ (true),
+    show_handoff_ (false),
+    async_write_ (false),
+    max_total_size_ (0),
+    max_age_ (0)
 {
     USERMSG_TRACE_ENTRY;
 
@@ -96,7 +115,18 @@ UserMsgStg::UserMsgStg (const UserMsgStg & other) :
     enabled_flags_(other.enabled_flags_),
     s_log_file_(other.s_log_file_),
     log_count_(other.log_count_),
-    roll_trigger_(other.roll_trigger_)
+    roll_trigger_(other.roll_trigger_),
+    history_capacity_(other.history_capacity_),
+    index_interval_(other.index_interval_),
+    category_rules_(other.category_rules_),
+    sync_mode_(other.sync_mode_),
+    sync_interval_(other.sync_interval_),
+    coalesce_interval_(other.coalesce_interval_),
+    coalesce_errors_(other.coalesce_errors_),
+    show_handoff_(other.show_handoff_),
+    async_write_(other.async_write_),
+    max_total_size_(other.max_total_size_),
+    max_age_(other.max_age_)
 {
     USERMSG_TRACE_ENTRY;
 
@@ -135,6 +165,33 @@ QByteArray UserMsgStg::toByteArray () const
     out << log_count_;
     out << roll_trigger_;
     out << guard_string;
+    out << ver3_string;
+    out << history_capacity_;
+    out << guard_string;
+    out << ver4_string;
+    out << index_interval_;
+    out << guard_string;
+    out << ver5_string;
+    out << category_rules_;
+    out << guard_string;
+    out << ver6_string;
+    out << sync_mode_;
+    out << sync_interval_;
+    out << guard_string;
+    out << ver7_string;
+    out << coalesce_interval_;
+    out << coalesce_errors_;
+    out << guard_string;
+    out << ver8_string;
+    out << show_handoff_;
+    out << guard_string;
+    out << ver9_string;
+    out << async_write_;
+    out << guard_string;
+    out << ver10_string;
+    out << max_total_size_;
+    out << max_age_;
+    out << guard_string;
 
     USERMSG_TRACE_EXIT;
     return buffer.buffer ();
@@ -144,6 +201,11 @@ QByteArray UserMsgStg::toByteArray () const
 /* ------------------------------------------------------------------------- */
 /**
  * The stream must begin and end with the marker.
+ *
+ * After the fields of the first version each later version adds
+ * a section that starts with its own marker and ends with the
+ * guard. Sections that are not known (written by a newer version)
+ * are ignored along with anything that follows them.
  */
 bool UserMsgStg::fromByteArray (QByteArray * value)
 {
@@ -163,11 +225,36 @@ bool UserMsgStg::fromByteArray (QByteArray * value)
     in >> enabled_flags_;
     in >> s_log_file_;
     in >> guard;
-    if (guard == ver2_string) {
-        // added on 2017-02-10; strings generated prior to this date
-        // will not have following fields:
-        in >> log_count_;
-        in >> roll_trigger_;
+    while ((guard == guard_string) && !in.atEnd ()) {
+        QString section;
+        in >> section;
+        if (section == ver2_string) {
+            // added on 2017-02-10; strings generated prior to this date
+            // will not have following fields:
+            in >> log_count_;
+            in >> roll_trigger_;
+        } else if (section == ver3_string) {
+            in >> history_capacity_;
+        } else if (section == ver4_string) {
+            in >> index_interval_;
+        } else if (section == ver5_string) {
+            in >> category_rules_;
+        } else if (section == ver6_string) {
+            in >> sync_mode_;
+            in >> sync_interval_;
+        } else if (section == ver7_string) {
+            in >> coalesce_interval_;
+            in >> coalesce_errors_;
+        } else if (section == ver8_string) {
+            in >> show_handoff_;
+        } else if (section == ver9_string) {
+            in >> async_write_;
+        } else if (section == ver10_string) {
+            in >> max_total_size_;
+            in >> max_age_;
+        } else {
+            break;
+        }
         in >> guard;
     }
     sanityCheck ();
@@ -195,6 +282,17 @@ bool UserMsgStg::toQSettings ( QSettings * stg) const
     stg->setValue ("s_log_file_", s_log_file_);
     stg->setValue ("log_count_", log_count_);
     stg->setValue ("roll_trigger_", roll_trigger_);
+    stg->setValue ("history_capacity_", history_capacity_);
+    stg->setValue ("index_interval_", index_interval_);
+    stg->setValue ("category_rules_", category_rules_);
+    stg->setValue ("sync_mode_", sync_mode_);
+    stg->setValue ("sync_interval_", sync_interval_);
+    stg->setValue ("coalesce_interval_", coalesce_interval_);
+    stg->setValue ("coalesce_errors_", coalesce_errors_);
+    stg->setValue ("show_handoff_", show_handoff_);
+    stg->setValue ("async_write_", async_write_);
+    stg->setValue ("max_total_size_", max_total_size_);
+    stg->setValue ("max_age_", max_age_);
 
     stg->endGroup ();
     USERMSG_TRACE_EXIT;
@@ -218,6 +316,17 @@ bool UserMsgStg::fromQSettings ( QSettings * stg)
         s_log_file_ = stg->value ("s_log_file_").toString ();
         log_count_ = stg->value ("log_count_", 10).toInt ();
         roll_trigger_ = stg->value ("roll_trigger_", 1024*1024*10).toInt ();
+        history_capacity_ = stg->value ("history_capacity_", 1000).toInt ();
+        index_interval_ = stg->value ("index_interval_", 256).toInt ();
+        category_rules_ = stg->value ("category_rules_").toStringList ();
+        sync_mode_ = stg->value ("sync_mode_", SYNC_NONE).toInt ();
+        sync_interval_ = stg->value ("sync_interval_", 1000).toInt ();
+        coalesce_interval_ = stg->value ("coalesce_interval_", 0).toInt ();
+        coalesce_errors_ = stg->value ("coalesce_errors_", true).toBool ();
+        show_handoff_ = stg->value ("show_handoff_", false).toBool ();
+        async_write_ = stg->value ("async_write_", false).toBool ();
+        max_total_size_ = stg->value ("max_total_size_", 0).toLongLong ();
+        max_age_ = stg->value ("max_age_", 0).toInt ();
 
         b_ret = true;
         break;
@@ -232,7 +341,7 @@ bool UserMsgStg::fromQSettings ( QSettings * stg)
 /* ========================================================================= */
 
 /* ------------------------------------------------------------------------- */
-bool UserMsgStg::isEnabled (UserMsgEntry::Type value)
+bool UserMsgStg::isEnabled (UserMsgEntry::Type value) const
 {
     TypeFlag tf = typeToFlag (value);
     return (enabled_flags_ & tf) != 0;
@@ -259,6 +368,82 @@ void UserMsgStg::setAllEnabled(bool include_debug)
 }
 /* ========================================================================= */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * Matches \p name against a pattern where `*` stands for any
+ * sequence of characters.
+ */
+static bool wildcardMatch (const QString & pattern, int p, const char * name)
+{
+    int p_max = pattern.length ();
+    while (p < p_max) {
+        QChar c = pattern.at (p);
+        if (c == '*') {
+            for (;;) {
+                if (wildcardMatch (pattern, p + 1, name))
+                    return true;
+                if (*name == 0)
+                    return false;
+                ++name;
+            }
+        }
+        if ((*name == 0) || (c != QChar (*name)))
+            return false;
+        ++p;
+        ++name;
+    }
+    return *name == 0;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The level is the most verbose type that is enabled: `off`, `error`,
+ * `warning`, `info` or `debug` (which also enables all debug types);
+ * a number is used as a mask.
+ *
+ * @returns -1 if the level is not valid
+ */
+static int levelToMask (const QString & level)
+{
+    if (level == QLatin1String ("off")) return TF_NONE;
+    if (level == QLatin1String ("error")) return TF_ERROR;
+    if (level == QLatin1String ("warning")) return TF_ERROR | TF_WARNING;
+    if (level == QLatin1String ("info")) return TF_ALL_NON_DEBUG;
+    if (level == QLatin1String ("debug")) return TF_ALL;
+    bool ok;
+    int result = level.toInt (&ok);
+    if (!ok || (result < 0))
+        return -1;
+    return result & TF_ALL;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Each rule has the form `pattern=level` (for example `net.*=debug`);
+ * see levelToMask() for the levels. The last rule that matches the
+ * name decides; if none does, the global flags (setEnabled()) apply.
+ * Malformed rules are ignored.
+ */
+int UserMsgStg::categoryMask (const char * name) const
+{
+    int result = enabled_flags_;
+    foreach(const QString & rule, category_rules_) {
+        int eq = rule.lastIndexOf (QChar ('='));
+        if (eq <= 0)
+            continue;
+        int mask = levelToMask (rule.mid (eq + 1).trimmed ());
+        if (mask < 0)
+            continue;
+        if (wildcardMatch (rule.left (eq).trimmed (), 0, name)) {
+            result = mask;
+        }
+    }
+    return result;
+}
+/* ========================================================================= */
+
 /* ------------------------------------------------------------------------- */
 void UserMsgStg::sanityCheck ()
 {
@@ -274,5 +459,35 @@ void UserMsgStg::sanityCheck ()
     } else if (roll_trigger_ > 1024*1024*1024*1) {
         roll_trigger_ = 1024*1024*10;
     }
+    // history_capacity_ sanity check
+    if (history_capacity_ < 0) {
+        history_capacity_ = 0;
+    } else if (history_capacity_ > 1000000) {
+        history_capacity_ = 1000000;
+    }
+    // index_interval_ sanity check
+    if (index_interval_ < 0) {
+        index_interval_ = 0;
+    }
+    // sync_mode_ and sync_interval_ sanity check
+    if ((sync_mode_ < SYNC_NONE) || (sync_mode_ >= SYNC_MAX)) {
+        sync_mode_ = SYNC_NONE;
+    }
+    if (sync_interval_ < 1) {
+        sync_interval_ = 1000;
+    }
+    // coalesce_interval_ sanity check
+    if (coalesce_interval_ < 0) {
+        coalesce_interval_ = 0;
+    } else if (coalesce_interval_ > 60000) {
+        coalesce_interval_ = 60000;
+    }
+    // max_total_size_ and max_age_ sanity check
+    if (max_total_size_ < 0) {
+        max_total_size_ = 0;
+    }
+    if (max_age_ < 0) {
+        max_age_ = 0;
+    }
 }
 /* ========================================================================= */
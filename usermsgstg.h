@@ -13,11 +13,25 @@
 #include <usermsg/usermsg-config.h>
 #include <usermsg/usermsg.h>
 
+#include <QStringList>
+
 class QSettings;
 
 //! User messages mediator settings.
 class USERMSG_EXPORT UserMsgStg {
 
+public:
+
+    //! How the log file is pushed to the disk (see UserMsgSync).
+    enum SyncMode {
+        SYNC_NONE = 0, /**< left to the operating system */
+        SYNC_PERIODIC, /**< fdatasync() every syncInterval() on a thread */
+        SYNC_ERRORS, /**< fdatasync() after each message with an error */
+        SYNC_DSYNC, /**< the file is opened with O_DSYNC */
+
+        SYNC_MAX /**< first invalid value */
+    };
+
 private:
 
     int enabled_flags_; /**< combination of 1 bit flags */
@@ -26,6 +40,24 @@ private:
                     log file on each start */
     int roll_trigger_; /**< size of the log file in bytes that
                        tells the program to start anew */
+    int history_capacity_; /**< number of recent entries kept in memory */
+    int index_interval_; /**< number of log entries between two points
+                         in the time index (0 disables the index) */
+    QStringList category_rules_; /**< `pattern=level` rules for
+                                 categories; the last match wins */
+    int sync_mode_; /**< one of the SyncMode values */
+    int sync_interval_; /**< milliseconds between two synchronizations
+                        in SYNC_PERIODIC mode */
+    int coalesce_interval_; /**< shown messages are merged and delivered
+                            at most this often (ms); 0 disables */
+    bool coalesce_errors_; /**< messages with errors are delivered at once */
+    bool show_handoff_; /**< messages shown from other threads are handed
+                        to the thread of the manager */
+    bool async_write_; /**< the log file is written by a background
+                       thread (see UserMsgAsyncWriter) */
+    qint64 max_total_size_; /**< bytes that the log files may use in
+                            total; 0 disables the limit */
+    int max_age_; /**< seconds an old log file is kept; 0 disables */
 
 public:
 
@@ -62,7 +94,7 @@ public:
     //! tells if a type is visible or not
     bool
     isEnabled (
-            UserMsgEntry::Type value);
+            UserMsgEntry::Type value) const;
 
     //! enables or disables the visibility of a type
     void
@@ -77,7 +109,7 @@ public:
 
     //! The path to the log file.
     const QString &
-    logFile () {
+    logFile () const {
         return s_log_file_;
     }
 
@@ -90,7 +122,7 @@ public:
 
     //! The number of old log files to keep around.
     int
-    oldLogFilesCount () {
+    oldLogFilesCount () const {
         return log_count_;
     }
 
@@ -103,7 +135,7 @@ public:
 
     //! Maximum size of the log file in bytes.
     int
-    maxLogFileSize () {
+    maxLogFileSize () const {
         return roll_trigger_;
     }
 
@@ -114,6 +146,156 @@ public:
         roll_trigger_ = value;
     }
 
+    //! The number of recent entries kept in memory (0 disables the history).
+    int
+    historyCapacity () const {
+        return history_capacity_;
+    }
+
+    //! The number of recent entries kept in memory (0 disables the history).
+    void
+    setHistoryCapacity (
+            int value) {
+        history_capacity_ = value;
+    }
+
+    //! Log entries between two points in the time index (0 disables it).
+    int
+    indexInterval () const {
+        return index_interval_;
+    }
+
+    //! Log entries between two points in the time index (0 disables it).
+    void
+    setIndexInterval (
+            int value) {
+        index_interval_ = value;
+    }
+
+    //! The rules that set the thresholds of categories.
+    const QStringList &
+    categoryRules () const {
+        return category_rules_;
+    }
+
+    //! The rules that set the thresholds of categories.
+    void
+    setCategoryRules (
+            const QStringList & value) {
+        category_rules_ = value;
+    }
+
+    //! How the log file is pushed to the disk.
+    SyncMode
+    syncMode () const {
+        return (SyncMode)sync_mode_;
+    }
+
+    //! How the log file is pushed to the disk.
+    void
+    setSyncMode (
+            SyncMode value) {
+        sync_mode_ = value;
+    }
+
+    //! Milliseconds between two synchronizations in SYNC_PERIODIC mode.
+    int
+    syncInterval () const {
+        return sync_interval_;
+    }
+
+    //! Milliseconds between two synchronizations in SYNC_PERIODIC mode.
+    void
+    setSyncInterval (
+            int value) {
+        sync_interval_ = value;
+    }
+
+    //! Deliver shown messages at most this often (ms; 0 delivers each).
+    int
+    coalesceInterval () const {
+        return coalesce_interval_;
+    }
+
+    //! Deliver shown messages at most this often (ms; 0 delivers each).
+    void
+    setCoalesceInterval (
+            int value) {
+        coalesce_interval_ = value;
+    }
+
+    //! Tell if messages with errors bypass coalescing.
+    bool
+    coalesceErrors () const {
+        return coalesce_errors_;
+    }
+
+    //! Tell if messages with errors bypass coalescing.
+    void
+    setCoalesceErrors (
+            bool value) {
+        coalesce_errors_ = value;
+    }
+
+    //! Tell if messages shown from other threads are delivered
+    //! in the thread of the manager.
+    bool
+    showHandoff () const {
+        return show_handoff_;
+    }
+
+    //! Deliver messages shown from other threads in the thread of
+    //! the manager.
+    void
+    setShowHandoff (
+            bool value) {
+        show_handoff_ = value;
+    }
+
+    //! Tell if the log file is written by a background thread.
+    bool
+    asyncWrite () const {
+        return async_write_;
+    }
+
+    //! Have the log file written by a background thread.
+    void
+    setAsyncWrite (
+            bool value) {
+        async_write_ = value;
+    }
+
+    //! Bytes that the log file and the old ones may use (0 for no limit).
+    qint64
+    maxTotalSize () const {
+        return max_total_size_;
+    }
+
+    //! Bytes that the log file and the old ones may use (0 for no limit).
+    void
+    setMaxTotalSize (
+            qint64 value) {
+        max_total_size_ = value;
+    }
+
+    //! Seconds an old log file is kept (0 for no limit).
+    int
+    maxAge () const {
+        return max_age_;
+    }
+
+    //! Seconds an old log file is kept (0 for no limit).
+    void
+    setMaxAge (
+            int value) {
+        max_age_ = value;
+    }
+
+    //! The types enabled for a category, one bit for each.
+    int
+    categoryMask (
+            const char * name) const;
+
 private:
 
     //! Checks the values and brings them to sane values if necessary.
@@ -0,0 +1,318 @@
+/**
+ * @file usermsgsync.cc
+ * @brief Definitions for UserMsgSync class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgsync.h"
+#include "usermsg-private.h"
+
+#include <QElapsedTimer>
+
+#if defined(Q_OS_UNIX)
+#   include <errno.h>
+#   include <unistd.h>
+#endif
+
+/**
+ * @class UserMsgSync
+ *
+ * The manager owns one instance. Depending on UserMsgStg::syncMode():
+ * - UserMsgStg::SYNC_NONE: nothing is done; the operating system
+ *   decides when the log reaches the disk;
+ * - UserMsgStg::SYNC_PERIODIC: the thread calls fdatasync() on the
+ *   log file every UserMsgStg::syncInterval() milliseconds if
+ *   anything was written in the meantime; the threads that log
+ *   never wait for the disk, but the last interval may be lost;
+ * - UserMsgStg::SYNC_ERRORS: the manager calls syncDuplicate() after
+ *   each message that contains an error, once it released its lock;
+ * - UserMsgStg::SYNC_DSYNC: the log file is opened with `O_DSYNC`,
+ *   so each write returns once the data is on the disk; the manager
+ *   records the time spent writing each message.
+ *
+ * In each mode the time spent waiting for the disk is accounted
+ * for in stats(); with UserMsgStg::asyncWrite() the time of the
+ * `O_DSYNC` writes is recorded by UserMsgAsyncWriter. The thread
+ * works on a duplicate of the log file handle, so the manager may
+ * close its own at any time, and never holds the mutex while it
+ * waits for the disk.
+ *
+ * A handle that is replaced by setHandle() while it has pending
+ * data (for example the log that was just rolled) is synchronized
+ * one last time by the thread, which is started for that if needed,
+ * so setHandle() never waits for the disk either.
+ *
+ * Only POSIX systems are supported; elsewhere the functions that
+ * synchronize do nothing and report failure.
+ */
+
+/* ------------------------------------------------------------------------- */
+UserMsgSync::UserMsgSync () :
+    QThread (),
+    mutex_ (),
+    wake_ (),
+    fd_ (-1),
+    retired_ (),
+    interval_ (1000),
+    periodic_ (false),
+    stop_ (false),
+    running_ (false),
+    dirty_ (0),
+    count_ (0),
+    total_ns_ (0),
+    max_ns_ (0),
+    last_ns_ (0)
+{
+    USERMSG_TRACE_ENTRY;
+
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Anything that was written since last synchronization is pushed
+ * to the disk.
+ */
+UserMsgSync::~UserMsgSync()
+{
+    USERMSG_TRACE_ENTRY;
+    stopPeriodic ();
+    setHandle (-1);
+    mutex_.lock ();
+    stop_ = true;
+    wake_.wakeAll ();
+    mutex_.unlock ();
+    wait ();
+    USERMSG_TRACE_EXIT;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The handle is duplicated. The file used before, if any, is given
+ * to the thread for a last synchronization if it has pending data,
+ * or closed.
+ */
+void UserMsgSync::setHandle (int fd)
+{
+#if defined(Q_OS_UNIX)
+    mutex_.lock ();
+    if (fd_ != -1) {
+        if (dirty_.fetchAndStoreAcquire (0) != 0) {
+            retired_.append (fd_);
+        } else {
+            ::close (fd_);
+        }
+        fd_ = -1;
+    }
+    if (fd != -1) {
+        fd_ = ::dup (fd);
+    }
+    _wakeThread (!retired_.isEmpty ());
+#else
+    Q_UNUSED(fd);
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * If the thread is already running only the interval is changed.
+ */
+void UserMsgSync::startPeriodic (int interval)
+{
+    mutex_.lock ();
+    interval_ = interval;
+    periodic_ = true;
+    _wakeThread (true);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Does not wait for the thread; it exits once the old handles, if
+ * any, were synchronized.
+ */
+void UserMsgSync::stopPeriodic ()
+{
+    mutex_.lock ();
+    periodic_ = false;
+    _wakeThread (false);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A thread that left its loop may still be finishing, so it is
+ * waited for before being started again (this is quick).
+ *
+ * @warning The caller must hold the mutex; it is released.
+ */
+void UserMsgSync::_wakeThread (bool has_work)
+{
+    bool start_thread = has_work && !running_ && !stop_;
+    if (start_thread) {
+        running_ = true;
+    }
+    wake_.wakeAll ();
+    mutex_.unlock ();
+    if (start_thread) {
+        wait ();
+        start (QThread::LowPriority);
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The mutex is released while a file is synchronized; the periodic
+ * synchronization works on its own duplicate of the handle, so
+ * setHandle() may replace the handle meanwhile.
+ */
+void UserMsgSync::run ()
+{
+    QMutexLocker locker (&mutex_);
+    for (;;) {
+        while (!retired_.isEmpty ()) {
+            int fd = retired_.takeFirst ();
+            locker.unlock ();
+            syncNow (fd);
+#if defined(Q_OS_UNIX)
+            ::close (fd);
+#endif
+            locker.relock ();
+        }
+        if (stop_ || !periodic_)
+            break;
+
+        wake_.wait (&mutex_, (unsigned long)interval_);
+        if (!periodic_ || (fd_ == -1) ||
+                (dirty_.fetchAndStoreAcquire (0) == 0))
+            continue;
+#if defined(Q_OS_UNIX)
+        int fd = ::dup (fd_);
+        if (fd == -1)
+            continue;
+        locker.unlock ();
+        syncNow (fd);
+        ::close (fd);
+        locker.relock ();
+#endif
+    }
+    running_ = false;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+bool UserMsgSync::syncNow (int fd)
+{
+    QElapsedTimer timer;
+    timer.start ();
+    bool b_ret = syncHandle (fd);
+    recordLatency (timer.nsecsElapsed ());
+    return b_ret;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The caller takes the duplicate while it may still use the handle
+ * of the file and synchronizes it later, without holding any lock.
+ */
+bool UserMsgSync::syncDuplicate (int fd)
+{
+    if (fd == -1)
+        return false;
+    bool b_ret = syncNow (fd);
+#if defined(Q_OS_UNIX)
+    ::close (fd);
+#endif
+    return b_ret;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSync::recordLatency (qint64 nsecs)
+{
+    quint64 value = nsecs < 0 ? 0 : (quint64)nsecs;
+    count_.fetchAndAddRelaxed (1);
+    total_ns_.fetchAndAddRelaxed (value);
+    last_ns_.store (value);
+    quint64 prev = max_ns_.load ();
+    while ((value > prev) && !max_ns_.testAndSetRelaxed (prev, value, prev)) {
+    }
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The fields are read one at a time, so a snapshot taken while other
+ * threads synchronize may be slightly inconsistent.
+ */
+UserMsgSyncStats UserMsgSync::stats () const
+{
+    UserMsgSyncStats result;
+    result.count = count_.load ();
+    result.total_ns = total_ns_.load ();
+    result.max_ns = max_ns_.load ();
+    result.last_ns = last_ns_.load ();
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgSync::resetStats ()
+{
+    count_.store (0);
+    total_ns_.store (0);
+    max_ns_.store (0);
+    last_ns_.store (0);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * `fdatasync()` is used where available, `fsync()` elsewhere.
+ */
+bool UserMsgSync::syncHandle (int fd)
+{
+#if defined(Q_OS_UNIX)
+    if (fd == -1)
+        return false;
+    int ret;
+    do {
+#   if defined(Q_OS_LINUX)
+        ret = ::fdatasync (fd);
+#   else
+        ret = ::fsync (fd);
+#   endif
+    } while ((ret == -1) && (errno == EINTR));
+    return ret == 0;
+#else
+    Q_UNUSED(fd);
+    return false;
+#endif
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @returns -1 if the handle could not be duplicated or if the
+ * platform is not supported.
+ */
+int UserMsgSync::duplicate (int fd)
+{
+#if defined(Q_OS_UNIX)
+    if (fd == -1)
+        return -1;
+    return ::dup (fd);
+#else
+    Q_UNUSED(fd);
+    return -1;
+#endif
+}
+/* ========================================================================= */
@@ -0,0 +1,127 @@
+/**
+ * @file usermsgsync.h
+ * @brief Declarations for UserMsgSync class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGSYNC_H_INCLUDE
+#define GUARD_USERMSGSYNC_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+//! The cost of keeping the log file on disk.
+struct UserMsgSyncStats {
+    quint64 count; /**< number of measured synchronizations */
+    quint64 total_ns; /**< time spent in them */
+    quint64 max_ns; /**< the slowest one */
+    quint64 last_ns; /**< the most recent one */
+};
+
+//! Pushes the log file to the disk according to UserMsgStg::SyncMode.
+class USERMSG_EXPORT UserMsgSync : public QThread {
+
+private:
+
+    QMutex mutex_; /**< protects the members up to dirty_ */
+    QWaitCondition wake_; /**< wakes the thread early */
+    int fd_; /**< duplicate of the log file handle; -1 if none */
+    QVector<int> retired_; /**< old handles waiting for a last sync */
+    int interval_; /**< time between two synchronizations (ms) */
+    bool periodic_; /**< synchronize fd_ every interval_ */
+    bool stop_; /**< asks the thread to exit */
+    bool running_; /**< the thread is (or is about to be) in run() */
+    QAtomicInt dirty_; /**< something was written since last sync */
+
+    QAtomicInteger<quint64> count_; /**< see UserMsgSyncStats */
+    QAtomicInteger<quint64> total_ns_; /**< see UserMsgSyncStats */
+    QAtomicInteger<quint64> max_ns_; /**< see UserMsgSyncStats */
+    QAtomicInteger<quint64> last_ns_; /**< see UserMsgSyncStats */
+
+public:
+
+    //! Default constructor.
+    UserMsgSync ();
+
+    //! Destructor; stops the thread.
+    virtual ~UserMsgSync();
+
+
+    //! The file to synchronize periodically (-1 for none).
+    void
+    setHandle (
+            int fd);
+
+    //! Start synchronizing every \p interval milliseconds.
+    void
+    startPeriodic (
+            int interval);
+
+    //! Stop synchronizing periodically.
+    void
+    stopPeriodic ();
+
+    //! Tell the thread that new data was written.
+    void
+    markDirty () {
+        dirty_.storeRelease (1);
+    }
+
+    //! Synchronize a file now and account for the time it took.
+    bool
+    syncNow (
+            int fd);
+
+    //! Synchronize and close a handle returned by duplicate().
+    bool
+    syncDuplicate (
+            int fd);
+
+    //! Account for time spent making the data durable.
+    void
+    recordLatency (
+            qint64 nsecs);
+
+    //! A copy of the statistics.
+    UserMsgSyncStats
+    stats () const;
+
+    //! Start the statistics anew.
+    void
+    resetStats ();
+
+
+    //! Push the data (not necessarily the metadata) of a file to the disk.
+    static bool
+    syncHandle (
+            int fd);
+
+    //! A handle to the same file that stays valid when \p fd is closed.
+    static int
+    duplicate (
+            int fd);
+
+protected:
+
+    //! The periodic synchronization and the last one of old handles.
+    void
+    run ();
+
+private:
+
+    //! Start the thread if it has work and is not running.
+    void
+    _wakeThread (
+            bool has_work);
+
+};
+
+#endif // GUARD_USERMSGSYNC_H_INCLUDE
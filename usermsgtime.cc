@@ -0,0 +1,148 @@
+/**
+ * @file usermsgtime.cc
+ * @brief Definitions for UserMsgTime class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgtime.h"
+#include "usermsg-private.h"
+
+#include <string.h>
+
+/**
+ * @class UserMsgTime
+ *
+ * The output is identical to `QDateTime::toString (Qt::ISODate)`
+ * (or `Qt::ISODateWithMs` when milliseconds are requested) but
+ * the digits are written straight into a caller-provided buffer.
+ *
+ * Each thread remembers the `YYYY-MM-DDTHH:MM:SS` part of the
+ * last second that it formatted, so entries produced in the
+ * same second only pay for a copy of that prefix, the
+ * sub-second digits and the time zone suffix.
+ */
+
+//! Length of the `YYYY-MM-DDTHH:MM:SS` part.
+#define ISO_PREFIX_LENGTH 19
+
+//! The cache kept by each thread.
+struct IsoPrefixCache {
+    qint64 key; /**< julian day and second of the day; -1 for none */
+    char text [ISO_PREFIX_LENGTH]; /**< formatted prefix */
+};
+
+static thread_local IsoPrefixCache iso_cache = { -1, { 0 } };
+
+/* ------------------------------------------------------------------------- */
+static inline void writeTwo (char * p, int value)
+{
+    p[0] = (char)('0' + value / 10);
+    p[1] = (char)('0' + value % 10);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Uses `QDateTime::toString()` for values that the fast path does
+ * not cover (years outside 0 - 9999).
+ */
+static int slowFormat (
+        const QDateTime & moment, char * buffer, bool with_msecs)
+{
+    QByteArray ba = moment.toString (
+                with_msecs ? Qt::ISODateWithMs : Qt::ISODate).toLatin1 ();
+    int len = qMin (ba.size (), (int)UserMsgTime::ISO_MAX_LENGTH);
+    memcpy (buffer, ba.constData (), len);
+    return len;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The buffer must have room for at least ISO_MAX_LENGTH characters;
+ * it is not null-terminated.
+ *
+ * @returns the number of characters that were written; an invalid
+ * \p moment produces an empty result, just like QDateTime does.
+ */
+int UserMsgTime::formatIso (
+        const QDateTime & moment, char * buffer, bool with_msecs)
+{
+    if (!moment.isValid ())
+        return 0;
+
+    QDate dt = moment.date ();
+    int msecs = moment.time ().msecsSinceStartOfDay ();
+    qint64 key = dt.toJulianDay () * 86400 + msecs / 1000;
+
+    if (key != iso_cache.key) {
+        int year, month, day;
+        dt.getDate (&year, &month, &day);
+        if ((year < 0) || (year > 9999)) {
+            return slowFormat (moment, buffer, with_msecs);
+        }
+
+        int secs = msecs / 1000;
+        char * p = iso_cache.text;
+        writeTwo (p, year / 100);
+        writeTwo (p + 2, year % 100);
+        p[4] = '-';
+        writeTwo (p + 5, month);
+        p[7] = '-';
+        writeTwo (p + 8, day);
+        p[10] = 'T';
+        writeTwo (p + 11, secs / 3600);
+        p[13] = ':';
+        writeTwo (p + 14, (secs / 60) % 60);
+        p[16] = ':';
+        writeTwo (p + 17, secs % 60);
+        iso_cache.key = key;
+    }
+
+    memcpy (buffer, iso_cache.text, ISO_PREFIX_LENGTH);
+    int len = ISO_PREFIX_LENGTH;
+
+    if (with_msecs) {
+        int ms = msecs % 1000;
+        buffer[len++] = '.';
+        buffer[len++] = (char)('0' + ms / 100);
+        writeTwo (buffer + len, ms % 100);
+        len += 2;
+    }
+
+    switch (moment.timeSpec ()) {
+    case Qt::LocalTime: {
+        break; }
+    case Qt::UTC: {
+        buffer[len++] = 'Z';
+        break; }
+    default: {
+        int offset = moment.offsetFromUtc ();
+        if (offset < 0) {
+            buffer[len++] = '-';
+            offset = -offset;
+        } else {
+            buffer[len++] = '+';
+        }
+        writeTwo (buffer + len, offset / 3600);
+        buffer[len + 2] = ':';
+        writeTwo (buffer + len + 3, (offset / 60) % 60);
+        len += 5;
+        break; }
+    }
+
+    return len;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+QString UserMsgTime::toIso (const QDateTime & moment, bool with_msecs)
+{
+    char buffer [ISO_MAX_LENGTH];
+    int len = formatIso (moment, buffer, with_msecs);
+    return QString::fromLatin1 (buffer, len);
+}
+/* ========================================================================= */
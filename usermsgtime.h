@@ -0,0 +1,43 @@
+/**
+ * @file usermsgtime.h
+ * @brief Declarations for UserMsgTime class
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGTIME_H_INCLUDE
+#define GUARD_USERMSGTIME_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+
+#include <QString>
+#include <QDateTime>
+
+//! Fast formatting of timestamps.
+class USERMSG_EXPORT UserMsgTime {
+
+public:
+
+    enum {
+        //! the size of a buffer large enough for any output
+        ISO_MAX_LENGTH = 32
+    };
+
+    //! Writes the ISO-8601 form of \p moment into \p buffer.
+    static int
+    formatIso (
+            const QDateTime & moment,
+            char * buffer,
+            bool with_msecs = false);
+
+    //! Same as formatIso() but the result is a string.
+    static QString
+    toIso (
+            const QDateTime & moment,
+            bool with_msecs = false);
+
+};
+
+#endif // GUARD_USERMSGTIME_H_INCLUDE
@@ -0,0 +1,272 @@
+/**
+ * @file usermsgtrace.cc
+ * @brief Definitions for UserMsgTrace class.
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#include "usermsgtrace.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QVector>
+
+/**
+ * @class UserMsgTrace
+ *
+ * When the library is configured with `-DUSERMSG_TRACE=ON` each
+ * USERMSG_TRACE_ENTRY places a UserMsgTraceScope in the function,
+ * so every instrumented function becomes a complete event (`"ph":"X"`)
+ * once recording is enabled with setEnabled(). Otherwise the macros
+ * expand to nothing and nothing is recorded.
+ *
+ * Each thread appends to its own buffer without taking any lock;
+ * when the buffer is full further events are dropped and counted.
+ * The buffers outlive their threads, so toChromeJson() also sees the
+ * threads that have exited; the buffer of an exited thread is given
+ * to a new thread only after clear().
+ *
+ * The output can be opened with chrome://tracing or Perfetto.
+ *
+ * This file must not use the trace macros itself.
+ */
+
+/**
+ * @class UserMsgTraceScope
+ *
+ * While recording is off the scope costs a load and a branch.
+ */
+
+QAtomicInt UserMsgTrace::enabled_ (0);
+
+//! A scope that was recorded.
+struct UserMsgTraceEvent {
+    const char * name; /**< the scope */
+    qint64 begin; /**< when it was entered (ns) */
+    qint64 end; /**< when it was left (ns) */
+};
+
+//! The events of one thread.
+struct UserMsgTraceBuffer {
+    int tid; /**< the thread, as shown in the output */
+    QAtomicInt generation; /**< the clear() that this buffer has seen */
+    QAtomicInt count; /**< events that can be read */
+    QAtomicInt orphan; /**< the thread has exited */
+    UserMsgTraceEvent * events; /**< EVENTS_PER_THREAD slots */
+};
+
+//! Gives the buffer back when the thread exits.
+struct UserMsgTraceLocal {
+    UserMsgTraceBuffer * buffer; /**< the buffer of this thread */
+
+    ~UserMsgTraceLocal () {
+        if (buffer != NULL) {
+            buffer->orphan.storeRelease (1);
+        }
+    }
+};
+
+//! Protects the list of buffers.
+static QBasicMutex registry_mutex;
+
+//! All the buffers ever created; never freed.
+static QVector<UserMsgTraceBuffer*> * registry = NULL;
+
+//! Incremented by clear().
+static QAtomicInt generation (1);
+
+//! Source for UserMsgTraceBuffer::tid.
+static int last_tid = 0;
+
+//! Events that did not fit.
+static QAtomicInteger<quint64> dropped_events (0);
+
+static thread_local UserMsgTraceLocal local_buffer = { NULL };
+
+/* ------------------------------------------------------------------------- */
+/**
+ * A buffer left by a thread that exited is reused if its events
+ * were cleared since; otherwise a new one is allocated.
+ */
+static UserMsgTraceBuffer * localBuffer ()
+{
+    UserMsgTraceBuffer * result = local_buffer.buffer;
+    if (Q_LIKELY(result != NULL))
+        return result;
+
+    QMutexLocker locker (&registry_mutex);
+    if (registry == NULL) {
+        registry = new QVector<UserMsgTraceBuffer*> ();
+    }
+    int gen = generation.loadAcquire ();
+    foreach(UserMsgTraceBuffer * b, *registry) {
+        if (b->orphan.loadAcquire () && (b->generation.loadAcquire () != gen)) {
+            result = b;
+            break;
+        }
+    }
+    if (result == NULL) {
+        result = new UserMsgTraceBuffer ();
+        result->events = new UserMsgTraceEvent [UserMsgTrace::EVENTS_PER_THREAD];
+        registry->append (result);
+    }
+    result->tid = ++last_tid;
+    result->count.storeRelease (0);
+    result->generation.storeRelease (gen);
+    result->orphan.storeRelease (0);
+    local_buffer.buffer = result;
+    return result;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+void UserMsgTrace::setEnabled (bool value)
+{
+    enabled_.storeRelease (value ? 1 : 0);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Each thread empties its own buffer the next time it records an
+ * event; until then the old events are simply not exported. The
+ * registry lock keeps a buffer from being emptied while
+ * toChromeJson() reads it.
+ */
+void UserMsgTrace::clear ()
+{
+    generation.fetchAndAddOrdered (1);
+    dropped_events.store (0);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+quint64 UserMsgTrace::dropped ()
+{
+    return dropped_events.load ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The origin is the first call.
+ */
+qint64 UserMsgTrace::now ()
+{
+    static const struct Clock {
+        QElapsedTimer timer;
+        Clock () { timer.start (); }
+    } clock;
+    return clock.timer.nsecsElapsed ();
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Only the calling thread writes to its buffer; an event becomes
+ * visible to toChromeJson() once the count is published. Appending
+ * never touches the events already published, but emptying the
+ * buffer after clear() does, so that takes the registry lock and
+ * waits for an export in progress.
+ */
+void UserMsgTrace::record (const char * name, qint64 begin_ns, qint64 end_ns)
+{
+    UserMsgTraceBuffer * b = localBuffer ();
+    int gen = generation.loadAcquire ();
+    if (b->generation.load () != gen) {
+        QMutexLocker locker (&registry_mutex);
+        b->count.storeRelease (0);
+        b->generation.storeRelease (gen);
+    }
+    int n = b->count.load ();
+    if (n >= EVENTS_PER_THREAD) {
+        dropped_events.fetchAndAddRelaxed (1);
+        return;
+    }
+    UserMsgTraceEvent & e = b->events[n];
+    e.name = name;
+    e.begin = begin_ns;
+    e.end = end_ns;
+    b->count.storeRelease (n + 1);
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+static void appendJsonName (QByteArray & out, const char * name)
+{
+    out.append ('"');
+    for (const char * p = name; *p != 0; ++p) {
+        if ((*p == '"') || (*p == '\\')) {
+            out.append ('\\');
+            out.append (*p);
+        } else if ((unsigned char)*p >= 0x20) {
+            out.append (*p);
+        }
+    }
+    out.append ('"');
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Timestamps are in microseconds from the first recorded event of
+ * the process. Recording may continue while this runs; the events
+ * recorded meanwhile may or may not be included.
+ */
+QByteArray UserMsgTrace::toChromeJson ()
+{
+    QByteArray pid = QByteArray::number (QCoreApplication::applicationPid ());
+    QByteArray out;
+    out.append ("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+
+    QMutexLocker locker (&registry_mutex);
+    if (registry != NULL) {
+        int gen = generation.loadAcquire ();
+        foreach(UserMsgTraceBuffer * b, *registry) {
+            if (b->generation.loadAcquire () != gen)
+                continue;
+            int n = b->count.loadAcquire ();
+            QByteArray tid = QByteArray::number (b->tid);
+            for (int i = 0; i < n; ++i) {
+                const UserMsgTraceEvent & e = b->events[i];
+                if (!first) out.append (',');
+                first = false;
+                out.append ("\n{\"name\":");
+                appendJsonName (out, e.name);
+                out.append (",\"cat\":\"usermsg\",\"ph\":\"X\",\"ts\":");
+                out.append (QByteArray::number ((double)e.begin / 1000.0, 'f', 3));
+                out.append (",\"dur\":");
+                out.append (QByteArray::number ((double)(e.end - e.begin) / 1000.0, 'f', 3));
+                out.append (",\"pid\":");
+                out.append (pid);
+                out.append (",\"tid\":");
+                out.append (tid);
+                out.append ('}');
+            }
+        }
+    }
+    out.append ("\n]}\n");
+    return out;
+}
+/* ========================================================================= */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * The file is replaced atomically.
+ */
+bool UserMsgTrace::exportChrome (const QString & path)
+{
+    QSaveFile file (path);
+    if (!file.open (QIODevice::WriteOnly))
+        return false;
+    file.write (toChromeJson ());
+    return file.commit ();
+}
+/* ========================================================================= */
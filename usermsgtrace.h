@@ -0,0 +1,110 @@
+/**
+ * @file usermsgtrace.h
+ * @brief Declarations for UserMsgTrace and UserMsgTraceScope classes
+ * @author Nicu Tofan <nicu.tofan@gmail.com>
+ * @copyright Copyright 2014 piles contributors. All rights reserved.
+ * This file is released under the
+ * [MIT License](http://opensource.org/licenses/mit-license.html)
+ */
+
+#ifndef GUARD_USERMSGTRACE_H_INCLUDE
+#define GUARD_USERMSGTRACE_H_INCLUDE
+
+#include <usermsg/usermsg-config.h>
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+
+//! Records the time spent in scopes and exports it for chrome://tracing.
+class USERMSG_EXPORT UserMsgTrace {
+
+public:
+
+    enum {
+        //! events kept for each thread; later ones are dropped
+        EVENTS_PER_THREAD = 16 * 1024
+    };
+
+private:
+
+    static QAtomicInt enabled_; /**< recording is on */
+
+public:
+
+    //! Tell if the scopes are being recorded.
+    static inline bool
+    isEnabled () {
+        return enabled_.loadAcquire () != 0;
+    }
+
+    //! Start or stop recording.
+    static void
+    setEnabled (
+            bool value);
+
+    //! Forget the events recorded so far.
+    static void
+    clear ();
+
+    //! The number of events that did not fit in the buffers.
+    static quint64
+    dropped ();
+
+
+    //! A monotonic timestamp in nanoseconds.
+    static qint64
+    now ();
+
+    //! Record a scope of the calling thread.
+    static void
+    record (
+            const char * name,
+            qint64 begin_ns,
+            qint64 end_ns);
+
+
+    //! The events in Chrome trace-event JSON format.
+    static QByteArray
+    toChromeJson ();
+
+    //! Write the events to a file in Chrome trace-event JSON format.
+    static bool
+    exportChrome (
+            const QString & path);
+};
+
+//! Records the scope where it lives, if tracing is enabled.
+class UserMsgTraceScope {
+
+private:
+
+    const char * name_; /**< the scope; NULL if not recording */
+    qint64 begin_; /**< when the scope was entered */
+
+public:
+
+    //! Constructor; \p name must have static storage.
+    explicit inline
+    UserMsgTraceScope (
+            const char * name) :
+        name_ (NULL),
+        begin_ (0)
+    {
+        if (Q_UNLIKELY(UserMsgTrace::isEnabled ())) {
+            name_ = name;
+            begin_ = UserMsgTrace::now ();
+        }
+    }
+
+    //! Destructor; records the scope.
+    inline
+    ~UserMsgTraceScope()
+    {
+        if (Q_UNLIKELY(name_ != NULL)) {
+            UserMsgTrace::record (name_, begin_, UserMsgTrace::now ());
+        }
+    }
+};
+
+#endif // GUARD_USERMSGTRACE_H_INCLUDE